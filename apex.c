@@ -0,0 +1,168 @@
+/*
+ *  apex.c
+ *  Embeddable step/query interface over the pipeline model
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex.h"
+#include "cosim.h"
+#include "cpu.h"
+
+_Static_assert(APEX_OCCUPANCY_STAGES == NUM_STAGES,
+               "apex_occupancy must cover every stage latch");
+
+APEX_CPU *apex_create(const char *program, size_t length, const char *options)
+{
+  APEX_Config config;
+  APEX_config_default(&config);
+
+  if (options)
+  {
+    char *copy = strdup(options);
+    if (!copy)
+    {
+      return NULL;
+    }
+    char *save;
+    for (char *option = strtok_r(copy, " \t", &save); option;
+         option = strtok_r(NULL, " \t", &save))
+    {
+      if (APEX_config_set(&config, option) != 0)
+      {
+        free(copy);
+        return NULL;
+      }
+    }
+    free(copy);
+  }
+
+  int code_memory_size = 0;
+  APEX_Instruction *code_memory =
+      create_code_memory_from_buffer(program, length, &code_memory_size);
+  APEX_CPU *cpu = APEX_cpu_create(code_memory, code_memory_size, &config);
+  if (!cpu)
+  {
+    free(code_memory);
+    return NULL;
+  }
+  cpu->owns_code_memory = 1;
+  return cpu;
+}
+
+void apex_destroy(APEX_CPU *cpu)
+{
+  if (cpu)
+  {
+    APEX_cpu_stop(cpu);
+  }
+}
+
+static int pipeline_empty(const APEX_CPU *cpu)
+{
+  if (cpu->rob_count)
+  {
+    return 0;
+  }
+  for (int i = F; i < NUM_STAGES; ++i)
+  {
+    if (cpu->stage[i].uop != APEX_UOP_BUBBLE)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int apex_done(const APEX_CPU *cpu)
+{
+  return pipeline_empty(cpu) &&
+         get_code_index(cpu->pc) >= cpu->code_memory_size;
+}
+
+long apex_step(APEX_CPU *cpu, long cycles)
+{
+  long run = 0;
+  while (run < cycles && !cpu->debug.hit && !apex_done(cpu))
+  {
+    APEX_cpu_cycle(cpu);
+    run++;
+  }
+  return run;
+}
+
+long apex_step_until_retired(APEX_CPU *cpu, long retired, long max_cycles)
+{
+  long run = 0;
+  while (run < max_cycles && cpu->ins_completed < retired &&
+         !cpu->debug.hit && !apex_done(cpu))
+  {
+    APEX_cpu_cycle(cpu);
+    run++;
+  }
+  return run;
+}
+
+int apex_reg(APEX_CPU *cpu, int reg)
+{
+  if (reg < 0 || reg >= 32)
+  {
+    return 0;
+  }
+  return APEX_cpu_reg_value(cpu, reg);
+}
+
+int apex_mem_read(const APEX_CPU *cpu, int address, int *out, int count)
+{
+  int words = sizeof(cpu->data_memory) / sizeof(cpu->data_memory[0]);
+  if (address < 0 || count < 0 || address > words - count)
+  {
+    return -1;
+  }
+  memcpy(out, &cpu->memory[address], sizeof(int) * count);
+  return 0;
+}
+
+void apex_counters_get(const APEX_CPU *cpu, apex_counters *out)
+{
+  out->cycles = cpu->clock;
+  out->retired = cpu->ins_completed;
+  out->pc = cpu->pc;
+}
+
+void apex_occupancy_get(const APEX_CPU *cpu, apex_occupancy *out)
+{
+  for (int i = F; i < NUM_STAGES; ++i)
+  {
+    int uop = cpu->stage[i].uop;
+    out->stage_pc[i] = uop == APEX_UOP_BUBBLE ? -1 : cpu->uop_pool[uop].pc;
+  }
+  out->rob_entries = cpu->rob_count;
+  out->uops_in_flight = APEX_UOP_POOL_SIZE - 1 - cpu->uop_free_count;
+}
+
+int apex_break(APEX_CPU *cpu, const char *spec)
+{
+  return APEX_debug_add(cpu, spec);
+}
+
+const char *apex_break_hit(const APEX_CPU *cpu)
+{
+  return cpu->debug.hit ? cpu->debug.reason : NULL;
+}
+
+void apex_break_resume(APEX_CPU *cpu)
+{
+  cpu->debug.hit = 0;
+}
+
+long apex_cosim_finish(APEX_CPU *cpu)
+{
+  if (!cpu->cosim)
+  {
+    return -2;
+  }
+  long divergence = APEX_cosim_finish(cpu->cosim, NULL);
+  cpu->cosim = NULL;
+  return divergence;
+}
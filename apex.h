@@ -0,0 +1,81 @@
+#ifndef _APEX_H_
+#define _APEX_H_
+/*
+ *  apex.h
+ *  Embeddable interface of the APEX simulator (libapex). None of
+ *  these functions print anything, results are read through queries.
+ */
+#include <stddef.h>
+
+typedef struct APEX_CPU APEX_CPU;
+
+/* Cycle and instruction counters of a run */
+typedef struct apex_counters
+{
+  long cycles;   // Clock cycles simulated
+  long retired;  // Instructions retired from the ROB
+  int pc;        // Next fetch address
+} apex_counters;
+
+/* Stage latches in pipeline order, F to MEM */
+#define APEX_OCCUPANCY_STAGES 8
+
+/* What the pipeline holds right now */
+typedef struct apex_occupancy
+{
+  int stage_pc[APEX_OCCUPANCY_STAGES]; // PC per latch, -1 when empty
+  int rob_entries;                     // Instructions in the ROB
+  int uops_in_flight;                  // Uop pool entries in use
+} apex_occupancy;
+
+/*
+ * Creates a CPU from program text held in memory, same format as the
+ * input files. options is NULL or a space separated list of key=value
+ * settings. Returns NULL on a parse or option error.
+ */
+APEX_CPU *apex_create(const char *program, size_t length, const char *options);
+
+void apex_destroy(APEX_CPU *cpu);
+
+/* Steps up to cycles clock cycles, returns the cycles actually run */
+long apex_step(APEX_CPU *cpu, long cycles);
+
+/*
+ * Steps until at least retired instructions retired in total, the
+ * pipeline drained or max_cycles passed, returns the cycles run
+ */
+long apex_step_until_retired(APEX_CPU *cpu, long retired, long max_cycles);
+
+/* Returns 1 once every instruction retired and the pipeline is empty */
+int apex_done(const APEX_CPU *cpu);
+
+int apex_reg(APEX_CPU *cpu, int reg);
+
+/* Copies count data memory words starting at address, returns -1 out of range */
+int apex_mem_read(const APEX_CPU *cpu, int address, int *out, int count);
+
+void apex_counters_get(const APEX_CPU *cpu, apex_counters *out);
+
+void apex_occupancy_get(const APEX_CPU *cpu, apex_occupancy *out);
+
+/*
+ * Arms a breakpoint, same specs as break= on the command line:
+ * pc:<address>, cycle:<n>, retired:<n>, reg:R<n>=<value>, mem:<a>[-<b>].
+ * Stepping stops in the cycle a condition fires.
+ */
+int apex_break(APEX_CPU *cpu, const char *spec);
+
+/* Returns what fired, or NULL if no breakpoint is pending */
+const char *apex_break_hit(const APEX_CPU *cpu);
+
+/* Clears a fired breakpoint so stepping can continue */
+void apex_break_resume(APEX_CPU *cpu);
+
+/*
+ * With the cosim=1 option, stops the lockstep checker and returns the
+ * retire index of the first divergence, -1 if all matched, -2 if the
+ * checker is not running
+ */
+long apex_cosim_finish(APEX_CPU *cpu);
+
+#endif
@@ -0,0 +1,986 @@
+/*
+ *  assembler.c
+ *  Assembles a program source into code memory. Every statement is
+ *  lowered to the plain "OPCODE,Rd,Rs1,#imm" form and handed to
+ *  create_APEX_instruction. Labels used ahead of their definition get
+ *  a placeholder immediate that is patched once the source is read.
+ */
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assembler.h"
+
+#define CODE_BASE 4000       // pc of the first instruction
+#define SYMBOL_BUCKETS 1024    // Initial size, doubles past two symbols a bucket
+#define MAX_OPERANDS 3
+
+/* Operands of each APEX_Opcode, R a register and I an immediate */
+static const char *shapes[] = {
+    "", "RI", "RRR", "RRR", "RRR", "RRR", "RRR", "RRR", "RRI", "RRI",
+    "RRI", "RRR", "RRI", "RRR", "I", "I", "RI", ""};
+
+typedef struct Symbol
+{
+  char *name;
+  int value;
+  int is_label;   // Labels are fixed, .equ constants may be redefined
+  struct Symbol *next;
+} Symbol;
+
+typedef struct Macro
+{
+  char *name;
+  char *params[APEX_ASM_MAX_ARGS];
+  int param_count;
+  char **body;
+  int lines;
+  struct Macro *next;
+} Macro;
+
+/* An immediate waiting for a label defined further down */
+typedef struct Fixup
+{
+  int index;      // Instruction to patch
+  char *symbol;
+  int addend;
+  int relative;   // Branch offset from the instruction, not an address
+  char *where;    // Position of the reference, for the error
+} Fixup;
+
+/* Lines being assembled, a file or the body of a .rept or macro */
+typedef struct Source
+{
+  FILE *fp;
+  char **lines;
+  int count;
+  int next;
+  const char *name;           // File name, or what the block is
+  const char *path;           // Base of relative .include paths
+  const struct Source *parent; // Where a block was expanded
+  int line_no;
+  char *buffer;
+  size_t length;
+} Source;
+
+typedef struct Assembler
+{
+  APEX_Instruction *code;
+  int size;
+  int capacity;
+  Symbol **symbols;
+  unsigned int buckets;
+  unsigned int symbol_count;
+  Macro *macros;
+  Fixup *fixups;
+  int fixup_count;
+  int fixup_capacity;
+  int depth;
+  int expansions; // Macro calls so far, the value of \@
+} Assembler;
+
+static int assemble_source(Assembler *as, Source *src);
+
+/* Appends "file:line: " for src, through the blocks it was expanded from */
+static void position(const Source *src, char *out, size_t size)
+{
+  size_t used = strlen(out);
+  if (src->parent)
+  {
+    position(src->parent, out, size);
+    used = strlen(out);
+    snprintf(out + used, size - used, "line %d of %s: ", src->line_no, src->name);
+  }
+  else
+  {
+    snprintf(out + used, size - used, "%s:%d: ", src->name, src->line_no);
+  }
+}
+
+static int error(const Source *src, const char *format, ...)
+{
+  char where[512] = "";
+  va_list args;
+
+  position(src, where, sizeof(where));
+  fprintf(stderr, "APEX_Error : %s", where);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+  return -1;
+}
+
+static char *trim(char *text)
+{
+  while (isspace((unsigned char)*text))
+    text++;
+  char *end = text + strlen(text);
+  while (end > text && isspace((unsigned char)end[-1]))
+    end--;
+  *end = '\0';
+  return text;
+}
+
+static void strip_comment(char *line)
+{
+  line[strcspn(line, ";")] = '\0';
+  char *slashes = strstr(line, "//");
+  if (slashes)
+  {
+    *slashes = '\0';
+  }
+}
+
+static int is_name_start(int c)
+{
+  return isalpha(c) || c == '_' || c == '.';
+}
+
+static int is_name_char(int c)
+{
+  return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+/* Rn or rn, stores n */
+static int register_number(const char *text, int *reg)
+{
+  if ((text[0] != 'R' && text[0] != 'r') || !isdigit((unsigned char)text[1]))
+  {
+    return 0;
+  }
+  for (const char *p = text + 1; *p; ++p)
+  {
+    if (!isdigit((unsigned char)*p))
+      return 0;
+  }
+  *reg = atoi(text + 1);
+  return 1;
+}
+
+/* Takes a name off the front of text, then blanks and one comma */
+static int take_name(char **text, char *name, size_t size)
+{
+  char *p = *text;
+  size_t length = 0;
+  if (!is_name_start((unsigned char)*p))
+  {
+    return 0;
+  }
+  while (is_name_char((unsigned char)p[length]))
+    length++;
+  if (length >= size)
+  {
+    return 0;
+  }
+  memcpy(name, p, length);
+  name[length] = '\0';
+  p += length;
+  while (isspace((unsigned char)*p))
+    p++;
+  if (*p == ',')
+    p++;
+  *text = trim(p);
+  return 1;
+}
+
+/* Splits text at commas into at most max trimmed fields, -1 if more */
+static int split(char *text, char **fields, int max)
+{
+  int count = 0;
+  if (!*text)
+  {
+    return 0;
+  }
+  for (;;)
+  {
+    char *comma = strchr(text, ',');
+    if (comma)
+      *comma = '\0';
+    if (count == max)
+      return -1;
+    fields[count++] = trim(text);
+    if (!comma)
+      return count;
+    text = comma + 1;
+  }
+}
+
+static unsigned int hash(const char *name)
+{
+  unsigned int h = 5381;
+  while (*name)
+    h = h * 33 + (unsigned char)*name++;
+  return h;
+}
+
+static Symbol *lookup(Assembler *as, const char *name)
+{
+  for (Symbol *symbol = as->symbols[hash(name) % as->buckets]; symbol;
+       symbol = symbol->next)
+  {
+    if (strcmp(symbol->name, name) == 0)
+      return symbol;
+  }
+  return NULL;
+}
+
+/* Doubles the buckets, kept as they are if that fails */
+static void rehash(Assembler *as)
+{
+  unsigned int buckets = 2 * as->buckets;
+  Symbol **symbols = calloc(buckets, sizeof(*symbols));
+  if (!symbols)
+  {
+    return;
+  }
+  for (unsigned int i = 0; i < as->buckets; ++i)
+  {
+    Symbol *symbol = as->symbols[i];
+    while (symbol)
+    {
+      Symbol *next = symbol->next;
+      symbol->next = symbols[hash(symbol->name) % buckets];
+      symbols[hash(symbol->name) % buckets] = symbol;
+      symbol = next;
+    }
+  }
+  free(as->symbols);
+  as->symbols = symbols;
+  as->buckets = buckets;
+}
+
+static int define(Assembler *as, const Source *src, const char *name,
+                  int value, int is_label)
+{
+  int reg;
+  if (register_number(name, &reg))
+  {
+    return error(src, "%s is a register name", name);
+  }
+  Symbol *symbol = lookup(as, name);
+  if (symbol)
+  {
+    if (symbol->is_label || is_label)
+      return error(src, "%s is already defined", name);
+    symbol->value = value;
+    return 0;
+  }
+  symbol = calloc(1, sizeof(*symbol));
+  if (!symbol || !(symbol->name = strdup(name)))
+  {
+    free(symbol);
+    return error(src, "out of memory");
+  }
+  symbol->value = value;
+  symbol->is_label = is_label;
+  symbol->next = as->symbols[hash(name) % as->buckets];
+  as->symbols[hash(name) % as->buckets] = symbol;
+  if (++as->symbol_count > 2 * as->buckets)
+  {
+    rehash(as);
+  }
+  return 0;
+}
+
+/*
+ * Evaluates a sum such as "N", "buffer+4" or "-8". One added symbol
+ * may be undefined yet, it is returned in pending and the rest of the
+ * sum in value, for the caller to patch later.
+ */
+static int evaluate(Assembler *as, const Source *src, const char *text,
+                    int *value, char *pending, size_t pending_size)
+{
+  const char *p = text;
+  long sum = 0;
+
+  pending[0] = '\0';
+  for (;;)
+  {
+    int sign = 1;
+    while (isspace((unsigned char)*p) || *p == '+' || *p == '-')
+    {
+      if (*p == '-')
+        sign = -sign;
+      p++;
+    }
+    if (isdigit((unsigned char)*p))
+    {
+      char *end;
+      int base = p[0] == '0' && (p[1] == 'x' || p[1] == 'X') ? 16 : 10;
+      sum += sign * strtol(p, &end, base);
+      p = end;
+    }
+    else if (is_name_start((unsigned char)*p))
+    {
+      char name[128];
+      size_t length = 0;
+      while (is_name_char((unsigned char)p[length]) && length < sizeof(name) - 1)
+      {
+        name[length] = p[length];
+        length++;
+      }
+      name[length] = '\0';
+      p += length;
+      Symbol *symbol = lookup(as, name);
+      if (symbol)
+      {
+        sum += sign * symbol->value;
+      }
+      else if (sign > 0 && !pending[0] && length < pending_size)
+      {
+        strcpy(pending, name);
+      }
+      else
+      {
+        return error(src, "%s is not defined", name);
+      }
+    }
+    else
+    {
+      return error(src, "bad expression '%s'", text);
+    }
+    while (isspace((unsigned char)*p))
+      p++;
+    if (!*p)
+      break;
+    if (*p != '+' && *p != '-')
+      return error(src, "bad expression '%s'", text);
+  }
+  *value = (int)sum;
+  return 0;
+}
+
+/* Same as evaluate, every symbol has to be defined already */
+static int evaluate_now(Assembler *as, const Source *src, const char *text,
+                        int *value)
+{
+  char pending[128];
+  if (evaluate(as, src, text, value, pending, sizeof(pending)) < 0)
+  {
+    return -1;
+  }
+  if (pending[0])
+  {
+    return error(src, "%s has to be defined before this use", pending);
+  }
+  return 0;
+}
+
+static int add_fixup(Assembler *as, const Source *src, const char *symbol,
+                     int addend, int relative)
+{
+  if (as->fixup_count == as->fixup_capacity)
+  {
+    int capacity = as->fixup_capacity ? 2 * as->fixup_capacity : 64;
+    Fixup *fixups = realloc(as->fixups, capacity * sizeof(*fixups));
+    if (!fixups)
+      return error(src, "out of memory");
+    as->fixups = fixups;
+    as->fixup_capacity = capacity;
+  }
+  char where[512] = "";
+  position(src, where, sizeof(where));
+  Fixup *fixup = &as->fixups[as->fixup_count];
+  fixup->index = as->size;
+  fixup->symbol = strdup(symbol);
+  fixup->where = strdup(where);
+  fixup->addend = addend;
+  fixup->relative = relative;
+  if (!fixup->symbol || !fixup->where)
+  {
+    free(fixup->symbol);
+    free(fixup->where);
+    return error(src, "out of memory");
+  }
+  as->fixup_count++;
+  return 0;
+}
+
+static int emit(Assembler *as, const Source *src, char *text)
+{
+  if (as->size == as->capacity)
+  {
+    int capacity = as->capacity ? 2 * as->capacity : 256;
+    APEX_Instruction *code = realloc(as->code, capacity * sizeof(*code));
+    if (!code)
+      return error(src, "out of memory");
+    as->code = code;
+    as->capacity = capacity;
+  }
+  APEX_Instruction *ins = &as->code[as->size++];
+  memset(ins, 0, sizeof(*ins));
+  create_APEX_instruction(ins, text);
+  return 0;
+}
+
+/*
+ * Lowers one instruction. A bare branch operand is the target and
+ * becomes an offset from the branch, a #operand is used as written.
+ */
+static int instruction(Assembler *as, const Source *src, char *mnemonic,
+                       char *operands)
+{
+  char opcode[16];
+  size_t length = strlen(mnemonic);
+  if (length >= sizeof(opcode))
+  {
+    return error(src, "unknown instruction %s", mnemonic);
+  }
+  for (size_t i = 0; i <= length; ++i)
+  {
+    opcode[i] = toupper((unsigned char)mnemonic[i]);
+  }
+  int op = APEX_opcode_from_string(opcode);
+  if (op == APEX_OP_NONE)
+  {
+    return error(src, "unknown instruction %s", mnemonic);
+  }
+
+  const char *shape = shapes[op];
+  char *fields[MAX_OPERANDS];
+  int count = split(operands, fields, MAX_OPERANDS);
+  if (count != (int)strlen(shape))
+  {
+    return error(src, "%s takes %d operands", opcode, (int)strlen(shape));
+  }
+
+  char text[256];
+  int used = snprintf(text, sizeof(text), "%s", opcode);
+  int pc = CODE_BASE + 4 * as->size;
+  for (int i = 0; i < count; ++i)
+  {
+    int value;
+    if (shape[i] == 'R')
+    {
+      if (!register_number(fields[i], &value))
+        return error(src, "%s is not a register", fields[i]);
+      used += snprintf(text + used, sizeof(text) - used, ",R%d", value);
+      continue;
+    }
+
+    const char *expression = fields[i];
+    int relative = op == APEX_OP_BZ || op == APEX_OP_BNZ;
+    if (*expression == '#')
+    {
+      expression++;
+      relative = 0;
+    }
+    char pending[128];
+    if (evaluate(as, src, expression, &value, pending, sizeof(pending)) < 0)
+    {
+      return -1;
+    }
+    if (pending[0])
+    {
+      if (add_fixup(as, src, pending, value, relative) < 0)
+        return -1;
+      value = 0;
+    }
+    else if (relative)
+    {
+      value -= pc;
+    }
+    used += snprintf(text + used, sizeof(text) - used, ",#%d", value);
+  }
+  return emit(as, src, text);
+}
+
+static char *next_line(Source *src)
+{
+  if (src->fp)
+  {
+    if (getline(&src->buffer, &src->length, src->fp) == -1)
+      return NULL;
+  }
+  else
+  {
+    if (src->next == src->count)
+      return NULL;
+    const char *line = src->lines[src->next++];
+    size_t length = strlen(line) + 1;
+    if (length > src->length)
+    {
+      char *buffer = realloc(src->buffer, length);
+      if (!buffer)
+        return NULL;
+      src->buffer = buffer;
+      src->length = length;
+    }
+    memcpy(src->buffer, line, length);
+  }
+  src->line_no++;
+  return src->buffer;
+}
+
+static void free_lines(char **lines, int count)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    free(lines[i]);
+  }
+  free(lines);
+}
+
+/*
+ * Reads the body of a .rept or .macro up to its closing directive,
+ * nested blocks included. Returns the raw lines.
+ */
+static char **collect(Source *src, const char *open, const char *close,
+                      int *count)
+{
+  char **lines = NULL;
+  int capacity = 0;
+  int nesting = 0;
+  int start = src->line_no;
+  char *line;
+
+  *count = 0;
+  while ((line = next_line(src)))
+  {
+    char word[16];
+    char *copy = strdup(line);
+    if (!copy)
+      break;
+    strip_comment(line);
+    char *p = trim(line);
+    size_t length = strcspn(p, " \t,");
+    snprintf(word, sizeof(word), "%.*s", (int)length, p);
+    if (strcmp(word, ".rept") == 0 || strcmp(word, ".macro") == 0)
+    {
+      nesting++;
+    }
+    else if (strcmp(word, ".endr") == 0 || strcmp(word, ".endm") == 0)
+    {
+      if (!nesting--)
+      {
+        free(copy);
+        if (strcmp(word, close) == 0)
+          return lines ? lines : calloc(1, sizeof(char *));
+        error(src, "%s closes %s", word, open);
+        free_lines(lines, *count);
+        return NULL;
+      }
+    }
+    if (*count == capacity)
+    {
+      capacity = capacity ? 2 * capacity : 16;
+      char **grown = realloc(lines, capacity * sizeof(*grown));
+      if (!grown)
+      {
+        free(copy);
+        break;
+      }
+      lines = grown;
+    }
+    lines[(*count)++] = copy;
+  }
+  src->line_no = start;
+  error(src, "%s without %s", open, close);
+  free_lines(lines, *count);
+  return NULL;
+}
+
+/* Assembles lines as a block expanded at src */
+static int assemble_block(Assembler *as, const Source *src, const char *name,
+                          char **lines, int count)
+{
+  if (as->depth == APEX_ASM_MAX_DEPTH)
+  {
+    return error(src, "%s nested more than %d deep", name, APEX_ASM_MAX_DEPTH);
+  }
+  Source block = {.lines = lines, .count = count, .name = name,
+                  .path = src->path, .parent = src};
+  as->depth++;
+  int status = assemble_source(as, &block);
+  as->depth--;
+  free(block.buffer);
+  return status;
+}
+
+static Macro *find_macro(Assembler *as, const char *name)
+{
+  for (Macro *macro = as->macros; macro; macro = macro->next)
+  {
+    if (strcmp(macro->name, name) == 0)
+      return macro;
+  }
+  return NULL;
+}
+
+static void free_macro(Macro *macro)
+{
+  free(macro->name);
+  for (int i = 0; i < macro->param_count; ++i)
+  {
+    free(macro->params[i]);
+  }
+  free_lines(macro->body, macro->lines);
+  free(macro);
+}
+
+/* A body line with \param replaced by its argument and \@ by serial */
+static char *substitute(const Macro *macro, char **args, int serial,
+                        const char *line)
+{
+  size_t capacity = strlen(line) + 64;
+  size_t used = 0;
+  char *out = malloc(capacity);
+
+  while (out && *line)
+  {
+    const char *insert = NULL;
+    char number[16];
+    size_t skip = 1;
+    if (line[0] == '\\' && line[1] == '@')
+    {
+      snprintf(number, sizeof(number), "%d", serial);
+      insert = number;
+      skip = 2;
+    }
+    else if (line[0] == '\\')
+    {
+      for (int i = 0; i < macro->param_count; ++i)
+      {
+        size_t length = strlen(macro->params[i]);
+        if (strncmp(line + 1, macro->params[i], length) == 0 &&
+            !is_name_char((unsigned char)line[1 + length]))
+        {
+          insert = args[i];
+          skip = 1 + length;
+          break;
+        }
+      }
+    }
+    size_t length = insert ? strlen(insert) : 1;
+    if (used + length + 1 > capacity)
+    {
+      capacity = 2 * (used + length + 1);
+      char *grown = realloc(out, capacity);
+      if (!grown)
+      {
+        free(out);
+        return NULL;
+      }
+      out = grown;
+    }
+    memcpy(out + used, insert ? insert : line, length);
+    used += length;
+    line += insert ? skip : 1;
+  }
+  if (out)
+    out[used] = '\0';
+  return out;
+}
+
+static int expand_macro(Assembler *as, const Source *src, Macro *macro,
+                        char *operands)
+{
+  char *args[APEX_ASM_MAX_ARGS];
+  int count = split(operands, args, APEX_ASM_MAX_ARGS);
+  if (count != macro->param_count)
+  {
+    return error(src, "macro %s takes %d arguments", macro->name,
+                 macro->param_count);
+  }
+
+  int serial = as->expansions++;
+  char **lines = calloc(macro->lines ? macro->lines : 1, sizeof(char *));
+  if (!lines)
+  {
+    return error(src, "out of memory");
+  }
+  for (int i = 0; i < macro->lines; ++i)
+  {
+    if (!(lines[i] = substitute(macro, args, serial, macro->body[i])))
+    {
+      free_lines(lines, i);
+      return error(src, "out of memory");
+    }
+  }
+  char name[160];
+  snprintf(name, sizeof(name), "macro %s", macro->name);
+  int status = assemble_block(as, src, name, lines, macro->lines);
+  free_lines(lines, macro->lines);
+  return status;
+}
+
+static int define_macro(Assembler *as, Source *src, char *operands)
+{
+  char name[128];
+  if (!take_name(&operands, name, sizeof(name)))
+  {
+    return error(src, ".macro needs a name");
+  }
+  if (find_macro(as, name) || APEX_opcode_from_string(name) != APEX_OP_NONE)
+  {
+    return error(src, "macro %s is already defined", name);
+  }
+  Macro *macro = calloc(1, sizeof(*macro));
+  if (!macro || !(macro->name = strdup(name)))
+  {
+    free(macro);
+    return error(src, "out of memory");
+  }
+
+  char *save;
+  for (char *param = strtok_r(operands, " \t,", &save); param;
+       param = strtok_r(NULL, " \t,", &save))
+  {
+    if (macro->param_count == APEX_ASM_MAX_ARGS)
+    {
+      free_macro(macro);
+      return error(src, "macro %s has more than %d parameters", name,
+                   APEX_ASM_MAX_ARGS);
+    }
+    macro->params[macro->param_count++] = strdup(param);
+  }
+
+  macro->body = collect(src, ".macro", ".endm", &macro->lines);
+  if (!macro->body)
+  {
+    free_macro(macro);
+    return -1;
+  }
+  macro->next = as->macros;
+  as->macros = macro;
+  return 0;
+}
+
+static int repeat(Assembler *as, Source *src, char *operands)
+{
+  int times;
+  if (evaluate_now(as, src, operands, &times) < 0)
+  {
+    return -1;
+  }
+  int count;
+  char **body = collect(src, ".rept", ".endr", &count);
+  if (!body)
+  {
+    return -1;
+  }
+  int status = 0;
+  for (int i = 0; i < times && status == 0; ++i)
+  {
+    status = assemble_block(as, src, ".rept", body, count);
+  }
+  free_lines(body, count);
+  return status;
+}
+
+/* Assembles another file in place, relative to the including one */
+static int include(Assembler *as, const Source *src, char *operands)
+{
+  char *file = operands;
+  size_t length = strlen(file);
+  if (length >= 2 && file[0] == '"' && file[length - 1] == '"')
+  {
+    file[length - 1] = '\0';
+    file++;
+  }
+  if (!*file)
+  {
+    return error(src, ".include needs a file name");
+  }
+
+  char path[4096];
+  const char *slash = src->path ? strrchr(src->path, '/') : NULL;
+  if (file[0] != '/' && slash)
+  {
+    snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - src->path), src->path, file);
+  }
+  else
+  {
+    snprintf(path, sizeof(path), "%s", file);
+  }
+  if (as->depth == APEX_ASM_MAX_DEPTH)
+  {
+    return error(src, "includes nested more than %d deep", APEX_ASM_MAX_DEPTH);
+  }
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+  {
+    return error(src, "cannot open %s", path);
+  }
+
+  Source child = {.fp = fp, .name = path, .path = path};
+  as->depth++;
+  int status = assemble_source(as, &child);
+  as->depth--;
+  free(child.buffer);
+  fclose(fp);
+  return status;
+}
+
+static int directive(Assembler *as, Source *src, const char *name,
+                     char *operands)
+{
+  if (strcmp(name, ".equ") == 0)
+  {
+    char symbol[128];
+    int value;
+    if (!take_name(&operands, symbol, sizeof(symbol)))
+      return error(src, ".equ needs a name");
+    if (evaluate_now(as, src, operands, &value) < 0)
+      return -1;
+    return define(as, src, symbol, value, 0);
+  }
+  if (strcmp(name, ".rept") == 0)
+  {
+    return repeat(as, src, operands);
+  }
+  if (strcmp(name, ".macro") == 0)
+  {
+    return define_macro(as, src, operands);
+  }
+  if (strcmp(name, ".include") == 0)
+  {
+    return include(as, src, operands);
+  }
+  if (strcmp(name, ".endr") == 0 || strcmp(name, ".endm") == 0)
+  {
+    return error(src, "%s without an open block", name);
+  }
+  return error(src, "unknown directive %s", name);
+}
+
+static int statement(Assembler *as, Source *src, char *line)
+{
+  strip_comment(line);
+  char *p = trim(line);
+
+  /* Labels ahead of the statement, "loop: ADDL ..." */
+  for (;;)
+  {
+    char *end = p;
+    if (!is_name_start((unsigned char)*end))
+      break;
+    while (is_name_char((unsigned char)*end))
+      end++;
+    if (*end != ':')
+      break;
+    *end = '\0';
+    if (define(as, src, p, CODE_BASE + 4 * as->size, 1) < 0)
+      return -1;
+    p = trim(end + 1);
+  }
+  if (!*p)
+  {
+    return 0;
+  }
+
+  char *operands = p + strcspn(p, " \t,");
+  if (*operands)
+  {
+    *operands++ = '\0';
+  }
+  operands = trim(operands);
+
+  if (p[0] == '.')
+  {
+    return directive(as, src, p, operands);
+  }
+  Macro *macro = find_macro(as, p);
+  if (macro)
+  {
+    return expand_macro(as, src, macro, operands);
+  }
+  return instruction(as, src, p, operands);
+}
+
+static int assemble_source(Assembler *as, Source *src)
+{
+  char *line;
+  while ((line = next_line(src)))
+  {
+    if (statement(as, src, line) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* Fills in the immediates that named labels defined later */
+static int patch(Assembler *as)
+{
+  for (int i = 0; i < as->fixup_count; ++i)
+  {
+    Fixup *fixup = &as->fixups[i];
+    Symbol *symbol = lookup(as, fixup->symbol);
+    if (!symbol)
+    {
+      fprintf(stderr, "APEX_Error : %s%s is not defined\n", fixup->where,
+              fixup->symbol);
+      return -1;
+    }
+    int value = symbol->value + fixup->addend;
+    if (fixup->relative)
+      value -= CODE_BASE + 4 * fixup->index;
+    as->code[fixup->index].imm = value;
+  }
+  return 0;
+}
+
+static void release(Assembler *as)
+{
+  for (unsigned int i = 0; i < as->buckets; ++i)
+  {
+    Symbol *symbol = as->symbols[i];
+    while (symbol)
+    {
+      Symbol *next = symbol->next;
+      free(symbol->name);
+      free(symbol);
+      symbol = next;
+    }
+  }
+  free(as->symbols);
+  while (as->macros)
+  {
+    Macro *next = as->macros->next;
+    free_macro(as->macros);
+    as->macros = next;
+  }
+  for (int i = 0; i < as->fixup_count; ++i)
+  {
+    free(as->fixups[i].symbol);
+    free(as->fixups[i].where);
+  }
+  free(as->fixups);
+}
+
+APEX_Instruction *APEX_assemble(FILE *fp, const char *path, int *size)
+{
+  Assembler *as = calloc(1, sizeof(*as));
+  if (as)
+  {
+    as->buckets = SYMBOL_BUCKETS;
+    as->symbols = calloc(as->buckets, sizeof(*as->symbols));
+  }
+  if (!as || !as->symbols)
+  {
+    free(as);
+    *size = 0;
+    return NULL;
+  }
+
+  Source src = {.fp = fp, .name = path ? path : "<program>", .path = path};
+  int status = assemble_source(as, &src);
+  free(src.buffer);
+  if (status == 0)
+  {
+    status = patch(as);
+  }
+  release(as);
+
+  APEX_Instruction *code = as->code;
+  *size = as->size;
+  if (status < 0 || !as->size)
+  {
+    free(code);
+    code = NULL;
+    *size = 0;
+  }
+  free(as);
+  return code;
+}
@@ -0,0 +1,27 @@
+#ifndef _APEX_ASSEMBLER_H_
+#define _APEX_ASSEMBLER_H_
+/*
+ *  assembler.h
+ *  Assembler front end of the program loader. On top of the one
+ *  instruction per line format it takes comments, labels, .equ
+ *  constants, .rept and .macro blocks and .include files, and expands
+ *  them in one pass into code memory.
+ */
+#include <stdio.h>
+#include "cpu.h"
+
+#define APEX_ASM_MAX_DEPTH 16   // Nested includes, macro calls and repeats
+#define APEX_ASM_MAX_ARGS 8     // Parameters of one macro
+
+/*
+ * Assembles the program on fp, path names it in errors and is the base
+ * of relative .include paths, NULL for a program held in memory.
+ * Returns the code memory and its size, NULL on an error or an empty
+ * program. Does not close fp.
+ */
+APEX_Instruction *APEX_assemble(FILE *fp, const char *path, int *size);
+
+/* Fills ins from one plain "OPCODE,Rd,Rs1,#imm" line, see file_parser.c */
+void create_APEX_instruction(APEX_Instruction *ins, char *buffer);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ *  cache.c
+ *  Private data cache timing model with an MSI directory for
+ *  multi-core runs. Permissions are only changed under the stripe
+ *  lock of the line, so cores may run on separate host threads.
+ */
+#include <stdlib.h>
+#include "cache.h"
+
+APEX_Coherence *APEX_coherence_create(int memory_words, int line_words)
+{
+  APEX_Coherence *coherence = calloc(1, sizeof(*coherence));
+  if (!coherence)
+  {
+    return NULL;
+  }
+  coherence->line_words = line_words;
+  coherence->lines = (memory_words + line_words - 1) / line_words;
+  coherence->directory = calloc(coherence->lines, sizeof(APEX_Directory_Entry));
+  if (!coherence->directory)
+  {
+    free(coherence);
+    return NULL;
+  }
+  for (int i = 0; i < coherence->lines; ++i)
+  {
+    coherence->directory[i].owner = -1;
+  }
+  for (int i = 0; i < APEX_COHERENCE_STRIPES; ++i)
+  {
+    pthread_mutex_init(&coherence->locks[i], NULL);
+  }
+  return coherence;
+}
+
+void APEX_coherence_free(APEX_Coherence *coherence)
+{
+  if (!coherence)
+  {
+    return;
+  }
+  for (int i = 0; i < APEX_COHERENCE_STRIPES; ++i)
+  {
+    pthread_mutex_destroy(&coherence->locks[i]);
+  }
+  free(coherence->directory);
+  free(coherence);
+}
+
+APEX_Cache *APEX_cache_create(const APEX_Config *config, int core,
+                              APEX_Coherence *coherence)
+{
+  APEX_Cache *cache = calloc(1, sizeof(*cache));
+  if (!cache)
+  {
+    return NULL;
+  }
+  cache->sets = config->dcache_sets;
+  cache->ways = config->dcache_ways;
+  cache->line_words = config->dcache_line;
+  cache->miss_latency = config->dcache_miss_latency;
+  cache->c2c_latency = config->dcache_c2c_latency;
+  cache->core = core;
+  cache->coherence = coherence;
+
+  cache->tags = malloc(sizeof(int) * cache->sets * cache->ways);
+  cache->lru = calloc(cache->sets * cache->ways, sizeof(unsigned long));
+  cache->ready = calloc(cache->sets * cache->ways, sizeof(int));
+  cache->prefetched = calloc(cache->sets * cache->ways, 1);
+  if (!cache->tags || !cache->lru || !cache->ready || !cache->prefetched)
+  {
+    APEX_cache_free(cache);
+    return NULL;
+  }
+  for (int i = 0; i < cache->sets * cache->ways; ++i)
+  {
+    cache->tags[i] = -1;
+  }
+  return cache;
+}
+
+void APEX_cache_free(APEX_Cache *cache)
+{
+  if (!cache)
+  {
+    return;
+  }
+  free(cache->tags);
+  free(cache->lru);
+  free(cache->ready);
+  free(cache->prefetched);
+  free(cache);
+}
+
+static pthread_mutex_t *stripe(APEX_Coherence *coherence, int line)
+{
+  return &coherence->locks[line % APEX_COHERENCE_STRIPES];
+}
+
+/* Drops this core from the directory entry of an evicted line */
+static void evict(APEX_Cache *cache, int line)
+{
+  APEX_Coherence *coherence = cache->coherence;
+  if (!coherence || line < 0 || line >= coherence->lines)
+  {
+    return;
+  }
+  pthread_mutex_lock(stripe(coherence, line));
+  APEX_Directory_Entry *entry = &coherence->directory[line];
+  entry->sharers &= ~(1u << cache->core);
+  if (entry->owner == cache->core)
+  {
+    entry->owner = -1;
+    cache->writebacks++;
+  }
+  pthread_mutex_unlock(stripe(coherence, line));
+}
+
+/*
+ * Asks the directory for read or write permission on a line, returns
+ * the extra cycles that costs. present tells whether the tag is still
+ * in this cache, a present line without permission was invalidated.
+ */
+static int acquire(APEX_Cache *cache, int line, int is_store, int present)
+{
+  APEX_Coherence *coherence = cache->coherence;
+  unsigned int self = 1u << cache->core;
+  int latency = 0;
+
+  pthread_mutex_lock(stripe(coherence, line));
+  APEX_Directory_Entry *entry = &coherence->directory[line];
+  int peer_owns = entry->owner >= 0 && entry->owner != cache->core;
+
+  if (present && !(entry->sharers & self))
+  {
+    cache->coherence_misses++;
+  }
+
+  if (!is_store)
+  {
+    if (present && (entry->sharers & self))
+    {
+      latency = -1;
+    }
+    else
+    {
+      /* A modified peer copy is written back and downgraded to S */
+      latency = peer_owns ? cache->c2c_latency : cache->miss_latency;
+      if (peer_owns)
+      {
+        entry->owner = -1;
+      }
+      entry->sharers |= self;
+    }
+  }
+  else
+  {
+    if (present && entry->owner == cache->core)
+    {
+      latency = -1;
+    }
+    else
+    {
+      unsigned int others = entry->sharers & ~self;
+      if (present && (entry->sharers & self))
+      {
+        cache->upgrades++;
+        latency = cache->c2c_latency;
+      }
+      else
+      {
+        latency = peer_owns ? cache->c2c_latency : cache->miss_latency;
+      }
+      cache->invalidations += __builtin_popcount(others);
+      entry->sharers = self;
+      entry->owner = cache->core;
+    }
+  }
+  pthread_mutex_unlock(stripe(coherence, line));
+  return latency;
+}
+
+/* Picks the least recently used way of a set and evicts its line */
+static int victim(APEX_Cache *cache, int set)
+{
+  int *tags = &cache->tags[set * cache->ways];
+  unsigned long *lru = &cache->lru[set * cache->ways];
+  int way = 0;
+
+  for (int i = 1; i < cache->ways; ++i)
+  {
+    if (lru[i] < lru[way])
+    {
+      way = i;
+    }
+  }
+  if (tags[way] >= 0)
+  {
+    evict(cache, tags[way]);
+  }
+  if (cache->prefetched[set * cache->ways + way])
+  {
+    cache->prefetch_unused++;
+  }
+  return way;
+}
+
+/*
+ * Looks up one data memory word at cycle now and returns the stall
+ * cycles the access costs on top of the single cycle memory stage
+ */
+int APEX_cache_access(APEX_Cache *cache, int address, int is_store, int now)
+{
+  int line = address / cache->line_words;
+  int set = line % cache->sets;
+  int *tags = &cache->tags[set * cache->ways];
+  unsigned long *lru = &cache->lru[set * cache->ways];
+  int way = -1;
+
+  cache->accesses++;
+  cache->tick++;
+  for (int i = 0; i < cache->ways; ++i)
+  {
+    if (tags[i] == line)
+    {
+      way = i;
+      break;
+    }
+  }
+
+  int latency;
+  if (cache->coherence)
+  {
+    latency = acquire(cache, line, is_store, way >= 0);
+  }
+  else
+  {
+    latency = way >= 0 ? -1 : cache->miss_latency;
+  }
+
+  int entry = set * cache->ways + way;
+  cache->prefetch_hit = 0;
+  if (latency < 0)
+  {
+    cache->hits++;
+    lru[way] = cache->tick;
+    if (!cache->prefetched[entry])
+    {
+      return 0;
+    }
+    /* First use of a prefetched line, which may still be on its way */
+    cache->prefetched[entry] = 0;
+    cache->prefetch_useful++;
+    cache->prefetch_hit = 1;
+    latency = cache->ready[entry] > now ? cache->ready[entry] - now : 0;
+    if (latency > 0)
+    {
+      cache->prefetch_late++;
+    }
+    cache->prefetch_hidden += cache->miss_latency - latency;
+    return latency;
+  }
+
+  cache->misses++;
+  if (way < 0)
+  {
+    way = victim(cache, set);
+    tags[way] = line;
+  }
+  else if (cache->prefetched[entry])
+  {
+    /* The prefetched copy could not serve the access, a peer took it or a store needs an upgrade */
+    cache->prefetch_unused++;
+  }
+  cache->prefetched[set * cache->ways + way] = 0;
+  lru[way] = cache->tick;
+  return latency;
+}
+
+/*
+ * Brings a line in ahead of use, it arrives a miss latency after now.
+ * Returns 0 if the line is already cached.
+ */
+int APEX_cache_prefetch(APEX_Cache *cache, int line, int now)
+{
+  int set = line % cache->sets;
+  int *tags = &cache->tags[set * cache->ways];
+
+  for (int i = 0; i < cache->ways; ++i)
+  {
+    if (tags[i] == line)
+    {
+      return 0;
+    }
+  }
+
+  int latency = cache->coherence ? acquire(cache, line, 0, 0) : cache->miss_latency;
+  int way = victim(cache, set);
+  tags[way] = line;
+  cache->tick++;
+  cache->lru[set * cache->ways + way] = cache->tick;
+  cache->ready[set * cache->ways + way] = now + latency;
+  cache->prefetched[set * cache->ways + way] = 1;
+  cache->prefetches++;
+  return 1;
+}
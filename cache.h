@@ -0,0 +1,76 @@
+#ifndef _APEX_CACHE_H_
+#define _APEX_CACHE_H_
+/*
+ *  cache.h
+ *  Timing model of a private set-associative data cache. Data always
+ *  lives in the (possibly shared) data memory, the cache only tracks
+ *  tags and, when several cores share memory, MSI permissions kept in
+ *  a directory.
+ */
+#include <pthread.h>
+#include "cpu.h"
+
+#define APEX_COHERENCE_STRIPES 64
+
+/* Directory entry of one memory line */
+typedef struct APEX_Directory_Entry
+{
+  unsigned int sharers; // Cores holding the line in S or M
+  int owner;            // Core holding it in M, -1 if none
+} APEX_Directory_Entry;
+
+/* MSI directory shared by the caches of all cores */
+typedef struct APEX_Coherence
+{
+  int line_words;
+  int lines;
+  APEX_Directory_Entry *directory;
+  pthread_mutex_t locks[APEX_COHERENCE_STRIPES];
+} APEX_Coherence;
+
+typedef struct APEX_Cache
+{
+  int sets;
+  int ways;
+  int line_words;
+  int miss_latency;     // Extra cycles to fetch a line from memory
+  int c2c_latency;      // Extra cycles for an upgrade or a line held by a peer
+  int core;             // Bit of this cache in the directory
+  APEX_Coherence *coherence; // NULL for a single core
+
+  int *tags;            // sets * ways line numbers, -1 when empty
+  unsigned long *lru;   // Last use tick per way
+  unsigned long tick;
+  int *ready;           // Cycle a prefetched line arrives per way
+  unsigned char *prefetched; // Way filled by a prefetch and not used yet
+
+  /* Stats */
+  long accesses;
+  long hits;
+  long misses;
+  long coherence_misses; // Tag present but permission taken by a peer
+  long upgrades;         // S to M on a store
+  long invalidations;    // Peer copies this cache invalidated
+  long writebacks;       // Modified lines written back
+  long prefetches;       // Lines filled by a prefetch
+  long prefetch_useful;  // Prefetched lines a demand access used
+  long prefetch_late;    // Used while still on the way
+  long prefetch_unused;  // Evicted or invalidated before any use
+  long prefetch_hidden;  // Miss cycles the used prefetches saved
+  int prefetch_hit;      // Last access was the first use of a prefetched line
+} APEX_Cache;
+
+APEX_Coherence *APEX_coherence_create(int memory_words, int line_words);
+
+void APEX_coherence_free(APEX_Coherence *coherence);
+
+APEX_Cache *APEX_cache_create(const APEX_Config *config, int core,
+                              APEX_Coherence *coherence);
+
+void APEX_cache_free(APEX_Cache *cache);
+
+int APEX_cache_access(APEX_Cache *cache, int address, int is_store, int now);
+
+int APEX_cache_prefetch(APEX_Cache *cache, int line, int now);
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ *  config.c
+ *  Contains the tunable parameters of the modelled core and
+ *  the parser for their key=value command line form
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "memimage.h"
+#include "prefetch.h"
+#include "simpoint.h"
+#include "slice.h"
+
+typedef struct APEX_Config_Option
+{
+  const char *name; // Key used on the command line
+  size_t offset;    // Position of the field in APEX_Config
+  int min;          // Smallest accepted value
+  int max;          // Largest accepted value
+} APEX_Config_Option;
+
+static const APEX_Config_Option options[] = {
+    {"rob_size", offsetof(APEX_Config, rob_size), 1, APEX_ROB_SIZE},
+    {"break_trace", offsetof(APEX_Config, break_trace), 0, 1},
+    {"cosim", offsetof(APEX_Config, cosim), 0, 1},
+    {"dcache", offsetof(APEX_Config, dcache), 0, 1},
+    {"dcache_sets", offsetof(APEX_Config, dcache_sets), 1, 4096},
+    {"dcache_ways", offsetof(APEX_Config, dcache_ways), 1, 16},
+    {"dcache_line", offsetof(APEX_Config, dcache_line), 1, 64},
+    {"dcache_miss_latency", offsetof(APEX_Config, dcache_miss_latency), 0, 1000},
+    {"dcache_c2c_latency", offsetof(APEX_Config, dcache_c2c_latency), 0, 1000},
+    {"quantum", offsetof(APEX_Config, quantum), 0, 1000000},
+    {"mem_dep", offsetof(APEX_Config, mem_dep), APEX_MEM_DEP_IN_ORDER, APEX_MEM_DEP_ALWAYS},
+    {"simpoint_k", offsetof(APEX_Config, simpoint_k), 1, APEX_SIMPOINT_MAX_K},
+    {"simpoint_full", offsetof(APEX_Config, simpoint_full), 0, 1},
+    {"bypass_latency", offsetof(APEX_Config, bypass_latency), 0, 16},
+    {"result_buses", offsetof(APEX_Config, result_buses), 0, 8},
+    {"branch_checkpoints", offsetof(APEX_Config, branch_checkpoints), 0, APEX_MAX_CHECKPOINTS},
+    {"fusion", offsetof(APEX_Config, fusion), 0,
+     APEX_FUSE_MOVC_ALU | APEX_FUSE_ADDR_MEM | APEX_FUSE_ALU_BRANCH},
+    {"eliminate", offsetof(APEX_Config, eliminate), 0, 1},
+    {"prefetch", offsetof(APEX_Config, prefetch), APEX_PREFETCH_NONE, APEX_PREFETCH_STREAM},
+    {"prefetch_degree", offsetof(APEX_Config, prefetch_degree), 1, APEX_PREFETCH_MAX_DEGREE},
+    {"prefetch_distance", offsetof(APEX_Config, prefetch_distance), 1, 64},
+    {"uop_cache", offsetof(APEX_Config, uop_cache), 0, 4096},
+    {"loop_buffer", offsetof(APEX_Config, loop_buffer), 0, APEX_LOOP_BUFFER_MAX},
+    {"interval_full", offsetof(APEX_Config, interval_full), 0, 1},
+    {"slices", offsetof(APEX_Config, slices), 1, APEX_SLICE_MAX},
+    {"slice_warmup", offsetof(APEX_Config, slice_warmup), 0, 100000000},
+    {"slice_threads", offsetof(APEX_Config, slice_threads), 0, APEX_SLICE_MAX},
+    {"slice_full", offsetof(APEX_Config, slice_full), 0, 1},
+    {"smt_fetch", offsetof(APEX_Config, smt_fetch), APEX_SMT_FETCH_ROUND_ROBIN, APEX_SMT_FETCH_ICOUNT},
+    {"smt_rob", offsetof(APEX_Config, smt_rob), 0, APEX_ROB_SIZE},
+    {"smt_prf", offsetof(APEX_Config, smt_prf), 0, 24},
+    {"topdown", offsetof(APEX_Config, topdown), 0, 1},
+    {"topdown_region", offsetof(APEX_Config, topdown_region), 0, 1000000000},
+    {"ilp_hot", offsetof(APEX_Config, ilp_hot), 0, 1000},
+    {"mem_mmap", offsetof(APEX_Config, mem_mmap), 0, 1},
+    {"ports", offsetof(APEX_Config, ports), 0, APEX_MAX_PORTS},
+    {"port0", offsetof(APEX_Config, port_classes[0]), 1, (1 << APEX_PORT_CLASSES) - 1},
+    {"port1", offsetof(APEX_Config, port_classes[1]), 1, (1 << APEX_PORT_CLASSES) - 1},
+    {"port2", offsetof(APEX_Config, port_classes[2]), 1, (1 << APEX_PORT_CLASSES) - 1},
+    {"port3", offsetof(APEX_Config, port_classes[3]), 1, (1 << APEX_PORT_CLASSES) - 1},
+    {"digest", offsetof(APEX_Config, digest), 0, 1000000000},
+};
+
+/* Options taking a file name or other text, each a char[APEX_CONFIG_PATH] */
+typedef struct APEX_Config_Text
+{
+  const char *name;
+  size_t offset;
+  int (*check)(const char *value); // Returns 0 if value is valid, NULL takes any
+} APEX_Config_Text;
+
+static const APEX_Config_Text text_options[] = {
+    {"mem_image", offsetof(APEX_Config, mem_image), NULL},
+    {"mem_dump", offsetof(APEX_Config, mem_dump), NULL},
+    {"mem_dump_ranges", offsetof(APEX_Config, mem_dump_ranges), APEX_memory_image_check_ranges},
+    {"digest_log", offsetof(APEX_Config, digest_log), NULL},
+};
+
+void APEX_config_default(APEX_Config *config)
+{
+  memset(config, 0, sizeof(*config));
+  config->rob_size = APEX_ROB_SIZE;
+  config->dcache_sets = 16;
+  config->dcache_ways = 2;
+  config->dcache_line = 4;
+  config->dcache_miss_latency = 10;
+  config->dcache_c2c_latency = 5;
+  config->quantum = 100;
+  config->mem_dep = APEX_MEM_DEP_STORE_SETS;
+  config->simpoint_k = 4;
+  config->branch_checkpoints = 4;
+  config->prefetch_degree = 2;
+  config->prefetch_distance = 1;
+  config->slices = 4;
+  config->slice_warmup = 2000;
+  config->smt_fetch = APEX_SMT_FETCH_ICOUNT;
+  config->ilp_hot = 10;
+  /* A port for everything, then ALU ports sharing MUL, AGU and branch work */
+  config->port_classes[0] = APEX_PORT_ALU | APEX_PORT_AGU | APEX_PORT_BRANCH | APEX_PORT_MUL;
+  config->port_classes[1] = APEX_PORT_ALU | APEX_PORT_MUL;
+  config->port_classes[2] = APEX_PORT_ALU | APEX_PORT_AGU;
+  config->port_classes[3] = APEX_PORT_ALU | APEX_PORT_BRANCH;
+}
+
+/*
+ * Applies one "key=value" option, returns -1 and leaves the
+ * config untouched if the key is unknown or the value out of range
+ */
+int APEX_config_set(APEX_Config *config, const char *option)
+{
+  const char *eq = strchr(option, '=');
+  if (!eq)
+  {
+    fprintf(stderr, "APEX_Error : Expected key=value, got %s\n", option);
+    return -1;
+  }
+
+  size_t key_len = eq - option;
+  for (size_t i = 0; i < sizeof(text_options) / sizeof(text_options[0]); ++i)
+  {
+    if (strlen(text_options[i].name) != key_len ||
+        strncmp(text_options[i].name, option, key_len) != 0)
+    {
+      continue;
+    }
+
+    if (strlen(eq + 1) >= APEX_CONFIG_PATH)
+    {
+      fprintf(stderr, "APEX_Error : %s must be shorter than %d characters\n",
+              text_options[i].name, APEX_CONFIG_PATH);
+      return -1;
+    }
+    if (text_options[i].check && text_options[i].check(eq + 1) != 0)
+    {
+      return -1;
+    }
+    strcpy((char *)config + text_options[i].offset, eq + 1);
+    return 0;
+  }
+
+  for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i)
+  {
+    if (strlen(options[i].name) != key_len ||
+        strncmp(options[i].name, option, key_len) != 0)
+    {
+      continue;
+    }
+
+    char *end;
+    long value = strtol(eq + 1, &end, 0);
+    if (*end != '\0' || end == eq + 1 ||
+        value < options[i].min || value > options[i].max)
+    {
+      fprintf(stderr, "APEX_Error : %s must be in [%d, %d]\n",
+              options[i].name, options[i].min, options[i].max);
+      return -1;
+    }
+    *(int *)((char *)config + options[i].offset) = (int)value;
+    return 0;
+  }
+
+  fprintf(stderr, "APEX_Error : Unknown option %.*s\n", (int)key_len, option);
+  return -1;
+}
@@ -0,0 +1,231 @@
+/*
+ *  cosim.c
+ *  Lockstep co-simulation. The pipeline pushes one record per retired
+ *  instruction into a single-producer/single-consumer ring, a checker
+ *  thread replays the program on the reference interpreter and
+ *  compares every record. Neither side takes a lock.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cosim.h"
+
+/* Must stay a power of two */
+#define RING_SIZE 4096
+#define CONTEXT_RECORDS 8
+
+struct APEX_Cosim
+{
+  APEX_Retire_Record ring[RING_SIZE];
+
+  /* Producer and consumer indices live on separate cache lines */
+  alignas(64) atomic_ulong head; // Next slot the pipeline writes
+  unsigned long tail_cache;      // Producer's last view of tail
+  alignas(64) atomic_ulong tail; // Next slot the checker reads
+  alignas(64) atomic_int closed;
+  atomic_int diverged;
+
+  pthread_t thread;
+  APEX_Func func;
+  long checked;
+  long divergence;               // Retire index of the first mismatch
+  char what[64];
+  APEX_Retire_Record expected;
+  APEX_Retire_Record actual;
+  APEX_Retire_Record history[CONTEXT_RECORDS]; // Last matching records
+};
+
+static const char *compare(const APEX_Retire_Record *expected,
+                           const APEX_Retire_Record *actual)
+{
+  if (expected->pc != actual->pc)
+  {
+    return "pc";
+  }
+  if (expected->rd != actual->rd)
+  {
+    return "destination register";
+  }
+  if (expected->rd >= 0 && expected->value != actual->value)
+  {
+    return "register value";
+  }
+  if (expected->mem_address != actual->mem_address)
+  {
+    return "store address";
+  }
+  if (expected->mem_address >= 0 && expected->mem_value != actual->mem_value)
+  {
+    return "store value";
+  }
+  return NULL;
+}
+
+static void check(APEX_Cosim *cosim, const APEX_Retire_Record *actual)
+{
+  APEX_Retire_Record expected;
+  const char *what;
+
+  if (!APEX_func_step(&cosim->func, &expected))
+  {
+    memset(&expected, 0, sizeof(expected));
+    expected.pc = -1;
+    expected.rd = -1;
+    expected.mem_address = -1;
+    what = "retired past the end of the program";
+  }
+  else
+  {
+    what = compare(&expected, actual);
+  }
+
+  if (what)
+  {
+    snprintf(cosim->what, sizeof(cosim->what), "%s", what);
+    cosim->expected = expected;
+    cosim->actual = *actual;
+    cosim->divergence = cosim->checked;
+    atomic_store_explicit(&cosim->diverged, 1, memory_order_relaxed);
+    return;
+  }
+  cosim->history[cosim->checked % CONTEXT_RECORDS] = *actual;
+  cosim->checked++;
+}
+
+static void *checker_main(void *arg)
+{
+  APEX_Cosim *cosim = arg;
+  unsigned long tail = 0;
+  int idle = 0;
+
+  for (;;)
+  {
+    unsigned long head = atomic_load_explicit(&cosim->head, memory_order_acquire);
+    if (tail == head)
+    {
+      if (atomic_load_explicit(&cosim->closed, memory_order_acquire) &&
+          tail == atomic_load_explicit(&cosim->head, memory_order_acquire))
+      {
+        return NULL;
+      }
+      /* Spin briefly, then back off so an idle checker costs no core */
+      if (++idle < 64)
+      {
+        sched_yield();
+      }
+      else
+      {
+        struct timespec nap = {0, 50000};
+        nanosleep(&nap, NULL);
+      }
+      continue;
+    }
+    idle = 0;
+
+    while (tail != head)
+    {
+      if (!atomic_load_explicit(&cosim->diverged, memory_order_relaxed))
+      {
+        check(cosim, &cosim->ring[tail & (RING_SIZE - 1)]);
+      }
+      tail++;
+    }
+    atomic_store_explicit(&cosim->tail, tail, memory_order_release);
+  }
+}
+
+APEX_Cosim *APEX_cosim_start(const APEX_Instruction *code_memory,
+                             int code_memory_size, const int *memory)
+{
+  APEX_Cosim *cosim = calloc(1, sizeof(*cosim));
+  if (!cosim)
+  {
+    return NULL;
+  }
+  APEX_func_init(&cosim->func, code_memory, code_memory_size);
+  if (memory)
+  {
+    memcpy(cosim->func.data_memory, memory, sizeof(cosim->func.data_memory));
+  }
+  cosim->divergence = -1;
+
+  if (pthread_create(&cosim->thread, NULL, checker_main, cosim) != 0)
+  {
+    free(cosim);
+    return NULL;
+  }
+  return cosim;
+}
+
+void APEX_cosim_retire(APEX_Cosim *cosim, const APEX_Retire_Record *record)
+{
+  /* Once diverged the checker discards everything, stop feeding it */
+  if (atomic_load_explicit(&cosim->diverged, memory_order_relaxed))
+  {
+    return;
+  }
+
+  unsigned long head = atomic_load_explicit(&cosim->head, memory_order_relaxed);
+  while (head - cosim->tail_cache == RING_SIZE)
+  {
+    cosim->tail_cache = atomic_load_explicit(&cosim->tail, memory_order_acquire);
+    if (head - cosim->tail_cache == RING_SIZE)
+    {
+      sched_yield();
+    }
+  }
+  cosim->ring[head & (RING_SIZE - 1)] = *record;
+  atomic_store_explicit(&cosim->head, head + 1, memory_order_release);
+}
+
+static void print_record(FILE *report, const char *label,
+                         const APEX_Retire_Record *record)
+{
+  fprintf(report, "  %-9s pc(%d)", label, record->pc);
+  if (record->rd >= 0)
+  {
+    fprintf(report, " R%d=%d", record->rd, record->value);
+  }
+  if (record->mem_address >= 0)
+  {
+    fprintf(report, " MEM[%d]=%d", record->mem_address, record->mem_value);
+  }
+  if (record->cycle)
+  {
+    fprintf(report, " cycle %d", record->cycle);
+  }
+  fprintf(report, "\n");
+}
+
+long APEX_cosim_finish(APEX_Cosim *cosim, FILE *report)
+{
+  atomic_store_explicit(&cosim->closed, 1, memory_order_release);
+  pthread_join(cosim->thread, NULL);
+
+  long divergence = cosim->divergence;
+  if (report && divergence < 0)
+  {
+    fprintf(report, "APEX_COSIM : %ld retired instructions match the reference model\n",
+            cosim->checked);
+  }
+  else if (report)
+  {
+    fprintf(report, "APEX_COSIM : Divergence at retired instruction %ld, %s differs\n",
+            divergence, cosim->what);
+    long first = divergence > CONTEXT_RECORDS ? divergence - CONTEXT_RECORDS : 0;
+    for (long i = first; i < divergence; ++i)
+    {
+      print_record(report, "matched", &cosim->history[i % CONTEXT_RECORDS]);
+    }
+    print_record(report, "pipeline", &cosim->actual);
+    print_record(report, "reference", &cosim->expected);
+  }
+
+  free(cosim);
+  return divergence;
+}
@@ -0,0 +1,27 @@
+#ifndef _APEX_COSIM_H_
+#define _APEX_COSIM_H_
+/*
+ *  cosim.h
+ *  Lockstep check of the pipeline model against the reference
+ *  interpreter, which runs on its own thread
+ */
+#include <stdio.h>
+#include "functional.h"
+
+typedef struct APEX_Cosim APEX_Cosim;
+
+/* The interpreter starts from a copy of memory, or zeroes if NULL */
+APEX_Cosim *APEX_cosim_start(const APEX_Instruction *code_memory,
+                             int code_memory_size, const int *memory);
+
+/* Called by the pipeline for every retired instruction, never blocks long */
+void APEX_cosim_retire(APEX_Cosim *cosim, const APEX_Retire_Record *record);
+
+/*
+ * Waits for the checker to catch up and stops it. Prints a summary,
+ * and the first divergence with context, to report if not NULL.
+ * Returns the retire index of the first divergence, or -1 if none.
+ */
+long APEX_cosim_finish(APEX_Cosim *cosim, FILE *report);
+
+#endif
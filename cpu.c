@@ -1,44 +1,223 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "cpu.h"
+#include "cache.h"
+#include "cosim.h"
+#include "memimage.h"
+#include "prefetch.h"
+#include "trace.h"
 
 #define ENABLE_DEBUG_MESSAGES 1
 
-APEX_CPU *APEX_cpu_init(const char *filename)
+/* value_cycle of a result not yet on a result bus */
+#define RESULT_PENDING INT_MAX
+
+/* Instructions rename resolves itself, see rename_idiom() */
+#define IDIOM_ZERO 1
+#define IDIOM_MOVE 2
+
+struct QueueEntry IQ[8];
+struct LSQ LSQ[6];
+struct functionalUnits functionalUnits;
+
+/* Sets up config.ports, every class needs a port executing it */
+static int init_ports(APEX_CPU *cpu)
 {
-  if (!filename)
+  static const char *const names[APEX_PORT_CLASSES] = {"ALU", "AGU", "branch", "MUL"};
+  int covered = 0;
+
+  cpu->port_conflict_cycle = -1;
+  for (int p = 0; p < cpu->config.ports; ++p)
+  {
+    cpu->port[p].classes = cpu->config.port_classes[p];
+    cpu->port[p].taken = -1;
+    covered |= cpu->port[p].classes;
+  }
+  for (int c = 0; c < APEX_PORT_CLASSES && cpu->config.ports; ++c)
+  {
+    if (!(covered & (1 << c)))
+    {
+      fprintf(stderr, "APEX_Error : No port executes %s instructions\n", names[c]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Starts data memory from config.mem_image, read or mapped */
+static int load_memory(APEX_CPU *cpu)
+{
+  if (!cpu->config.mem_mmap || !cpu->config.mem_image[0])
+  {
+    return APEX_memory_image_load(&cpu->config, cpu->data_memory);
+  }
+  cpu->mapped_memory = APEX_memory_image_map(cpu->config.mem_image);
+  if (!cpu->mapped_memory)
+  {
+    return -1;
+  }
+  cpu->memory = cpu->mapped_memory;
+  return 0;
+}
+
+/*
+ * Creates a CPU over an already parsed program. The code memory is
+ * only read, so several CPUs may share one parsed program.
+ */
+APEX_CPU *APEX_cpu_create(APEX_Instruction *code_memory, int code_memory_size,
+                          const APEX_Config *config)
+{
+  if (!code_memory)
   {
     return NULL;
   }
 
-  APEX_CPU *cpu = malloc(sizeof(*cpu));
+  APEX_CPU *cpu = calloc(1, sizeof(*cpu));
   if (!cpu)
   {
     return NULL;
   }
 
+  if (config)
+  {
+    cpu->config = *config;
+  }
+  else
+  {
+    APEX_config_default(&cpu->config);
+  }
+
   cpu->pc = 4000;
-  memset(cpu->regs, 0, sizeof(int) * 32);
+  memset(cpu->regs, 0, sizeof(cpu->regs));
   memset(cpu->freeRegisterFlag, 1, sizeof(int) * 32);
   memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
   memset(cpu->data_memory, 0, sizeof(int) * 4000);
 
+  /* Slot 0 stays as the bubble, every other slot starts on the free list */
+  memset(&cpu->uop_pool[APEX_UOP_BUBBLE], 0, sizeof(APEX_Uop));
+  cpu->uop_pool[APEX_UOP_BUBBLE].opcode = "";
+  cpu->uop_free_count = 0;
+  for (int i = APEX_UOP_POOL_SIZE - 1; i > APEX_UOP_BUBBLE; --i)
+  {
+    cpu->uop_free[cpu->uop_free_count++] = i;
+  }
+  cpu->rob_head = 0;
+  cpu->rob_tail = 0;
+  cpu->rob_count = 0;
+  APEX_store_sets_init(&cpu->store_sets);
+
     for(int i=0; i<24;i++)
     {
-        prf[i].valid=1;
-        prf[i].value=-1;
-        prf[i].latest=0;
+        cpu->prf[i].valid=1;
+        cpu->prf[i].value=-1;
+        cpu->prf[i].latest=0;
 
     }
-  cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
+  memset(cpu->prf_alias, -1, sizeof(cpu->prf_alias));
+  cpu->code_memory = code_memory;
+  cpu->code_memory_size = code_memory_size;
+  cpu->memory = cpu->data_memory;
+  cpu->threads = 1;
+  if (init_ports(cpu) != 0)
+  {
+    free(cpu);
+    return NULL;
+  }
+  cpu->topdown.region_size = cpu->config.topdown_region;
+  cpu->topdown.next_region = cpu->config.topdown_region;
+
+  if (cpu->config.dcache)
+  {
+    cpu->dcache = APEX_cache_create(&cpu->config, 0, NULL);
+    if (!cpu->dcache)
+    {
+      free(cpu);
+      return NULL;
+    }
+  }
+
+  cpu->front_end.loop_start = -1;
+  cpu->front_end.loop_end = -1;
+  if (cpu->config.uop_cache)
+  {
+    cpu->front_end.uop_cache = malloc(sizeof(APEX_Decoded) * cpu->config.uop_cache);
+    if (!cpu->front_end.uop_cache)
+    {
+      APEX_cache_free(cpu->dcache);
+      free(cpu);
+      return NULL;
+    }
+    for (int i = 0; i < cpu->config.uop_cache; ++i)
+    {
+      cpu->front_end.uop_cache[i].pc = -1;
+    }
+  }
 
-  if (!cpu->code_memory)
+  /* Multi-core runs attach the caches later, the prefetcher goes with the core */
+  if (cpu->config.prefetch != APEX_PREFETCH_NONE)
   {
+    cpu->prefetcher = APEX_prefetcher_create(&cpu->config);
+    if (!cpu->prefetcher)
+    {
+      free(cpu->front_end.uop_cache);
+      APEX_cache_free(cpu->dcache);
+      free(cpu);
+      return NULL;
+    }
+  }
+
+  /* Before the checker starts, it copies the initial memory */
+  if (load_memory(cpu) != 0)
+  {
+    APEX_prefetcher_free(cpu->prefetcher);
+    free(cpu->front_end.uop_cache);
+    APEX_cache_free(cpu->dcache);
     free(cpu);
     return NULL;
   }
 
+  if (cpu->config.cosim)
+  {
+    cpu->cosim = APEX_cosim_start(code_memory, code_memory_size, cpu->memory);
+    if (!cpu->cosim)
+    {
+      APEX_memory_image_unmap(cpu->mapped_memory);
+      APEX_prefetcher_free(cpu->prefetcher);
+      free(cpu->front_end.uop_cache);
+      APEX_cache_free(cpu->dcache);
+      free(cpu);
+      return NULL;
+    }
+  }
+
+  for (int i = 1; i < NUM_STAGES; ++i)
+  {
+    cpu->stage[i].busy = 1;
+  }
+
+  return cpu;
+}
+
+APEX_CPU *APEX_cpu_init(const char *filename, const APEX_Config *config)
+{
+  if (!filename)
+  {
+    return NULL;
+  }
+
+  int code_memory_size = 0;
+  APEX_Instruction *code_memory = create_code_memory(filename, &code_memory_size);
+  APEX_CPU *cpu = APEX_cpu_create(code_memory, code_memory_size, config);
+
+  if (!cpu)
+  {
+    free(code_memory);
+    return NULL;
+  }
+  cpu->owns_code_memory = 1;
+
   if (ENABLE_DEBUG_MESSAGES)
   {
     fprintf(stderr,
@@ -58,12 +237,44 @@ APEX_CPU *APEX_cpu_init(const char *filename)
     }
   }
 
+  return cpu;
+}
+
+/*
+ * Creates a CPU fetching from a recorded trace instead of code memory.
+ * The trace already holds every instruction, so no program is loaded.
+ */
+APEX_CPU *APEX_cpu_init_trace(const char *trace_file, const APEX_Config *config)
+{
+  if (config && config->cosim)
+  {
+    fprintf(stderr, "APEX_Error : cosim needs the program, not a trace\n");
+    return NULL;
+  }
+
+  APEX_Trace_Reader *trace = APEX_trace_reader_open(trace_file);
+  if (!trace)
+  {
+    return NULL;
+  }
 
-  for (int i = 1; i < NUM_STAGES; ++i)
+  /* An empty code memory, fetch never reads it in trace mode */
+  APEX_Instruction *code_memory = calloc(1, sizeof(APEX_Instruction));
+  APEX_CPU *cpu = APEX_cpu_create(code_memory, 0, config);
+  if (!cpu)
   {
-    cpu->stage[i].busy = 1;
+    free(code_memory);
+    APEX_trace_reader_close(trace);
+    return NULL;
   }
+  cpu->owns_code_memory = 1;
+  cpu->trace = trace;
 
+  if (ENABLE_DEBUG_MESSAGES)
+  {
+    fprintf(stderr, "APEX_CPU : Initialized APEX CPU, fetching from trace %s\n",
+            trace_file);
+  }
   return cpu;
 }
 
@@ -79,1018 +290,2927 @@ int fun(struct prf prf[]) {
 }
 
 void freephyreg(struct prf prf[], int free){
+    /* Lookups that found no mapping come back as 24 */
+    if (free < 0 || free >= 24)
+        return;
     prf[free].latest=0;
     prf[free].valid=1;
     prf[free].arf_val=-1;
     prf[free].value=-1;
 }
 
-void APEX_cpu_stop(APEX_CPU *cpu)
+/* Whether an entry, its own or one it shares, names reg */
+static int reg_named(const APEX_CPU *cpu, int reg)
 {
-  free(cpu->code_memory);
-  free(cpu);
+    if (cpu->prf_alias[reg] >= 0)
+        return 1;
+    for (int i = 0; i < 24; ++i)
+    {
+        if (cpu->prf[i].value == reg)
+            return 1;
+    }
+    return 0;
 }
 
-int get_code_index(int pc)
+/* Gives a source register no entry names yet its first entry */
+static void rename_source(APEX_CPU *cpu, int reg)
 {
-  return (pc - 4000) / 4;
+    if (reg_named(cpu, reg))
+        return;
+    int pcount = fun(cpu->prf);
+    cpu->prf[pcount].value = reg;
+    cpu->prf[pcount].valid = 0;
 }
 
-static void print_instruction(CPU_Stage *stage)
+/*
+ * Frees entry i, unless registers share it: then the first of them
+ * owns it and the rest go on sharing it
+ */
+static void release_entry(struct prf prf[], int alias[], int i)
 {
+    if (i < 0 || i >= 24)
+        return;
+    for (int reg = 0; reg < APEX_THREAD_REGS * APEX_MAX_THREADS; ++reg)
+    {
+        if (alias[reg] == i)
+        {
+            prf[i].value = reg;
+            alias[reg] = -1;
+            return;
+        }
+    }
+    freephyreg(prf, i);
+}
 
-  if (
-      strcmp(stage->opcode, "ADD") == 0 ||
-      strcmp(stage->opcode, "SUB") == 0 ||
-      strcmp(stage->opcode, "MUL") == 0 ||
-      strcmp(stage->opcode, "AND") == 0 ||
-      strcmp(stage->opcode, "OR") == 0 ||
-      strcmp(stage->opcode, "XOR") == 0)
+/* Puts a result in rd's pending physical register, releasing the one it replaces */
+static void prf_apply(struct prf prf[], int alias[], int rd, int value)
+{
+    int frd=0,free=0;
+    for (int i = 0; i <24 ; ++i) {
+        if(prf[i].value==rd && prf[i].latest==0){
+            break;
+        }
+        else frd++;
+    }
+    for (int i = 0; i <24 ; ++i) {
+        if(prf[i].value==rd && prf[i].latest==1){
+            break;
+        }
+        else free++;
+    }
+    release_entry(prf, alias, free);
+    alias[rd] = -1;
+    if (frd < 24)
+    {
+        prf[frd].arf_val=value;
+        prf[frd].latest=1;
+    }
+}
+
+/* Writes a result, logged so a branch checkpoint can replay it */
+static void prf_write_value(APEX_CPU *cpu, long seq, int rd, int value)
+{
+    APEX_Prf_Write *entry = &cpu->prf_log[cpu->prf_log_count % APEX_PRF_LOG_SIZE];
+    entry->seq = seq;
+    entry->rd = rd;
+    entry->value = value;
+    cpu->prf_log_count++;
+    prf_apply(cpu->prf, cpu->prf_alias, rd, value);
+}
+
+static void prf_write(APEX_CPU *cpu, const APEX_Uop *uop)
+{
+    prf_write_value(cpu, uop->seq, uop->rd, uop->buffer);
+}
+
+/*
+ * Takes an entry from the uop pool, returns the bubble slot
+ * when every entry is in flight
+ */
+int uop_alloc(APEX_CPU *cpu)
+{
+  if (cpu->uop_free_count == 0)
   {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+    return APEX_UOP_BUBBLE;
   }
+  int uop = cpu->uop_free[--cpu->uop_free_count];
+  cpu->uop_pool[uop].completed = 0;
+  cpu->uop_pool[uop].fused = 0;
+  return uop;
+}
 
-  if (strcmp(stage->opcode, "LOAD") == 0)
+/* Returns an entry to the uop pool at retire or squash */
+void uop_free(APEX_CPU *cpu, int uop)
+{
+  if (uop == APEX_UOP_BUBBLE)
   {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+    return;
   }
+  cpu->uop_free[cpu->uop_free_count++] = uop;
+}
+
+static int is_store(int op)
+{
+  return op == APEX_OP_STORE || op == APEX_OP_STR;
+}
+
+static int is_load(int op)
+{
+  return op == APEX_OP_LOAD || op == APEX_OP_LDR;
+}
+
+static int is_branch(int op)
+{
+  return op == APEX_OP_BZ || op == APEX_OP_BNZ || op == APEX_OP_JUMP;
+}
+
+static int sets_zero_flag(int op)
+{
+  return op == APEX_OP_ADD || op == APEX_OP_SUB || op == APEX_OP_MUL ||
+         op == APEX_OP_ADDL || op == APEX_OP_SUBL;
+}
 
-  if (strcmp(stage->opcode, "STORE") == 0)
+/* Static prediction at fetch, backward BZ and BNZ are taken, the rest fall through */
+static int predict_next_pc(const APEX_Uop *uop)
+{
+  if ((uop->op == APEX_OP_BZ || uop->op == APEX_OP_BNZ) && uop->imm < 0)
   {
-    printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
+    return uop->pc + uop->imm;
   }
-    if (strcmp(stage->opcode, "STR") == 0)
-    {
-        printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rs1, stage->rs2, stage->rs3);
-    }
+  return uop->pc + 4;
+}
 
-  if (strcmp(stage->opcode, "MOVC") == 0)
+/*
+ * Next pc after a branch fetched from a trace. A taken JUMP's target is
+ * not recorded, so no prediction matches it.
+ */
+static int trace_next_pc(const APEX_Uop *uop)
+{
+  if (!uop->trace_taken)
   {
-    printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
+    return uop->pc + 4;
   }
+  return uop->op == APEX_OP_JUMP ? -1 : uop->pc + uop->imm;
+}
 
-  if (strcmp(stage->opcode, "HALT") == 0)
+/* Marks the instruction in a latch as done and empties the latch */
+static void complete_latch(APEX_CPU *cpu, CPU_Stage *latch)
+{
+  if (latch->uop != APEX_UOP_BUBBLE)
   {
-    printf("%s  ", stage->opcode);
+    cpu->uop_pool[latch->uop].completed = 1;
   }
+  latch->uop = APEX_UOP_BUBBLE;
+}
 
-  if (strcmp(stage->opcode, "BZ") == 0)
+/*
+ * Finds the youngest instruction older than ROB slot pos that writes
+ * reg, the head of a fused pair included. Returns 0 when the value is
+ * in the register file, else gives the value and the cycle from which
+ * dependents may use it.
+ */
+static int rob_writer(APEX_CPU *cpu, int pos, int reg, int *value, int *cycle)
+{
+  for (int i = pos; i != cpu->rob_head;)
   {
-    printf("%s,#%d ", stage->opcode, stage->imm);
+    i = (i + APEX_ROB_SIZE - 1) % APEX_ROB_SIZE;
+    APEX_Uop *older = &cpu->uop_pool[cpu->rob[i]];
+    if (older->rd == reg && APEX_op_writes_register(older->op))
+    {
+      *value = older->buffer;
+      *cycle = older->value_cycle;
+      return 1;
+    }
+    if (older->fused && older->head_rd == reg)
+    {
+      *value = older->head_value;
+      *cycle = older->head_cycle;
+      return 1;
+    }
   }
+  return 0;
+}
 
-  if (strcmp(stage->opcode, "LDR") == 0)
+/*
+ * Value of reg as the instruction at ROB slot pos sees it, from the
+ * youngest older writer still in the ROB or else the register file.
+ * Returns 0 until that writer's result is on the bypass.
+ */
+static int rob_operand(APEX_CPU *cpu, int pos, int reg, int *value)
+{
+  int cycle;
+  if (!rob_writer(cpu, pos, reg, value, &cycle))
   {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+    *value = cpu->regs[reg];
+    return 1;
   }
+  return cycle <= cpu->clock;
+}
 
-  if (strcmp(stage->opcode, "STR") == 0)
+/* Operand of a queued op, the head of its own fused pair included */
+static int uop_operand(APEX_CPU *cpu, const APEX_Uop *uop, int reg, int *value)
+{
+  if (uop->fused && uop->head_rd == reg)
   {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+    *value = uop->head_value;
+    return uop->head_cycle <= cpu->clock;
   }
+  return rob_operand(cpu, uop->rob_slot, reg, value);
+}
+
+/*
+ * Puts a result on a result bus, dependents may issue bypass_latency
+ * cycles later. With every bus taken the result queues for the next
+ * cycle, ahead of the results produced then.
+ */
+static void broadcast(APEX_CPU *cpu, int index)
+{
+  APEX_Bypass *bypass = &cpu->bypass;
+  APEX_Uop *uop = &cpu->uop_pool[index];
 
-  if (strcmp(stage->opcode, "ADDL") == 0)
+  if (cpu->config.result_buses && bypass->used == cpu->config.result_buses)
   {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+    bypass->waiting[bypass->waiting_count] = index;
+    bypass->waiting_seq[bypass->waiting_count] = uop->seq;
+    bypass->waiting_count++;
+    bypass->bus_waits++;
+    return;
   }
+  bypass->used++;
+  bypass->results++;
+  uop->value_cycle = cpu->clock + cpu->config.bypass_latency;
+}
 
-  if (strcmp(stage->opcode, "SUBL") == 0)
+/* Frees the result buses for a new cycle, queued results go first */
+static void bypass_cycle(APEX_CPU *cpu)
+{
+  APEX_Bypass *bypass = &cpu->bypass;
+  int waiting[APEX_UOP_POOL_SIZE];
+  long waiting_seq[APEX_UOP_POOL_SIZE];
+  int count = bypass->waiting_count;
+
+  memcpy(waiting, bypass->waiting, sizeof(int) * count);
+  memcpy(waiting_seq, bypass->waiting_seq, sizeof(long) * count);
+  bypass->used = 0;
+  bypass->waiting_count = 0;
+  for (int i = 0; i < count; ++i)
   {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+    /* A squashed result has nobody left to feed */
+    if (cpu->uop_pool[waiting[i]].seq == waiting_seq[i])
+    {
+      broadcast(cpu, waiting[i]);
+    }
   }
+}
 
-  if (strcmp(stage->opcode, "JUMP") == 0)
+/* Registers an ALU or MUL op reads, returns how many */
+static int alu_sources(int op, int rs1, int rs2, int *sources)
+{
+  int count = 0;
+  switch (op)
   {
-    printf("%s,R%d,#%d ", stage->opcode, stage->rs1, stage->imm);
+  case APEX_OP_ADD:
+  case APEX_OP_SUB:
+  case APEX_OP_MUL:
+    sources[count++] = rs2;
+    /* fall through */
+  case APEX_OP_ADDL:
+  case APEX_OP_SUBL:
+    sources[count++] = rs1;
+    break;
+  default:
+    break;
   }
+  return count;
+}
 
-  if (strcmp(stage->opcode, "BNZ") == 0)
+/*
+ * With config.eliminate, MOVC Rx,#0 and SUB Rx,Ry,Ry are zero idioms
+ * and ADDL or SUBL Rx,Ry,#0 a move. Rename gives them their value and
+ * they skip the functional units.
+ */
+static int rename_idiom(const APEX_CPU *cpu, const APEX_Uop *uop)
+{
+  if (!cpu->config.eliminate || uop->fused)
+    return 0;
+  switch (uop->op)
   {
-    printf("%s,#%d ", stage->opcode, stage->imm);
+  case APEX_OP_MOVC:
+    return uop->imm == 0 ? IDIOM_ZERO : 0;
+  case APEX_OP_SUB:
+    return uop->rs1 == uop->rs2 ? IDIOM_ZERO : 0;
+  case APEX_OP_ADDL:
+  case APEX_OP_SUBL:
+    return uop->imm == 0 ? IDIOM_MOVE : 0;
+  default:
+    return 0;
   }
 }
 
-static void print_stage_content(char *name, CPU_Stage *stage)
+/* Whether an instruction in the ROB has yet to write reg's entry */
+static int write_pending(const APEX_CPU *cpu, int reg)
 {
-  printf("%-15s: pc(%d) ", name, stage->pc);
-  print_instruction(stage);
-  printf("\n");
+  for (int n = 0; n < cpu->rob_count; ++n)
+  {
+    const APEX_Uop *uop = &cpu->uop_pool[cpu->rob[(cpu->rob_head + n) % APEX_ROB_SIZE]];
+    if (uop->fused && uop->head_rd == reg && uop->head_cycle == RESULT_PENDING)
+      return 1;
+    if (uop->rd == reg && APEX_op_writes_register(uop->op) &&
+        uop->value_cycle == RESULT_PENDING)
+      return 1;
+  }
+  return 0;
 }
 
-int fetch(APEX_CPU *cpu)
+/* The entry holding reg's latest value, its own or a shared one, -1 if none */
+static int latest_entry(const APEX_CPU *cpu, int reg)
 {
-  CPU_Stage *stage = &cpu->stage[F];
-  if (stage->flush == 1)
+  if (cpu->prf_alias[reg] >= 0)
+    return cpu->prf_alias[reg];
+  for (int i = 0; i < 24; ++i)
   {
-    strcpy(stage->opcode, " ");
+    if (cpu->prf[i].value == reg && cpu->prf[i].latest == 1)
+      return i;
   }
-  if (!stage->busy && !stage->stalled)
-  {
-    /* Store current PC in fetch latch */
-    stage->pc = cpu->pc;
+  return -1;
+}
+
+/*
+ * Whether an eliminated idiom renames its destination onto an entry
+ * already holding the value, the shared zero entry or a move's source
+ * entry, instead of taking one. Not while an older instruction still
+ * has to write either register.
+ */
+static int idiom_shares(const APEX_CPU *cpu, const APEX_Uop *uop)
+{
+  int idiom = rename_idiom(cpu, uop);
+  if (!idiom || write_pending(cpu, uop->rd))
+    return 0;
+  if (idiom == IDIOM_MOVE)
+    return !write_pending(cpu, uop->rs1) && latest_entry(cpu, uop->rs1) >= 0;
+  return 1;
+}
 
-    APEX_Instruction *current_ins = &cpu->code_memory[get_code_index(cpu->pc)];
-    strcpy(stage->opcode, current_ins->opcode);
-    stage->rd = current_ins->rd;
-    stage->rs1 = current_ins->rs1;
-    stage->rs2 = current_ins->rs2;
-    stage->imm = current_ins->imm;
-    stage->rd = current_ins->rd;
+/* Points an idiom's destination at the entry idiom_shares() found */
+static void share_entry(APEX_CPU *cpu, const APEX_Uop *uop, int idiom)
+{
+  int entry = idiom == IDIOM_MOVE ? latest_entry(cpu, uop->rs1) : APEX_PRF_ZERO;
+  if (idiom == IDIOM_MOVE && uop->rs1 == uop->rd)
+    return;
+  if (cpu->prf_alias[uop->rd] < 0)
+    release_entry(cpu->prf, cpu->prf_alias, latest_entry(cpu, uop->rd));
+  cpu->prf_alias[uop->rd] = entry;
+}
 
-    /* Update PC for next instruction */
-    cpu->pc += 4;
+/* Rename table lines of the registers sharing an entry */
+static void print_shared(const APEX_CPU *cpu)
+{
+  for (int reg = 0; reg < APEX_THREAD_REGS * cpu->threads; ++reg)
+  {
+    if (cpu->prf_alias[reg] == APEX_PRF_ZERO)
+      printf("|R[%d] = zero entry|\n", reg);
+    else if (cpu->prf_alias[reg] >= 0)
+      printf("|R[%d] = P%d shared|\n", reg, cpu->prf_alias[reg]);
+  }
+}
 
-    /* Copy data from fetch latch to decode latch*/
-    cpu->stage[DRF] = cpu->stage[F];
+/*
+ * Registers the ALU or MUL op in decode reads before it issues. Memory
+ * ops go ahead, the load/store queue waits for their operands. The
+ * second half of a fused pair gets the head's result inside the uop.
+ */
+static int issue_sources(APEX_CPU *cpu, const APEX_Uop *uop, int sources[4])
+{
+  int own[2];
+  int count = 0;
 
-    if (ENABLE_DEBUG_MESSAGES)
+  if (uop->fused)
+  {
+    count = alu_sources(uop->head_op, uop->head_rs1, uop->head_rs2, sources);
+  }
+  /* A zero idiom does not depend on its sources */
+  int own_count = rename_idiom(cpu, uop) == IDIOM_ZERO
+                      ? 0
+                      : alu_sources(uop->op, uop->rs1, uop->rs2, own);
+  for (int i = 0; i < own_count; ++i)
+  {
+    if (!uop->fused || own[i] != uop->head_rd)
     {
-      print_stage_content("Fetch", stage);
+      sources[count++] = own[i];
     }
   }
-  else
-    printf("Fetch :\n");
-  return 0;
+  return count;
 }
 
-int decode(APEX_CPU *cpu)
+/*
+ * Whether the op at ROB slot pos, or in decode when pos is the tail,
+ * can read every source this cycle, off the bypass or from the
+ * register file
+ */
+static int sources_ready(APEX_CPU *cpu, const APEX_Uop *uop, int pos)
 {
-    int intcounter=0,mulcounter=0;
-  CPU_Stage *stage = &cpu->stage[DRF];
+  int sources[4];
+  int count = issue_sources(cpu, uop, sources);
+  int value, cycle;
 
-  if (stage->flush == 1)
+  for (int i = 0; i < count; ++i)
   {
-    strcpy(stage->opcode, " ");
+    if (rob_writer(cpu, pos, sources[i], &value, &cycle) && cycle > cpu->clock)
+      return 0;
   }
+  return 1;
+}
 
-  if (!stage->busy && !stage->stalled)
-  {
+/* sources_ready, counting where the operands came from */
+static int operands_ready(APEX_CPU *cpu, const APEX_Uop *uop, int pos)
+{
+  int sources[4];
+  int count = issue_sources(cpu, uop, sources);
+  int value, cycle;
 
-    /* Read data from register file for store */
-    if (strcmp(stage->opcode, "STORE") == 0)
+  if (!sources_ready(cpu, uop, pos))
+  {
+    cpu->bypass.issue_stalls++;
+    return 0;
+  }
+  for (int i = 0; i < count; ++i)
+  {
+    if (rob_writer(cpu, pos, sources[i], &value, &cycle) &&
+        cycle == cpu->clock)
     {
-
-        stage->rs1_value = cpu->regs[stage->rs1];
-        stage->rs2_value = cpu->regs[stage->rs2];
-        cpu->stage[F].stalled = 0;
-        cpu->stage[DRF].stalled = 0;
-          int rs1f=0,rs2f=0;
-          for (int i = 0; i <24 ; ++i)
-          {
-              if(stage->rs1==prf[i].value){
-                  rs1f=-1;
-                  break;
-              }
-          }
-          for (int i = 0; i <24 ; ++i)
-          {
-              if(stage->rs2==prf[i].value){
-                  rs2f=-1;
-                  break;
-              }
-          }
-          if(rs1f!=-1) {
-              pcount = fun(prf);
-              prf[pcount].value = stage->rs1;
-              prf[pcount].valid = 0;
-          }
-          if(rs2f!=-1) {
-              pcount = fun(prf);
-              prf[pcount].value = stage->rs2;
-              prf[pcount].valid = 0;
-          }
-
-    }
-    if (strcmp(stage->opcode, "LOAD") == 0)
+      cpu->bypass.forwarded++;
+    }
+    else
     {
+      cpu->bypass.from_rf++;
+    }
+  }
+  return 1;
+}
 
-        stage->rs1_value = cpu->regs[stage->rs1];
-        cpu->stage[F].stalled = 0;
-        cpu->stage[DRF].stalled = 0;
-        int rs1f=0;
-        for (int i = 0; i <24 ; ++i)
-        {
-            if(stage->rs1==prf[i].value){
-                rs1f=-1;
-                break;
-            }
-        }
+/* Loads thread's pc and program for fetch, putting the current thread's away */
+static void switch_thread(APEX_CPU *cpu, int thread)
+{
+  APEX_Context *from = &cpu->context[cpu->thread];
+  APEX_Context *to = &cpu->context[thread];
+
+  if (thread == cpu->thread)
+    return;
+  from->pc = cpu->pc;
+  from->code_memory = cpu->code_memory;
+  from->code_memory_size = cpu->code_memory_size;
+  cpu->pc = to->pc;
+  cpu->code_memory = to->code_memory;
+  cpu->code_memory_size = to->code_memory_size;
+  cpu->thread = thread;
+}
 
-        if(rs1f!=-1) {
-            pcount = fun(prf);
-            prf[pcount].value = stage->rs1;
-            prf[pcount].valid = 0;
-        }
-        pcount=fun(prf);
-        prf[pcount].value=stage->rd;
-        prf[pcount].valid=0;
+static void set_thread_pc(APEX_CPU *cpu, int thread, int pc)
+{
+  if (thread == cpu->thread)
+    cpu->pc = pc;
+  else
+    cpu->context[thread].pc = pc;
+}
 
-    }
-    if (strcmp(stage->opcode, "ADD") == 0)
-    {
+/* Whether thread's pc is still in its program */
+static int thread_has_code(const APEX_CPU *cpu, int thread)
+{
+  const APEX_Context *context = &cpu->context[thread];
+  int current = thread == cpu->thread;
+  int index = get_code_index(current ? cpu->pc : context->pc);
+  return index >= 0 && index < (current ? cpu->code_memory_size : context->code_memory_size);
+}
 
+/*
+ * Picks the thread fetch works in this cycle among those with code
+ * left: the next one round robin or, with ICOUNT, the one with the
+ * fewest instructions fetched and not completed, ties round robin.
+ */
+static void select_thread(APEX_CPU *cpu)
+{
+  int counts[APEX_MAX_THREADS] = {0};
+  int best = -1;
 
-        stage->rs1_value = cpu->regs[stage->rs1];
-        stage->rs2_value = cpu->regs[stage->rs2];
-        int rs1f=0,rs2f=0;
-        for (int i = 0; i <24 ; ++i)
-        {
-            if(stage->rs1==prf[i].value){
-                rs1f=-1;
-                break;
-            }
-        }
-        for (int i = 0; i <24 ; ++i)
-        {
-            if(stage->rs2==prf[i].value){
-                rs2f=-1;
-                break;
-            }
-        }
-        if(rs1f!=-1) {
-            pcount = fun(prf);
-            prf[pcount].value = stage->rs1;
-            prf[pcount].valid = 0;
-        }
-        if(rs2f!=-1) {
-            pcount = fun(prf);
-            prf[pcount].value = stage->rs2;
-            prf[pcount].valid = 0;
-        }
-          pcount=fun(prf);
-          prf[pcount].value=stage->rd;
-          prf[pcount].valid=0;
+  if (cpu->config.smt_fetch == APEX_SMT_FETCH_ICOUNT)
+  {
+    for (int s = F; s <= DRF; ++s)
+    {
+      if (cpu->stage[s].uop != APEX_UOP_BUBBLE)
+        counts[cpu->uop_pool[cpu->stage[s].uop].thread]++;
+    }
+    for (int n = 0; n < cpu->rob_count; ++n)
+    {
+      APEX_Uop *uop = &cpu->uop_pool[cpu->rob[(cpu->rob_head + n) % APEX_ROB_SIZE]];
+      if (!uop->completed)
+        counts[uop->thread]++;
+    }
+  }
+  for (int n = 1; n <= cpu->threads; ++n)
+  {
+    int thread = (cpu->thread + n) % cpu->threads;
+    if (thread_has_code(cpu, thread) && (best < 0 || counts[thread] < counts[best]))
+      best = thread;
+  }
+  if (best >= 0)
+    switch_thread(cpu, best);
+}
+
+/* Moves a fetched instruction's registers into its thread's part of the file */
+static void rename_thread_regs(APEX_Uop *uop, int thread)
+{
+  int base = thread * APEX_THREAD_REGS;
+  if (uop->rd >= 0)
+    uop->rd += base;
+  if (uop->rs1 >= 0)
+    uop->rs1 += base;
+  if (uop->rs2 >= 0)
+    uop->rs2 += base;
+  if (uop->rs3 >= 0)
+    uop->rs3 += base;
+}
+
+/* Data memory of an instruction's thread */
+static int *thread_memory(APEX_CPU *cpu, const APEX_Uop *uop)
+{
+  return uop->thread ? cpu->context[uop->thread].memory : cpu->memory;
+}
+
+/*
+ * Physical registers decode takes to rename uop: its destination, the
+ * head's of a fused pair, and a first entry for a source no entry
+ * names yet. An idiom sharing an entry takes none. Mirrors the
+ * renaming in decode().
+ */
+static int rename_needs(const APEX_CPU *cpu, const APEX_Uop *uop)
+{
+  int sources[3];
+  int count = 0;
+  int need = uop->fused ? 1 : 0;
+
+  if (idiom_shares(cpu, uop))
+    return 0;
+  switch (uop->op)
+  {
+  case APEX_OP_STORE:
+    sources[count++] = uop->rs1;
+    sources[count++] = uop->rs2;
+    break;
+  case APEX_OP_ADD:
+  case APEX_OP_SUB:
+  case APEX_OP_MUL:
+    sources[count++] = uop->rs1;
+    sources[count++] = uop->rs2;
+    need++;
+    break;
+  case APEX_OP_STR:
+    sources[count++] = uop->rs1;
+    sources[count++] = uop->rs2;
+    sources[count++] = uop->rs3;
+    break;
+  case APEX_OP_LDR:
+    sources[count++] = uop->rs1;
+    sources[count++] = uop->rs2;
+    need++;
+    break;
+  case APEX_OP_LOAD:
+  case APEX_OP_ADDL:
+  case APEX_OP_SUBL:
+    sources[count++] = uop->rs1;
+    need++;
+    break;
+  case APEX_OP_MOVC:
+    need++;
+    break;
+  default:
+    break;
+  }
+  for (int n = 0; n < count; ++n)
+  {
+    int named = uop->fused && sources[n] == uop->head_rd;
+    for (int m = 0; m < n; ++m)
+      named |= sources[m] == sources[n];
+    if (!named && !reg_named(cpu, sources[n]))
+      need++;
+  }
+  return need;
+}
+
+/*
+ * Whether uop may dispatch as far as physical registers and, with
+ * several threads, the per-thread ROB and register limits go
+ */
+static int dispatch_fits(APEX_CPU *cpu, const APEX_Uop *uop)
+{
+  int need = rename_needs(cpu, uop);
+  int free = 0;
+
+  for (int i = 0; i < 24; ++i)
+  {
+    if (cpu->prf[i].valid == 1 && cpu->prf[i].value == -1)
+      free++;
+  }
+  if (need > free)
+    return 0;
+  if (cpu->threads == 1 || (!cpu->config.smt_rob && !cpu->config.smt_prf))
+    return 1;
+
+  /* The caps count what the thread's instructions in flight took */
+  int held = 0, renamed = 0;
+  for (int n = 0; n < cpu->rob_count; ++n)
+  {
+    const APEX_Uop *older = &cpu->uop_pool[cpu->rob[(cpu->rob_head + n) % APEX_ROB_SIZE]];
+    if (older->thread != uop->thread)
+      continue;
+    held++;
+    renamed += (older->rd >= 0) + (older->fused != 0);
+  }
+  if (cpu->config.smt_rob && held >= cpu->config.smt_rob)
+    return 0;
+  if (cpu->config.smt_prf && renamed + need > cpu->config.smt_prf)
+    return 0;
+  return 1;
+}
+
+/* Snapshots the rename state for a branch entering the ROB */
+static void take_checkpoint(APEX_CPU *cpu, int index)
+{
+  APEX_Uop *uop = &cpu->uop_pool[index];
+
+  cpu->branch.branches++;
+  cpu->unresolved_branches++;
+  for (int c = 0; c < cpu->config.branch_checkpoints; ++c)
+  {
+    if (cpu->branch_mask & (1u << c))
+    {
+      continue;
+    }
+    APEX_Checkpoint *checkpoint = &cpu->checkpoints[c];
+    checkpoint->seq = uop->seq;
+    memcpy(checkpoint->prf, cpu->prf, sizeof(checkpoint->prf));
+    memcpy(checkpoint->prf_alias, cpu->prf_alias, sizeof(checkpoint->prf_alias));
+    checkpoint->log_position = cpu->prf_log_count;
+    cpu->branch_mask |= 1u << c;
+    uop->checkpoint = c;
+    return;
+  }
+}
+
+/* Frees a resolved or squashed branch's checkpoint and its mask bit */
+static void release_checkpoint(APEX_CPU *cpu, int c)
+{
+  unsigned int bit = 1u << c;
+  cpu->branch_mask &= ~bit;
+  for (int i = 0; i < APEX_UOP_POOL_SIZE; ++i)
+  {
+    cpu->uop_pool[i].branch_mask &= ~bit;
+  }
+}
+
+void APEX_cpu_stop(APEX_CPU *cpu)
+{
+  switch_thread(cpu, 0);
+  for (int t = 1; t < cpu->threads; ++t)
+  {
+    free(cpu->context[t].memory);
+  }
+  if (cpu->owns_code_memory)
+  {
+    free(cpu->code_memory);
+  }
+  if (cpu->cosim)
+  {
+    APEX_cosim_finish(cpu->cosim, NULL);
+  }
+  APEX_cache_free(cpu->dcache);
+  APEX_prefetcher_free(cpu->prefetcher);
+  free(cpu->front_end.uop_cache);
+  if (cpu->trace)
+  {
+    APEX_trace_reader_close(cpu->trace);
+  }
+  free(cpu->debug.pc_bitmap);
+  APEX_topdown_free(&cpu->topdown);
+  APEX_memory_image_unmap(cpu->mapped_memory);
+  free(cpu);
+}
+
+int get_code_index(int pc)
+{
+  return (pc - 4000) / 4;
+}
+
+static void print_instruction(APEX_Uop *stage)
+{
+
+  if (
+      stage->op == APEX_OP_ADD ||
+      stage->op == APEX_OP_SUB ||
+      stage->op == APEX_OP_MUL ||
+      stage->op == APEX_OP_AND ||
+      stage->op == APEX_OP_OR ||
+      stage->op == APEX_OP_EXOR)
+  {
+    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+  }
+
+  if (stage->op == APEX_OP_LOAD)
+  {
+    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+  }
+
+  if (stage->op == APEX_OP_STORE)
+  {
+    printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
+  }
+    if (stage->op == APEX_OP_STR)
+    {
+        printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rs1, stage->rs2, stage->rs3);
+    }
+
+  if (stage->op == APEX_OP_MOVC)
+  {
+    printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
+  }
+
+  if (stage->op == APEX_OP_HALT)
+  {
+    printf("%s  ", stage->opcode);
+  }
+
+  if (stage->op == APEX_OP_BZ)
+  {
+    printf("%s,#%d ", stage->opcode, stage->imm);
+  }
+
+  if (stage->op == APEX_OP_LDR)
+  {
+    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+  }
+
+  if (stage->op == APEX_OP_STR)
+  {
+    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+  }
+
+  if (stage->op == APEX_OP_ADDL)
+  {
+    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+  }
+
+  if (stage->op == APEX_OP_SUBL)
+  {
+    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+  }
+
+  if (stage->op == APEX_OP_JUMP)
+  {
+    printf("%s,R%d,#%d ", stage->opcode, stage->rs1, stage->imm);
+  }
+
+  if (stage->op == APEX_OP_BNZ)
+  {
+    printf("%s,#%d ", stage->opcode, stage->imm);
+  }
+}
+
+static void print_stage_content(char *name, APEX_Uop *stage)
+{
+  printf("%-15s: pc(%d) ", name, stage->pc);
+  if (stage->fused)
+    printf("fused with pc(%d) ", stage->head_pc);
+  print_instruction(stage);
+  printf("\n");
+}
+
+/*
+ * Fills a fetched instruction from the next trace record, the trace
+ * already follows every branch so the pc is simply taken from it
+ */
+static void fetch_from_trace(APEX_CPU *cpu, APEX_Uop *stage)
+{
+  APEX_Trace_Record record;
+  APEX_trace_reader_next(cpu->trace, &record);
+
+  stage->pc = record.pc;
+  stage->opcode = APEX_opcode_name(record.op);
+  stage->op = record.op;
+  stage->rd = record.rd;
+  stage->rs1 = record.rs1;
+  stage->rs2 = record.rs2;
+  stage->rs3 = record.rs3;
+  stage->imm = record.imm;
+  stage->trace_mem_address = record.mem_address;
+  stage->trace_taken = record.taken;
+  stage->predicted_pc = predict_next_pc(stage);
+  cpu->pc = record.pc + 4;
+
+  /* The trace holds only the right path, fetch idles until the branch resolves */
+  if (is_branch(stage->op) && stage->predicted_pc != trace_next_pc(stage))
+  {
+    cpu->fetch_blocked = 1;
+  }
+}
+
+/* Keeps a fetched instruction for the uop cache or loop buffer */
+static void save_decoded(APEX_Decoded *decoded, const APEX_Uop *stage)
+{
+  decoded->pc = stage->pc;
+  decoded->predicted_pc = stage->predicted_pc;
+  decoded->opcode = stage->opcode;
+  decoded->op = stage->op;
+  decoded->rd = stage->rd;
+  decoded->rs1 = stage->rs1;
+  decoded->rs2 = stage->rs2;
+  decoded->rs3 = stage->rs3;
+  decoded->imm = stage->imm;
+}
+
+/* Fetches from a kept instruction, its next pc already predicted */
+static void load_decoded(APEX_Uop *stage, const APEX_Decoded *decoded)
+{
+  stage->pc = decoded->pc;
+  stage->predicted_pc = decoded->predicted_pc;
+  stage->opcode = decoded->opcode;
+  stage->op = decoded->op;
+  stage->rd = decoded->rd;
+  stage->rs1 = decoded->rs1;
+  stage->rs2 = decoded->rs2;
+  stage->rs3 = decoded->rs3;
+  stage->imm = decoded->imm;
+}
+
+/*
+ * A taken backward branch at pc closes a loop starting at target. A
+ * new loop replaces the candidate; once the same loop came round
+ * APEX_LOOP_HOT times with its whole body captured, the loop buffer
+ * locks on.
+ */
+static void loop_observe(APEX_CPU *cpu, int pc, int target)
+{
+  APEX_Front_End *front_end = &cpu->front_end;
+  int length = (pc - target) / 4 + 1;
+
+  if (cpu->trace || target > pc || length > cpu->config.loop_buffer)
+    return;
+  if (front_end->loop_start != target || front_end->loop_end != pc)
+  {
+    front_end->loop_start = target;
+    front_end->loop_end = pc;
+    front_end->loop_captured = 0;
+    front_end->loop_iterations = 0;
+    front_end->loop_active = 0;
+    for (int i = 0; i < length; ++i)
+      front_end->loop[i].pc = -1;
+  }
+  front_end->loop_iterations++;
+  if (!front_end->loop_active && front_end->loop_captured == length &&
+      front_end->loop_iterations >= APEX_LOOP_HOT)
+  {
+    front_end->loop_active = 1;
+    front_end->locks++;
+  }
+}
+
+/* Leaves the loop buffer when fetch is sent anywhere but round the loop */
+static void loop_redirect(APEX_CPU *cpu, int pc, int next_pc)
+{
+  if (next_pc <= pc)
+  {
+    loop_observe(cpu, pc, next_pc);
+    return;
+  }
+  cpu->front_end.loop_active = 0;
+  cpu->front_end.loop_iterations = 0;
+}
+
+/*
+ * Supplies the next instruction from the loop buffer while it is
+ * locked on the loop fetch is in. Returns 0 to fetch normally.
+ */
+static int fetch_from_loop(APEX_CPU *cpu, APEX_Uop *stage)
+{
+  APEX_Front_End *front_end = &cpu->front_end;
+
+  if (!front_end->loop_active)
+    return 0;
+  if (cpu->pc < front_end->loop_start || cpu->pc > front_end->loop_end)
+  {
+    front_end->loop_active = 0;
+    front_end->loop_iterations = 0;
+    return 0;
+  }
+  load_decoded(stage, &front_end->loop[(cpu->pc - front_end->loop_start) / 4]);
+  /* The loop buffer knows where its closing branch goes, JUMP included */
+  if (stage->pc == front_end->loop_end)
+    stage->predicted_pc = front_end->loop_start;
+  front_end->streamed++;
+  return 1;
+}
+
+/*
+ * Looks a fetched pc up in the uop cache. On a hit the kept record
+ * fills the uop, else the caller decodes and the record is kept.
+ */
+static APEX_Decoded *uop_cache_lookup(APEX_CPU *cpu, int pc, int *hit)
+{
+  APEX_Front_End *front_end = &cpu->front_end;
+  APEX_Decoded *entry = &front_end->uop_cache[(pc / 4) % cpu->config.uop_cache];
+
+  front_end->lookups++;
+  *hit = entry->pc == pc;
+  if (*hit)
+    front_end->hits++;
+  return entry;
+}
+
+/* Captures the body of the candidate loop and spots loops closing */
+static void front_end_fetched(APEX_CPU *cpu, const APEX_Uop *stage)
+{
+  APEX_Front_End *front_end = &cpu->front_end;
+
+  if (!cpu->config.loop_buffer)
+    return;
+  if (!front_end->loop_active && stage->pc >= front_end->loop_start &&
+      stage->pc <= front_end->loop_end)
+  {
+    APEX_Decoded *entry = &front_end->loop[(stage->pc - front_end->loop_start) / 4];
+    if (entry->pc < 0)
+    {
+      save_decoded(entry, stage);
+      front_end->loop_captured++;
+    }
+  }
+  if (is_branch(stage->op) && stage->predicted_pc <= stage->pc)
+    loop_observe(cpu, stage->pc, stage->predicted_pc);
+}
+
+/*
+ * Fills the empty fetch latch with the next instruction from the replay
+ * queue, the loop buffer, the trace or code memory, through the uop
+ * cache. Returns 0 when nothing could be fetched this cycle.
+ */
+static int fetch_next(APEX_CPU *cpu)
+{
+  CPU_Stage *latch = &cpu->stage[F];
+  int index = get_code_index(cpu->pc);
+  int more = cpu->replay_count > 0 ||
+             (cpu->trace ? !cpu->fetch_blocked && APEX_trace_reader_more(cpu->trace)
+                         : index >= 0 && index < cpu->code_memory_size);
+  if (!more)
+  {
+    return 0;
+  }
+
+  /* Allocate the instruction once, later stages only pass its index */
+  latch->uop = uop_alloc(cpu);
+  if (latch->uop == APEX_UOP_BUBBLE)
+  {
+    return 0;
+  }
+
+  APEX_Uop *stage = &cpu->uop_pool[latch->uop];
+
+  if (cpu->replay_count > 0)
+  {
+    /* Refetch a squashed instruction, the pc already points past it */
+    *stage = cpu->replay[cpu->replay_head];
+    stage->completed = 0;
+    cpu->replay_head = (cpu->replay_head + 1) % APEX_REPLAY_SIZE;
+    cpu->replay_count--;
+    return 1;
+  }
+
+  if (cpu->trace)
+  {
+    fetch_from_trace(cpu, stage);
+    /* The trace is decoded anyway, the uop cache is only timed */
+    if (cpu->front_end.uop_cache)
+    {
+      int hit;
+      APEX_Decoded *entry = uop_cache_lookup(cpu, stage->pc, &hit);
+      if (!hit)
+        save_decoded(entry, stage);
+    }
+  }
+  else if (fetch_from_loop(cpu, stage))
+  {
+    cpu->pc = stage->predicted_pc;
+  }
+  else
+  {
+    int hit = 0;
+    APEX_Decoded *entry = NULL;
+    if (cpu->front_end.uop_cache)
+      entry = uop_cache_lookup(cpu, cpu->pc, &hit);
+
+    if (hit)
+    {
+      load_decoded(stage, entry);
+    }
+    else
+    {
+      /* Store current PC in fetch latch */
+      stage->pc = cpu->pc;
+
+      APEX_Instruction *current_ins = &cpu->code_memory[index];
+      stage->opcode = current_ins->opcode;
+      stage->op = current_ins->op;
+      stage->rd = current_ins->rd;
+      stage->rs1 = current_ins->rs1;
+      stage->rs2 = current_ins->rs2;
+      stage->rs3 = current_ins->rs3;
+      stage->imm = current_ins->imm;
+
+      /* Update PC for next instruction, as predicted for a branch */
+      stage->predicted_pc = predict_next_pc(stage);
+      if (entry)
+        save_decoded(entry, stage);
+    }
+    cpu->pc = stage->predicted_pc;
+    front_end_fetched(cpu, stage);
+  }
+  stage->thread = cpu->thread;
+  if (cpu->thread)
+    rename_thread_regs(stage, cpu->thread);
+  cpu->context[cpu->thread].fetched++;
+  return 1;
+}
+
+int fetch(APEX_CPU *cpu)
+{
+  CPU_Stage *latch = &cpu->stage[F];
+  if (latch->flush == 1)
+  {
+    uop_free(cpu, latch->uop);
+    latch->uop = APEX_UOP_BUBBLE;
+  }
+
+  /* Fetch idles while a mispredicted branch restores the rename table */
+  if (cpu->recovery_stall > 0)
+  {
+    cpu->recovery_stall--;
+    cpu->branch.recovery_cycles++;
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
+      printf("Fetch : recovering\n");
+    return 0;
+  }
+  if (cpu->front_end.loop_active)
+    cpu->front_end.gated_cycles++;
+  if (cpu->threads > 1 && latch->uop == APEX_UOP_BUBBLE && !cpu->replay_count)
+    select_thread(cpu);
+
+  if (!latch->busy && !latch->stalled &&
+      (latch->uop != APEX_UOP_BUBBLE || fetch_next(cpu)))
+  {
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
+    {
+      print_stage_content("Fetch", &cpu->uop_pool[latch->uop]);
+    }
+
+    /* Move from fetch latch to decode latch once decode has drained it */
+    if (cpu->stage[DRF].uop == APEX_UOP_BUBBLE)
+    {
+      cpu->stage[DRF] = cpu->stage[F];
+      latch->uop = APEX_UOP_BUBBLE;
+    }
+  }
+  else if (ENABLE_DEBUG_MESSAGES && cpu->display)
+    printf("Fetch :\n");
+  return 0;
+}
+
+/*
+ * Which APEX_FUSE_* pair instruction a followed by b forms, 0 when
+ * they stay apart. b must read the register a writes.
+ */
+static int fusion_kind(const APEX_Uop *a, const APEX_Uop *b)
+{
+  switch (a->op)
+  {
+  case APEX_OP_MOVC:
+    if ((b->op == APEX_OP_ADD || b->op == APEX_OP_SUB) &&
+        (b->rs1 == a->rd || b->rs2 == a->rd))
+      return APEX_FUSE_MOVC_ALU;
+    return 0;
+  case APEX_OP_ADDL:
+  case APEX_OP_SUBL:
+    if ((b->op == APEX_OP_LOAD && b->rs1 == a->rd) ||
+        (b->op == APEX_OP_STORE && b->rs2 == a->rd))
+      return APEX_FUSE_ADDR_MEM;
+    /* fall through */
+  case APEX_OP_ADD:
+  case APEX_OP_SUB:
+    if (b->op == APEX_OP_BZ || b->op == APEX_OP_BNZ)
+      return APEX_FUSE_ALU_BRANCH;
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Merges the instruction in decode with the next one when the pair is
+ * enabled in config.fusion. The fused uop is the second instruction,
+ * carrying the first as its head, in the first one's pool entry; it
+ * takes one ROB slot and one pass through INT FU1.
+ */
+static void try_fuse(APEX_CPU *cpu)
+{
+  CPU_Stage *decode_latch = &cpu->stage[DRF];
+  CPU_Stage *fetch_latch = &cpu->stage[F];
+
+  if (!cpu->config.fusion || decode_latch->uop == APEX_UOP_BUBBLE)
+    return;
+  APEX_Uop *a = &cpu->uop_pool[decode_latch->uop];
+  if (rename_idiom(cpu, a))
+    return;
+  /* Only MOVC and the single cycle ALU ops start a pair */
+  int starts = a->op == APEX_OP_MOVC ||
+               (sets_zero_flag(a->op) && a->op != APEX_OP_MUL);
+  if (a->fused || !starts)
+    return;
+
+  /* Fetch the second instruction alongside the first, from the same thread */
+  if (fetch_latch->uop == APEX_UOP_BUBBLE)
+  {
+    if (cpu->recovery_stall > 0 || fetch_latch->busy || fetch_latch->stalled ||
+        a->thread != cpu->thread || !fetch_next(cpu))
+      return;
+  }
+  APEX_Uop *b = &cpu->uop_pool[fetch_latch->uop];
+  int kind = fusion_kind(a, b) & cpu->config.fusion;
+  if (!kind || b->fused || b->thread != a->thread || rename_idiom(cpu, b))
+    return;
+
+  /* Fuse in the head's entry: its instruction becomes the head, then the second moves in */
+  a->fused = kind;
+  a->head_pc = a->pc;
+  a->head_op = a->op;
+  a->head_rd = a->rd;
+  a->head_rs1 = a->rs1;
+  a->head_rs2 = a->rs2;
+  a->head_imm = a->imm;
+  a->pc = b->pc;
+  a->opcode = b->opcode;
+  a->op = b->op;
+  a->rd = b->rd;
+  a->rs1 = b->rs1;
+  a->rs2 = b->rs2;
+  a->rs3 = b->rs3;
+  a->imm = b->imm;
+  a->predicted_pc = b->predicted_pc;
+  a->trace_mem_address = b->trace_mem_address;
+  a->trace_taken = b->trace_taken;
+  uop_free(cpu, fetch_latch->uop);
+  fetch_latch->uop = APEX_UOP_BUBBLE;
+
+  for (int k = 0; k < APEX_FUSE_KINDS; ++k)
+  {
+    if (kind == 1 << k)
+      cpu->fused_pairs[k]++;
+  }
+}
+
+/*
+ * Top-down leaf of a cycle decode dispatched nothing in. held is set
+ * when the ROB, the physical registers or the checkpoints kept the
+ * instruction in decode.
+ */
+static int topdown_stall(APEX_CPU *cpu, int held)
+{
+  CPU_Stage *latch = &cpu->stage[DRF];
+  const APEX_Uop *head = cpu->rob_count ? &cpu->uop_pool[cpu->rob[cpu->rob_head]] : NULL;
+  int head_load = head && !head->completed && is_load(head->op);
+
+  if (latch->uop == APEX_UOP_BUBBLE)
+  {
+    if (cpu->topdown.refill || cpu->recovery_stall > 0)
+      return APEX_TD_FRONT_FLUSH;
+    int code_left = cpu->replay_count || cpu->trace || !head;
+    for (int t = 0; t < cpu->threads && !code_left; ++t)
+      code_left = thread_has_code(cpu, t);
+    if (code_left)
+      return APEX_TD_FRONT_FETCH;
+    /* Past the end of the program only retirement is left */
+    return head_load ? APEX_TD_MEM_LOAD : APEX_TD_CORE_DEPENDENCY;
+  }
+  if (latch->busy || latch->stalled)
+    return APEX_TD_CORE_FU;
+  /* With ports, a full ROB while ready instructions lost a port to others */
+  if (held && cpu->config.ports && cpu->port_conflict_cycle == cpu->clock - 1)
+    return APEX_TD_CORE_FU;
+  if (held)
+    return head_load ? APEX_TD_MEM_LOAD : APEX_TD_CORE_RESOURCES;
+
+  /* Waiting for an operand, the youngest older writer tells whose */
+  int sources[4];
+  int count = issue_sources(cpu, &cpu->uop_pool[latch->uop], sources);
+  for (int s = 0; s < count; ++s)
+  {
+    for (int i = cpu->rob_tail; i != cpu->rob_head;)
+    {
+      i = (i + APEX_ROB_SIZE - 1) % APEX_ROB_SIZE;
+      const APEX_Uop *older = &cpu->uop_pool[cpu->rob[i]];
+      if (older->rd == sources[s] && APEX_op_writes_register(older->op))
+      {
+        if (older->value_cycle > cpu->clock)
+          return is_load(older->op) ? APEX_TD_MEM_LOAD : APEX_TD_CORE_DEPENDENCY;
+        break;
+      }
+      if (older->fused && older->head_rd == sources[s])
+      {
+        if (older->head_cycle > cpu->clock)
+          return APEX_TD_CORE_DEPENDENCY;
+        break;
+      }
     }
-    if (strcmp(stage->opcode, "SUB") == 0)
+  }
+  return APEX_TD_CORE_DEPENDENCY;
+}
+
+/* Accounts decode's dispatch slot this cycle */
+static void topdown_slot(APEX_CPU *cpu, int delivered, int held)
+{
+  if (delivered)
+    cpu->topdown.refill = 0;
+  if (delivered && cpu->stage[DRF].uop == APEX_UOP_BUBBLE)
+    cpu->topdown.in_flight++;
+  else
+    cpu->topdown.slots[topdown_stall(cpu, held)]++;
+}
+
+/* Settles a retired uop's slot and closes a region every region_size */
+static void topdown_retire(APEX_CPU *cpu)
+{
+  APEX_Topdown *topdown = &cpu->topdown;
+
+  topdown->slots[APEX_TD_RETIRING]++;
+  topdown->in_flight--;
+  if (topdown->region_size && cpu->ins_completed >= topdown->next_region)
+  {
+    APEX_topdown_close_region(topdown, cpu->ins_completed, cpu->clock);
+    topdown->next_region += topdown->region_size;
+  }
+}
+
+int decode(APEX_CPU *cpu)
+{
+    struct prf *prf = cpu->prf;
+    int intcounter=0,mulcounter=0,pcount;
+  CPU_Stage *latch = &cpu->stage[DRF];
+
+  if (latch->flush == 1)
+  {
+    uop_free(cpu, latch->uop);
+    latch->uop = APEX_UOP_BUBBLE;
+  }
+
+  try_fuse(cpu);
+  APEX_Uop *stage = &cpu->uop_pool[latch->uop];
+  int delivered = latch->uop != APEX_UOP_BUBBLE;
+
+  /* Hold the instruction in decode latch while ROB has no free entry */
+  int rob_full = cpu->rob_count == cpu->config.rob_size;
+
+  /*
+   * A branch waits for a free checkpoint. With none configured nothing
+   * dispatches past an unresolved branch.
+   */
+  int branch_hold = latch->uop != APEX_UOP_BUBBLE &&
+                    (cpu->config.branch_checkpoints == 0
+                         ? cpu->unresolved_branches > 0
+                         : is_branch(stage->op) &&
+                               cpu->unresolved_branches == cpu->config.branch_checkpoints);
+  if (branch_hold && !rob_full)
+    cpu->branch.dispatch_stalls++;
+  int rename_hold = latch->uop != APEX_UOP_BUBBLE && !dispatch_fits(cpu, stage);
+
+  /*
+   * Issue waits until every source is on the bypass or in the register
+   * file. With ports the scheduler waits instead, in the ROB, except
+   * for a move rename copies the value of.
+   */
+  int wait_operands = !cpu->config.ports || rename_idiom(cpu, stage) == IDIOM_MOVE;
+  if (!latch->busy && !latch->stalled && !rob_full && !branch_hold && !rename_hold &&
+      (!wait_operands || operands_ready(cpu, stage, cpu->rob_tail)))
+  {
+    /* An idiom sharing an entry renames nothing below, see share_entry() */
+    int idiom = rename_idiom(cpu, stage);
+    int shares = idiom_shares(cpu, stage);
+
+    /* The head of a fused pair renames its destination first */
+    if (stage->fused)
+    {
+        pcount=fun(prf);
+        prf[pcount].value=stage->head_rd;
+        prf[pcount].valid=0;
+    }
+
+    /* Read data from register file for store */
+    if (stage->op == APEX_OP_STORE)
     {
+
         stage->rs1_value = cpu->regs[stage->rs1];
         stage->rs2_value = cpu->regs[stage->rs2];
         cpu->stage[F].stalled = 0;
         cpu->stage[DRF].stalled = 0;
+          rename_source(cpu, stage->rs1);
+          rename_source(cpu, stage->rs2);
 
-          int rs1f=0,rs2f=0;
-          for (int i = 0; i <24 ; ++i)
-          {
-              if(stage->rs1==prf[i].value){
-                  rs1f=-1;
-                  break;
-              }
-          }
-          for (int i = 0; i <24 ; ++i)
-          {
-              if(stage->rs2==prf[i].value){
-                  rs2f=-1;
-                  break;
-              }
-          }
-          if(rs1f!=-1) {
-              pcount = fun(prf);
-              prf[pcount].value = stage->rs1;
-              prf[pcount].valid = 0;
-          }
-          if(rs2f!=-1) {
-              pcount = fun(prf);
-              prf[pcount].value = stage->rs2;
-              prf[pcount].valid = 0;
-          }
+    }
+    if (stage->op == APEX_OP_LOAD)
+    {
+
+        stage->rs1_value = cpu->regs[stage->rs1];
+        cpu->stage[F].stalled = 0;
+        cpu->stage[DRF].stalled = 0;
+        rename_source(cpu, stage->rs1);
+        pcount=fun(prf);
+        prf[pcount].value=stage->rd;
+        prf[pcount].valid=0;
+
+    }
+    if (stage->op == APEX_OP_LDR)
+    {
+        rename_source(cpu, stage->rs1);
+        rename_source(cpu, stage->rs2);
+        pcount=fun(prf);
+        prf[pcount].value=stage->rd;
+        prf[pcount].valid=0;
+    }
+    if (stage->op == APEX_OP_STR)
+    {
+        rename_source(cpu, stage->rs1);
+        rename_source(cpu, stage->rs2);
+        rename_source(cpu, stage->rs3);
+    }
+    if (stage->op == APEX_OP_ADD)
+    {
+
+
+        stage->rs1_value = cpu->regs[stage->rs1];
+        stage->rs2_value = cpu->regs[stage->rs2];
+        rename_source(cpu, stage->rs1);
+        rename_source(cpu, stage->rs2);
           pcount=fun(prf);
           prf[pcount].value=stage->rd;
           prf[pcount].valid=0;
-
     }
-    if (strcmp(stage->opcode, "MUL") == 0)
+    if (stage->op == APEX_OP_SUB && !shares)
     {
-
         stage->rs1_value = cpu->regs[stage->rs1];
         stage->rs2_value = cpu->regs[stage->rs2];
         cpu->stage[F].stalled = 0;
         cpu->stage[DRF].stalled = 0;
-          int rs1f=0,rs2f=0;
-          for (int i = 0; i <24 ; ++i)
-          {
-              if(stage->rs1==prf[i].value){
-                  rs1f=-1;
-                  break;
-              }
-          }
-          for (int i = 0; i <24 ; ++i)
-          {
-              if(stage->rs2==prf[i].value){
-                  rs2f=-1;
-                  break;
-              }
-          }
-          if(rs1f!=-1) {
-              pcount = fun(prf);
-              prf[pcount].value = stage->rs1;
-              prf[pcount].valid = 0;
-          }
-          if(rs2f!=-1) {
-              pcount = fun(prf);
-              prf[pcount].value = stage->rs2;
-              prf[pcount].valid = 0;
-          }
+
+          rename_source(cpu, stage->rs1);
+          rename_source(cpu, stage->rs2);
           pcount=fun(prf);
           prf[pcount].value=stage->rd;
           prf[pcount].valid=0;
 
     }
-    if (strcmp(stage->opcode, "ADDL") == 0)
+    if (stage->op == APEX_OP_MUL)
     {
 
         stage->rs1_value = cpu->regs[stage->rs1];
+        stage->rs2_value = cpu->regs[stage->rs2];
         cpu->stage[F].stalled = 0;
         cpu->stage[DRF].stalled = 0;
-          int rs1f=0;
-          for (int i = 0; i <24 ; ++i)
-          {
-              if(stage->rs1==prf[i].value){
-                  rs1f=-1;
-                  break;
-              }
-          }
-
-          if(rs1f!=-1) {
-              pcount = fun(prf);
-              prf[pcount].value = stage->rs1;
-              prf[pcount].valid = 0;
-          }
-
+          rename_source(cpu, stage->rs1);
+          rename_source(cpu, stage->rs2);
           pcount=fun(prf);
           prf[pcount].value=stage->rd;
           prf[pcount].valid=0;
 
     }
-    if (strcmp(stage->opcode, "SUBL") == 0)
+    if (stage->op == APEX_OP_ADDL && !shares)
     {
+
         stage->rs1_value = cpu->regs[stage->rs1];
         cpu->stage[F].stalled = 0;
         cpu->stage[DRF].stalled = 0;
-        int rs1f=0;
-        for (int i = 0; i <24 ; ++i)
-        {
-            if(stage->rs1==prf[i].value){
-                rs1f=-1;
-                break;
-            }
-        }
+          rename_source(cpu, stage->rs1);
 
-        if(rs1f!=-1) {
-            pcount = fun(prf);
-            prf[pcount].value = stage->rs1;
-            prf[pcount].valid = 0;
-        }
-
-        pcount=fun(prf);
-        prf[pcount].value=stage->rd;
-        prf[pcount].valid=0;
+          pcount=fun(prf);
+          prf[pcount].value=stage->rd;
+          prf[pcount].valid=0;
 
     }
-    if (strcmp(stage->opcode, "BZ") == 0)
+    if (stage->op == APEX_OP_SUBL && !shares)
     {
-      if (cpu->zFlag == 1)
-      {
-        stage->flush = 1;
-        cpu->stage[F].stalled = 1;
-        cpu->stage[DRF].stalled = 1;
-      }
-      else
-      {
+        stage->rs1_value = cpu->regs[stage->rs1];
         cpu->stage[F].stalled = 0;
         cpu->stage[DRF].stalled = 0;
-      }
+        rename_source(cpu, stage->rs1);
+
+        pcount=fun(prf);
+        prf[pcount].value=stage->rd;
+        prf[pcount].valid=0;
+
     }
-    if (strcmp(stage->opcode, "HALT") == 0)
+    if (stage->op == APEX_OP_HALT)
     {
     }
-    if (strcmp(stage->opcode, "MOVC") == 0)
+    if (stage->op == APEX_OP_MOVC && !shares)
     {
         pcount=fun(prf);
         prf[pcount].value=stage->rd;
         prf[pcount].valid=0;
     }
-    if (
-              strcmp(stage->opcode, "LOAD") == 0 ||
-              strcmp(stage->opcode, "LDR")  == 0 ||
-              strcmp(stage->opcode, "ADD")  == 0 ||
-              strcmp(stage->opcode, "SUB")  == 0 ||
-              strcmp(stage->opcode, "STORE")== 0 ||
-              strcmp(stage->opcode, "STR")  == 0 ||
-              strcmp(stage->opcode, "MOVC") == 0 ||
-              strcmp(stage->opcode, "ADDL") == 0 ||
-              strcmp(stage->opcode, "SUBL") == 0){
-          cpu->stage[INT_FU1]=cpu->stage[DRF];
+    if (!idiom && (
+              stage->op == APEX_OP_LOAD ||
+              stage->op == APEX_OP_LDR ||
+              stage->op == APEX_OP_ADD ||
+              stage->op == APEX_OP_SUB ||
+              stage->op == APEX_OP_STORE ||
+              stage->op == APEX_OP_STR ||
+              stage->op == APEX_OP_MOVC ||
+              stage->op == APEX_OP_ADDL ||
+              stage->op == APEX_OP_SUBL ||
+              stage->fused)){
+          if (!cpu->config.ports)
+              cpu->stage[INT_FU1]=cpu->stage[DRF];
           intcounter++;
 
       }
-      if(strcmp(stage->opcode, "MUL") == 0) {
-          cpu->stage[MUL_FU1]=cpu->stage[DRF];
+      if(stage->op == APEX_OP_MUL) {
+          if (!cpu->config.ports)
+              cpu->stage[MUL_FU1]=cpu->stage[DRF];
           mulcounter++;
       }
 
-    if (ENABLE_DEBUG_MESSAGES)
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
     {
         printf("---------------------------------RAT-------------------------------------\n");
         for (int j = 0; j < 24; ++j) {
             if(prf[j].valid!=1)
                 printf("|R[%d] = P%d & valid = %d ARF_VAL=%d Latest=%d|\n",prf[j].value,j, prf[j].valid,prf[j].arf_val,prf[j].latest);
         }
+        print_shared(cpu);
         printf("---------------------------------RAT-------------------------------------\n");
         print_stage_content("Decode/RF", stage);
 
     }
     if(intcounter==0)
-        strcpy(cpu->stage[INT_FU1].opcode,"");
+        cpu->stage[INT_FU1].uop = APEX_UOP_BUBBLE;
       if(mulcounter==0)
-          strcpy(cpu->stage[MUL_FU1].opcode,"");
+          cpu->stage[MUL_FU1].uop = APEX_UOP_BUBBLE;
+
+    /* Dispatch into ROB, ops without a functional unit are done already */
+    if (latch->uop != APEX_UOP_BUBBLE)
+    {
+        /* A move reads its source as every older instruction left it */
+        if (idiom == IDIOM_MOVE)
+            rob_operand(cpu, cpu->rob_tail, stage->rs1, &stage->buffer);
+        else if (idiom == IDIOM_ZERO)
+            stage->buffer = 0;
+        stage->seq = ++cpu->uop_seq;
+        stage->rob_slot = cpu->rob_tail;
+        stage->executed = 0;
+        stage->issued = 0;
+        stage->dep_uop = APEX_UOP_BUBBLE;
+        stage->dep_waited = 0;
+        if (cpu->config.mem_dep == APEX_MEM_DEP_STORE_SETS &&
+            (is_load(stage->op) || is_store(stage->op)))
+            APEX_store_sets_dispatch(&cpu->store_sets, stage, latch->uop);
+        cpu->rob[cpu->rob_tail] = latch->uop;
+        cpu->rob_tail = (cpu->rob_tail + 1) % APEX_ROB_SIZE;
+        cpu->rob_count++;
+        stage->value_cycle = RESULT_PENDING;
+        stage->head_cycle = RESULT_PENDING;
+        stage->branch_mask = cpu->branch_mask;
+        stage->checkpoint = -1;
+        if (is_branch(stage->op))
+            take_checkpoint(cpu, latch->uop);
+        else if (intcounter == 0 && mulcounter == 0)
+        {
+            stage->completed = 1;
+            stage->value_cycle = cpu->clock;
+        }
+        if (shares)
+        {
+            share_entry(cpu, stage, idiom);
+            cpu->eliminated_shared++;
+        }
+        else if (idiom)
+            prf_write(cpu, stage);
+        if (idiom)
+        {
+            if (idiom == IDIOM_MOVE)
+                cpu->eliminated_moves++;
+            else
+                cpu->eliminated_zeros++;
+        }
+        latch->uop = APEX_UOP_BUBBLE;
+    }
   }
+  if (cpu->config.topdown)
+    topdown_slot(cpu, delivered, rob_full || branch_hold || rename_hold);
   return 0;
 }
 
-int intfu1(APEX_CPU *cpu)
+/*
+ * Reads the sources of an op entering INT FU1 or MUL FU1 from the
+ * youngest older writer in the ROB, else the register file, so a
+ * register nothing renamed reads its architectural value.
+ */
+static void read_operands(APEX_CPU *cpu, APEX_Uop *uop)
 {
-    CPU_Stage *stage = &cpu->stage[INT_FU1];
-    int frd=0,frs1=0,frs2=0,free=0,frs3=0;
-    if(strcmp(stage->opcode,"MOVC")==0){
+    switch (uop->op)
+    {
+    case APEX_OP_STR:
+        uop_operand(cpu, uop, uop->rs3, &uop->rs3_value);
+        /* Fall through */
+    case APEX_OP_ADD:
+    case APEX_OP_SUB:
+    case APEX_OP_MUL:
+    case APEX_OP_STORE:
+    case APEX_OP_LDR:
+        uop_operand(cpu, uop, uop->rs2, &uop->rs2_value);
+        /* Fall through */
+    case APEX_OP_ADDL:
+    case APEX_OP_SUBL:
+    case APEX_OP_LOAD:
+        uop_operand(cpu, uop, uop->rs1, &uop->rs1_value);
+        break;
+    default:
+        break;
+    }
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==0){
-                break;
-            }
-            else frd++;
-        }
+/*
+ * Executes the head of a fused pair ahead of the second instruction,
+ * which then reads the head's result from the rename table.
+ */
+static void execute_head(APEX_CPU *cpu, APEX_Uop *uop)
+{
+  int rs1_value = 0, rs2_value = 0;
+  int value;
+
+  if (uop->head_op != APEX_OP_MOVC)
+    rob_operand(cpu, uop->rob_slot, uop->head_rs1, &rs1_value);
+  if (uop->head_op == APEX_OP_ADD || uop->head_op == APEX_OP_SUB)
+    rob_operand(cpu, uop->rob_slot, uop->head_rs2, &rs2_value);
+  switch (uop->head_op)
+  {
+  case APEX_OP_MOVC:
+    value = uop->head_imm;
+    break;
+  case APEX_OP_ADD:
+    value = rs1_value + rs2_value;
+    break;
+  case APEX_OP_SUB:
+    value = rs1_value - rs2_value;
+    break;
+  case APEX_OP_ADDL:
+    value = rs1_value + uop->head_imm;
+    break;
+  default:
+    value = rs1_value - uop->head_imm;
+    break;
+  }
+  uop->head_value = value;
+  uop->head_cycle = cpu->clock + cpu->config.bypass_latency;
+  prf_write_value(cpu, uop->seq, uop->head_rd, value);
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==1){
-                break;
-            }
-            else free++;
-        }
-        freephyreg(prf,free);
-        prf[frd].arf_val=stage->imm;
-        prf[frd].latest=1;
+int intfu1(APEX_CPU *cpu)
+{
+    CPU_Stage *latch = &cpu->stage[INT_FU1];
+    APEX_Uop *stage = &cpu->uop_pool[latch->uop];
+    if (latch->uop != APEX_UOP_BUBBLE && stage->fused)
+        execute_head(cpu, stage);
+    if (latch->uop != APEX_UOP_BUBBLE)
+        read_operands(cpu, stage);
+    if(stage->op == APEX_OP_MOVC){
+        stage->buffer=stage->imm;
+        prf_write(cpu, stage);
+    }
+    if(stage->op == APEX_OP_ADD){
+        stage->buffer=stage->rs1_value+stage->rs2_value;
+        prf_write(cpu, stage);
+    }
+    if(stage->op == APEX_OP_SUB){
+        stage->buffer=stage->rs1_value-stage->rs2_value;
+        prf_write(cpu, stage);
+    }
+    if(stage->op == APEX_OP_STORE){
+        stage->buffer=stage->rs2_value+stage->imm;
+        stage->mem_address=stage->buffer;
+    }
+    if(stage->op == APEX_OP_SUBL){
+        stage->buffer=stage->rs1_value-stage->imm;
+        prf_write(cpu, stage);
+    }
+    if(stage->op == APEX_OP_ADDL){
+        stage->buffer=stage->rs1_value + stage->imm;
+        prf_write(cpu, stage);
+    }
+    if(stage->op == APEX_OP_STR){
+        stage->buffer=stage->rs2_value + stage->rs3_value;
+        stage->mem_address=stage->buffer;
+    }
+    if(stage->op == APEX_OP_LOAD){
+        /* Destination is written by mem() once the word is read */
+        stage->mem_address=stage->rs1_value + stage->imm;
+    }
+    if(stage->op == APEX_OP_LDR){
+        stage->mem_address=stage->rs1_value+stage->rs2_value;
+    }
+    if (latch->uop != APEX_UOP_BUBBLE && APEX_op_writes_register(stage->op) &&
+        !is_load(stage->op))
+        broadcast(cpu, latch->uop);
+    cpu->stage[INT_FU2]=cpu->stage[INT_FU1];
+    latch->uop = APEX_UOP_BUBBLE;
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
+    {
+        print_stage_content("Integer FU1", stage);
     }
-    if(strcmp(stage->opcode,"ADD")==0){
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs1 && prf[i].latest==1){
-                break;
-            }
-            else frs1++;
-        }
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs2 && prf[i].latest==1){
-                break;
-            }
-            else frs2++;
+    return 0;
+}
 
+int intfu2(APEX_CPU *cpu)
+{
+    CPU_Stage *latch = &cpu->stage[INT_FU2];
+    APEX_Uop *stage = &cpu->uop_pool[latch->uop];
+        if(stage->op == APEX_OP_STORE  ||
+           stage->op == APEX_OP_LOAD  ||
+           stage->op == APEX_OP_STR  ||
+           stage->op == APEX_OP_LDR
+        ){
+            /* Memory ops wait in the load/store queue until they may issue */
+            cpu->lsq[(cpu->lsq_head + cpu->lsq_count) % APEX_LSQ_SIZE] = latch->uop;
+            cpu->lsq_count++;
+            latch->uop = APEX_UOP_BUBBLE;
         }
-
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==0){
-                break;
-            }
-            else frd++;
+        else if (is_branch(stage->op)) {
+            /* A fused branch resolves in the branch unit like any other */
+            latch->uop = APEX_UOP_BUBBLE;
+        }
+        else {
+            complete_latch(cpu, latch);
         }
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
+    {
+        print_stage_content("Integer FU2", stage);
+    }
+
+    return 0;
+}
 
-            stage->rs1_value=prf[frs1].arf_val;
-            stage->rs2_value=prf[frs2].arf_val;
-            stage->buffer=stage->rs1_value+stage->rs2_value;
+int mulfu1(APEX_CPU *cpu)
+{
+    CPU_Stage *latch = &cpu->stage[MUL_FU1];
+    APEX_Uop *stage = &cpu->uop_pool[latch->uop];
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==1){
-                break;
-            }
-            else free++;
-        }
-            freephyreg(prf,free);
-            prf[frd].arf_val=stage->buffer;
-            prf[frd].latest=1;
+    /* Operands are read at issue, a younger writer may replace them before FU3 */
+    if(stage->op == APEX_OP_MUL)
+        read_operands(cpu, stage);
 
+    //if(!stage->stalled)
+    //cpu->stage[RETIRE] = cpu->stage[EX];
+    cpu->stage[MUL_FU2]=cpu->stage[MUL_FU1];
+    latch->uop = APEX_UOP_BUBBLE;
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
+    {
+        print_stage_content("MUL FU1", stage);
     }
-    if(strcmp(stage->opcode,"SUB")==0){
+    return 0;
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs1 && prf[i].latest==1){
-                break;
-            }
-            else frs1++;
-        }
+int mulfu2(APEX_CPU *cpu)
+{
+    CPU_Stage *latch = &cpu->stage[MUL_FU2];
+    APEX_Uop *stage = &cpu->uop_pool[latch->uop];
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs2 && prf[i].latest==1){
-                break;
-            }
-            else frs2++;
+    //if(!stage->stalled)
+    //cpu->stage[RETIRE] = cpu->stage[EX];
+    cpu->stage[MUL_FU3]=cpu->stage[MUL_FU2];
+    latch->uop = APEX_UOP_BUBBLE;
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
+    {
+        print_stage_content("MUL FU2", stage);
+    }
 
-        }
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==0){
-                break;
-            }
-            else frd++;
-        }
+    return 0;
+}
 
-        stage->rs1_value=prf[frs1].arf_val;
-        stage->rs2_value=prf[frs2].arf_val;
-        stage->buffer=stage->rs1_value-stage->rs2_value;
+int mulfu3(APEX_CPU *cpu){
+    CPU_Stage *latch = &cpu->stage[MUL_FU3];
+    APEX_Uop *stage = &cpu->uop_pool[latch->uop];
+    if(stage->op == APEX_OP_MUL){
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==1){
-                break;
-            }
-            else free++;
-        }
-        freephyreg(prf,free);
-        prf[frd].arf_val=stage->buffer;
-        prf[frd].latest=1;
+        stage->buffer=stage->rs1_value*stage->rs2_value;
+        prf_write(cpu, stage);
+        broadcast(cpu, latch->uop);
 
     }
-    if(strcmp(stage->opcode,"STORE")==0){
+    complete_latch(cpu, latch);
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
+    {
+        print_stage_content("MUL FU3", stage);
+    }
+    return 0;
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs1 && prf[i].latest==1){
-                break;
-            }
-            else frs1++;
-        }
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs2 && prf[i].latest==1){
-                break;
-            }
-            else frs2++;
+/* Resolves the address of a queued memory op, returns 0 while unknown */
+static int lsq_address(APEX_CPU *cpu, APEX_Uop *uop)
+{
+  int base, offset;
+  int ready;
 
-        }
+  switch (uop->op)
+  {
+  case APEX_OP_LOAD:
+    ready = uop_operand(cpu, uop, uop->rs1, &base);
+    offset = uop->imm;
+    break;
+  case APEX_OP_LDR:
+    ready = uop_operand(cpu, uop, uop->rs1, &base) &
+            uop_operand(cpu, uop, uop->rs2, &offset);
+    break;
+  case APEX_OP_STORE:
+    ready = uop_operand(cpu, uop, uop->rs2, &base);
+    offset = uop->imm;
+    break;
+  default:
+    ready = uop_operand(cpu, uop, uop->rs2, &base) &
+            uop_operand(cpu, uop, uop->rs3, &offset);
+    break;
+  }
+  /* Trust the recorded address over the one the model computed */
+  uop->mem_address = cpu->trace ? uop->trace_mem_address : base + offset;
+  return ready;
+}
 
-        stage->rs1_value=prf[frs1].arf_val;
-        stage->rs2_value=prf[frs2].arf_val;
-        stage->buffer=stage->rs2_value+stage->imm;
-    }
-    if(strcmp(stage->opcode,"SUBL")==0){
+static int store_set_pending(APEX_CPU *cpu, const APEX_Uop *load)
+{
+  const APEX_Uop *store = &cpu->uop_pool[load->dep_uop];
+  return load->dep_uop != APEX_UOP_BUBBLE && store->seq == load->dep_seq &&
+         !store->executed;
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs1 && prf[i].latest==1){
-                break;
-            }
-            else frs1++;
-        }
+/*
+ * Picks the oldest memory op allowed to access memory this cycle.
+ * Stores go only once every older memory op is done; loads go as soon
+ * as their address is known, unless the issue policy holds them
+ * behind an older store.
+ */
+static int lsq_select(APEX_CPU *cpu)
+{
+  APEX_Store_Sets *sets = &cpu->store_sets;
+  int older_pending = 0;        // An older memory op has not executed
+  int older_store_pending = 0;  // An older store has not executed
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==0){
-                break;
-            }
-            else frd++;
-        }
+  for (int n = 0; n < cpu->lsq_count; ++n)
+  {
+    int index = cpu->lsq[(cpu->lsq_head + n) % APEX_LSQ_SIZE];
+    APEX_Uop *uop = &cpu->uop_pool[index];
+    if (uop->executed)
+    {
+      continue;
+    }
 
-        stage->rs1_value=prf[frs1].arf_val;
-        stage->buffer=stage->rs1_value-stage->imm;
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==1){
-                break;
-            }
-            else free++;
+    if (is_store(uop->op))
+    {
+      int data;
+      /* A store on a path not yet confirmed must not write memory */
+      if (!older_pending && !uop->branch_mask && lsq_address(cpu, uop) &&
+          uop_operand(cpu, uop, uop->rs1, &data))
+      {
+        uop->rs1_value = data;
+        return index;
+      }
+      older_store_pending = 1;
+    }
+    else if (lsq_address(cpu, uop))
+    {
+      int hold = 0;
+      if (cpu->config.mem_dep == APEX_MEM_DEP_IN_ORDER)
+      {
+        hold = older_store_pending;
+      }
+      else if (cpu->config.mem_dep == APEX_MEM_DEP_STORE_SETS &&
+               store_set_pending(cpu, uop))
+      {
+        hold = 1;
+        if (!uop->dep_waited)
+        {
+          uop->dep_waited = 1;
+          sets->held++;
         }
-        freephyreg(prf,free);
-        prf[frd].arf_val=stage->buffer;
-        prf[frd].latest=1;
+      }
+      if (!hold)
+      {
+        sets->loads++;
+        sets->speculative += older_store_pending;
+        if (uop->dep_waited && uop->dep_address != uop->mem_address)
+        {
+          sets->false_deps++;
         }
-    if(strcmp(stage->opcode,"ADDL")==0){
+        return index;
+      }
+    }
+    older_pending = 1;
+  }
+  return APEX_UOP_BUBBLE;
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs1 && prf[i].latest==1){
-                break;
-            }
-            else frs1++;
-        }
+/* Whether an ALU op in the ROB has yet to compute its result */
+static int alu_pending(const APEX_CPU *cpu, int index)
+{
+  if (!cpu->config.ports)
+    return cpu->stage[INT_FU1].uop == index;
+  if (!cpu->uop_pool[index].issued)
+    return 1;
+  for (int p = 0; p < cpu->config.ports; ++p)
+  {
+    if (cpu->port[p].alu[0] == index)
+      return 1;
+  }
+  return 0;
+}
 
+/*
+ * Rebuilds the rename table from the instructions left in the ROB after
+ * a squash. Older ALU ops past INT FU1 hold their result; MULs, loads
+ * and ALU ops that have not executed yet get a pending entry.
+ */
+static void rebuild_rename(APEX_CPU *cpu)
+{
+  struct prf *prf = cpu->prf;
+  int regs = APEX_THREAD_REGS * cpu->threads;
+  int mapped[APEX_THREAD_REGS * APEX_MAX_THREADS] = {0};
+  int pcount;
 
+  for (int i = 0; i < 24; ++i)
+  {
+    if (prf[i].valid == 0 && prf[i].value >= 0 && prf[i].value < regs)
+      mapped[prf[i].value] = 1;
+    freephyreg(prf, i);
+  }
+  /* A register left sharing an entry reads the ROB or the register file */
+  memset(cpu->prf_alias, -1, sizeof(cpu->prf_alias));
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==0){
-                break;
-            }
-            else frd++;
+  for (int reg = 0; reg < regs; ++reg)
+  {
+    if (!mapped[reg])
+      continue;
+    int value = cpu->regs[reg];
+    for (int n = 0, i = cpu->rob_head; n < cpu->rob_count;
+         ++n, i = (i + 1) % APEX_ROB_SIZE)
+    {
+      APEX_Uop *uop = &cpu->uop_pool[cpu->rob[i]];
+      if (uop->fused && uop->head_rd == reg)
+      {
+        if (uop->head_cycle != RESULT_PENDING)
+        {
+          value = uop->head_value;
         }
-
-        stage->rs1_value=prf[frs1].arf_val;
-        stage->buffer=stage->rs1_value + stage->imm;
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==1){
-                break;
-            }
-            else free++;
+        else
+        {
+          pcount = fun(prf);
+          prf[pcount].value = reg;
+          prf[pcount].valid = 0;
         }
-        freephyreg(prf,free);
-        prf[frd].arf_val=stage->buffer;
-        prf[frd].latest=1;
+      }
+      if (uop->rd != reg || !APEX_op_writes_register(uop->op))
+        continue;
+      if (uop->completed ||
+          (uop->op != APEX_OP_MUL && !is_load(uop->op) &&
+           !alu_pending(cpu, cpu->rob[i])))
+      {
+        value = uop->buffer;
+      }
+      else
+      {
+        pcount = fun(prf);
+        prf[pcount].value = reg;
+        prf[pcount].valid = 0;
+      }
+    }
+    pcount = fun(prf);
+    prf[pcount].value = reg;
+    prf[pcount].valid = 0;
+    prf[pcount].arf_val = value;
+    prf[pcount].latest = 1;
+  }
+}
+
+/*
+ * Squashes the instruction at ROB slot pos and everything younger. A
+ * memory order violation queues them to be fetched again in program
+ * order; a mispredicted branch drops them, and with them any earlier
+ * replays not fetched yet, which are younger still, and every thread
+ * fetches again from its oldest dropped instruction. Returns the
+ * number squashed.
+ */
+static int squash_from(APEX_CPU *cpu, int pos, int replay)
+{
+  int squashed[APEX_REPLAY_SIZE];
+  int count = 0;
 
+  int entries = (cpu->rob_tail - pos + APEX_ROB_SIZE) % APEX_ROB_SIZE;
+  for (int n = 0; n < entries; ++n)
+  {
+    int index = cpu->rob[(pos + n) % APEX_ROB_SIZE];
+    APEX_Uop *uop = &cpu->uop_pool[index];
+    if (is_branch(uop->op) && !uop->completed)
+    {
+      cpu->unresolved_branches--;
+      if (uop->checkpoint >= 0)
+        release_checkpoint(cpu, uop->checkpoint);
+    }
+    squashed[count++] = index;
+  }
+  cpu->rob_tail = pos;
+  cpu->rob_count -= entries;
+  if (cpu->config.topdown)
+  {
+    cpu->topdown.slots[replay ? APEX_TD_BAD_REPLAY : APEX_TD_BAD_BRANCH] += entries;
+    cpu->topdown.in_flight -= entries;
+    cpu->topdown.refill = 1;
+  }
+  if (cpu->stage[DRF].uop != APEX_UOP_BUBBLE)
+    squashed[count++] = cpu->stage[DRF].uop;
+  if (cpu->stage[F].uop != APEX_UOP_BUBBLE)
+    squashed[count++] = cpu->stage[F].uop;
+
+  /* Earlier replays not fetched yet are younger still */
+  APEX_Uop pending[APEX_REPLAY_SIZE];
+  int pending_count = cpu->replay_count;
+  for (int i = 0; i < pending_count; ++i)
+    pending[i] = cpu->replay[(cpu->replay_head + i) % APEX_REPLAY_SIZE];
+  cpu->replay_head = 0;
+  cpu->replay_count = 0;
+  for (int i = 0; replay && i < count + pending_count && i < APEX_REPLAY_SIZE; ++i)
+  {
+    cpu->replay[cpu->replay_count++] =
+        i < count ? cpu->uop_pool[squashed[i]] : pending[i - count];
+  }
+  if (!replay && cpu->threads > 1)
+  {
+    int rewound = 0;
+    for (int i = 0; i < count + pending_count; ++i)
+    {
+      APEX_Uop *uop = i < count ? &cpu->uop_pool[squashed[i]] : &pending[i - count];
+      if (!(rewound & (1 << uop->thread)))
+        set_thread_pc(cpu, uop->thread, uop->fused ? uop->head_pc : uop->pc);
+      rewound |= 1 << uop->thread;
     }
-    if(strcmp(stage->opcode,"STR")==0){
+  }
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs1 && prf[i].latest==1){
-                break;
-            }
-            else frs1++;
-        }
+  for (int i = 0; i < count; ++i)
+  {
+    for (int s = F; s < NUM_STAGES; ++s)
+    {
+      if (cpu->stage[s].uop == squashed[i])
+        cpu->stage[s].uop = APEX_UOP_BUBBLE;
+    }
+    for (int p = 0; p < cpu->config.ports; ++p)
+    {
+      APEX_Port *port = &cpu->port[p];
+      for (int s = 0; s < 2; ++s)
+      {
+        if (port->alu[s] == squashed[i])
+          port->alu[s] = APEX_UOP_BUBBLE;
+      }
+      for (int s = 0; s < 3; ++s)
+      {
+        if (port->mul[s] == squashed[i])
+          port->mul[s] = APEX_UOP_BUBBLE;
+      }
+    }
+    cpu->uop_pool[squashed[i]].seq = 0;
+    uop_free(cpu, squashed[i]);
+  }
+  while (cpu->lsq_count > 0)
+  {
+    int last = cpu->lsq[(cpu->lsq_head + cpu->lsq_count - 1) % APEX_LSQ_SIZE];
+    if (cpu->uop_pool[last].seq != 0)
+      break;
+    cpu->lsq_count--;
+  }
+  return count;
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs2 && prf[i].latest==1){
-                break;
-            }
-            else frs2++;
+/*
+ * Brings the rename state back to what a branch saw at dispatch, plus
+ * the results older instructions wrote since. Once the write log has
+ * wrapped past the snapshot the table is rebuilt from the ROB instead.
+ */
+static void restore_checkpoint(APEX_CPU *cpu, int c)
+{
+  APEX_Checkpoint *checkpoint = &cpu->checkpoints[c];
 
-        }
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs3 && prf[i].latest==1){
-                break;
-            }
-            else frs3++;
+  if (cpu->prf_log_count - checkpoint->log_position > APEX_PRF_LOG_SIZE)
+  {
+    cpu->branch.rebuilds++;
+    rebuild_rename(cpu);
+    return;
+  }
+  cpu->branch.restores++;
+  memcpy(cpu->prf, checkpoint->prf, sizeof(cpu->prf));
+  memcpy(cpu->prf_alias, checkpoint->prf_alias, sizeof(cpu->prf_alias));
+  for (long i = checkpoint->log_position; i < cpu->prf_log_count; ++i)
+  {
+    const APEX_Prf_Write *write = &cpu->prf_log[i % APEX_PRF_LOG_SIZE];
+    /* A fused branch's own head is older than the branch */
+    if (write->seq <= checkpoint->seq)
+      prf_apply(cpu->prf, cpu->prf_alias, write->rd, write->value);
+  }
+}
 
-        }
+/*
+ * An older store just wrote memory, a younger load that already read
+ * the same word got stale data. It and everything after it replay.
+ */
+static void check_violation(APEX_CPU *cpu, int store_index)
+{
+  APEX_Uop *store = &cpu->uop_pool[store_index];
+  int younger = 0;
 
-        stage->rs1_value=prf[frs1].arf_val;
-        stage->rs2_value=prf[frs2].arf_val;
-        stage->rs3_value=prf[frs3].arf_val;
-        stage->buffer=stage->rs2_value + stage->rs3_value;
+  for (int n = 0; n < cpu->lsq_count; ++n)
+  {
+    int index = cpu->lsq[(cpu->lsq_head + n) % APEX_LSQ_SIZE];
+    APEX_Uop *uop = &cpu->uop_pool[index];
+    if (index == store_index)
+    {
+      younger = 1;
+      continue;
+    }
+    if (!younger || !is_load(uop->op) || uop->thread != store->thread)
+      continue;
+    if (uop->dep_uop == store_index && uop->dep_seq == store->seq)
+      uop->dep_address = store->mem_address;
+    if (uop->executed && uop->mem_address == store->mem_address)
+    {
+      cpu->store_sets.violations++;
+      APEX_store_sets_violation(&cpu->store_sets, uop->pc, store->pc);
+      if (ENABLE_DEBUG_MESSAGES && cpu->display)
+        printf("Violation      : load pc(%d) read MEM[%d] before store pc(%d)\n",
+               uop->pc, uop->mem_address, store->pc);
+      cpu->store_sets.replayed += squash_from(cpu, uop->rob_slot, 1);
+      rebuild_rename(cpu);
+      return;
+    }
+  }
+}
 
+/*
+ * Zero flag as the branch at ROB slot pos sees it, from the youngest
+ * older instruction that sets it or else the retired flag. Returns 0
+ * until that instruction's result is on the bypass.
+ */
+static int rob_zero_flag(APEX_CPU *cpu, int pos, int *zero)
+{
+  int thread = cpu->uop_pool[cpu->rob[pos]].thread;
+  for (int i = pos; i != cpu->rob_head;)
+  {
+    i = (i + APEX_ROB_SIZE - 1) % APEX_ROB_SIZE;
+    APEX_Uop *older = &cpu->uop_pool[cpu->rob[i]];
+    if (older->thread != thread)
+      continue;
+    if (sets_zero_flag(older->op))
+    {
+      *zero = older->buffer == 0;
+      return older->value_cycle <= cpu->clock;
+    }
+    if (older->fused && sets_zero_flag(older->head_op))
+    {
+      *zero = older->head_value == 0;
+      return older->head_cycle <= cpu->clock;
     }
-    if(strcmp(stage->opcode,"LOAD")==0){
+  }
+  *zero = cpu->zFlag[thread];
+  return 1;
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs1 && prf[i].latest==1){
-                break;
-            }
-            else frs1++;
-        }
+/* APEX_PORT_* class a dispatched uop executes as, 0 if it needs no port */
+static int port_class(const APEX_Uop *uop)
+{
+  if (uop->completed)
+    return 0;
+  if (uop->op == APEX_OP_MUL)
+    return APEX_PORT_MUL;
+  if (is_load(uop->op) || is_store(uop->op))
+    return APEX_PORT_AGU;
+  /* An ALU and branch pair computes its flag on an ALU port */
+  if (is_branch(uop->op))
+    return uop->fused ? APEX_PORT_ALU : APEX_PORT_BRANCH;
+  return APEX_PORT_ALU;
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==0){
-                break;
-            }
-            else frd++;
-        }
+/* Index of a single APEX_PORT_* class bit, as in APEX_Port.issued */
+static int port_class_index(int class)
+{
+  int index = 0;
+  while (class > 1)
+  {
+    class >>= 1;
+    index++;
+  }
+  return index;
+}
 
-        stage->rs1_value=prf[frs1].arf_val;
-        stage->buffer=stage->rs1_value + stage->imm;
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==1){
-                break;
-            }
-            else free++;
-        }
-        freephyreg(prf,free);
-        prf[frd].arf_val=stage->buffer;
-        prf[frd].latest=1;
-    }
-    if(strcmp(stage->opcode,"LDR")==0){
+/* Classes a port executes */
+static int port_width(int classes)
+{
+  int width = 0;
+  for (; classes; classes &= classes - 1)
+    width++;
+  return width;
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs1 && prf[i].latest==1){
-                break;
-            }
-            else frs1++;
-        }
+/*
+ * Free port executing class this cycle, the one executing the fewest
+ * classes so the versatile ports stay open. Returns -1 if all are taken.
+ */
+static int free_port(APEX_CPU *cpu, int class)
+{
+  int best = -1;
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs2 && prf[i].latest==1){
-                break;
-            }
-            else frs2++;
+  for (int p = 0; p < cpu->config.ports; ++p)
+  {
+    APEX_Port *port = &cpu->port[p];
+    if (!(port->classes & class) || port->taken == cpu->clock)
+      continue;
+    if (best < 0 || port_width(port->classes) < port_width(cpu->port[best].classes))
+      best = p;
+  }
+  return best;
+}
 
-        }
+/* Takes port p for this cycle and counts the class it executes */
+static void bind_port(APEX_CPU *cpu, int p, int class)
+{
+  cpu->port[p].taken = cpu->clock;
+  cpu->port[p].issued[port_class_index(class)]++;
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==0){
-                break;
-            }
-            else frd++;
-        }
+/* ALU stage of a port, operands are what the uop's ROB slot sees */
+static void port_alu(APEX_CPU *cpu, int index)
+{
+  APEX_Uop *uop = &cpu->uop_pool[index];
 
-        stage->rs1_value=prf[frs1].arf_val;
-        stage->rs2_value=prf[frs2].arf_val;
-        stage->buffer=stage->rs1_value+stage->rs2_value;
+  if (uop->fused)
+    execute_head(cpu, uop);
+  switch (uop->op)
+  {
+  case APEX_OP_MOVC:
+    uop->buffer = uop->imm;
+    break;
+  case APEX_OP_ADD:
+  case APEX_OP_SUB:
+    uop_operand(cpu, uop, uop->rs1, &uop->rs1_value);
+    uop_operand(cpu, uop, uop->rs2, &uop->rs2_value);
+    uop->buffer = uop->op == APEX_OP_ADD ? uop->rs1_value + uop->rs2_value
+                                         : uop->rs1_value - uop->rs2_value;
+    break;
+  case APEX_OP_ADDL:
+  case APEX_OP_SUBL:
+    uop_operand(cpu, uop, uop->rs1, &uop->rs1_value);
+    uop->buffer = uop->op == APEX_OP_ADDL ? uop->rs1_value + uop->imm
+                                          : uop->rs1_value - uop->imm;
+    break;
+  default:
+    /* The LSQ computes addresses, the branch unit resolves a fused branch */
+    return;
+  }
+  prf_write(cpu, uop);
+  broadcast(cpu, index);
+}
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==1){
-                break;
-            }
-            else free++;
-        }
-        freephyreg(prf,free);
-        prf[frd].arf_val=stage->buffer;
-        prf[frd].latest=1;
+/*
+ * Advances every port's stages, last first. Memory ops leaving the
+ * ALU stages join the LSQ oldest first, whichever port they took.
+ */
+static void port_stages(APEX_CPU *cpu)
+{
+  int to_lsq[APEX_MAX_PORTS];
+  int count = 0;
 
+  for (int p = 0; p < cpu->config.ports; ++p)
+  {
+    APEX_Port *port = &cpu->port[p];
+    APEX_Uop *uop = &cpu->uop_pool[port->mul[2]];
+    if (port->mul[2] != APEX_UOP_BUBBLE)
+    {
+      uop->buffer = uop->rs1_value * uop->rs2_value;
+      prf_write(cpu, uop);
+      broadcast(cpu, port->mul[2]);
+      uop->completed = 1;
     }
-    cpu->stage[INT_FU2]=cpu->stage[INT_FU1];
-    if (ENABLE_DEBUG_MESSAGES)
+    port->mul[2] = port->mul[1];
+    /* Operands are read as the MUL enters the pipe */
+    uop = &cpu->uop_pool[port->mul[0]];
+    if (port->mul[0] != APEX_UOP_BUBBLE)
     {
-        print_stage_content("Integer FU1", stage);
+      uop_operand(cpu, uop, uop->rs1, &uop->rs1_value);
+      uop_operand(cpu, uop, uop->rs2, &uop->rs2_value);
     }
+    port->mul[1] = port->mul[0];
+    port->mul[0] = APEX_UOP_BUBBLE;
 
+    uop = &cpu->uop_pool[port->alu[1]];
+    if (port->alu[1] != APEX_UOP_BUBBLE)
+    {
+      if (is_load(uop->op) || is_store(uop->op))
+        to_lsq[count++] = port->alu[1];
+      else if (!is_branch(uop->op))
+        uop->completed = 1;
+    }
+    port->alu[1] = port->alu[0];
+    if (port->alu[0] != APEX_UOP_BUBBLE)
+      port_alu(cpu, port->alu[0]);
+    port->alu[0] = APEX_UOP_BUBBLE;
 
-    return 0;
-}
-
-int intfu2(APEX_CPU *cpu)
-{
-    int strcounter=0, othercounter=0;
-    CPU_Stage *stage = &cpu->stage[INT_FU2];
-        if(strcmp(stage->opcode,"STORE")==0  ||
-           strcmp(stage->opcode,"LOAD") ==0  ||
-           strcmp(stage->opcode,"STR")  ==0  ||
-           strcmp(stage->opcode,"LDR")  ==0
-        ){
-            cpu->stage[MEM]=cpu->stage[INT_FU2];
-            strcounter++;
-        }
-        else {
-            cpu->stage[RETIRE] = cpu->stage[INT_FU2];
-            othercounter++;
-        }
-    if (ENABLE_DEBUG_MESSAGES)
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
     {
-        print_stage_content("Integer FU2", stage);
+      char name[32];
+      snprintf(name, sizeof(name), "Port %d", p);
+      print_stage_content(name, &cpu->uop_pool[port->alu[1]]);
     }
-    if(strcounter==0)
-        strcpy(cpu->stage[MEM].opcode,"");
-    if(othercounter==0)
-        strcpy(cpu->stage[RETIRE].opcode,"");
+  }
 
-    return 0;
+  for (int i = 0; i < count; ++i)
+  {
+    int oldest = i;
+    for (int j = i + 1; j < count; ++j)
+    {
+      if (cpu->uop_pool[to_lsq[j]].seq < cpu->uop_pool[to_lsq[oldest]].seq)
+        oldest = j;
+    }
+    int index = to_lsq[oldest];
+    to_lsq[oldest] = to_lsq[i];
+    cpu->lsq[(cpu->lsq_head + cpu->lsq_count) % APEX_LSQ_SIZE] = index;
+    cpu->lsq_count++;
+  }
 }
 
-int mulfu1(APEX_CPU *cpu)
+/*
+ * Scheduler, binds ready instructions in the ROB to free ports oldest
+ * first. Memory ops leave in program order, which keeps the LSQ in
+ * order; branches take their port as the branch unit resolves them.
+ */
+static void port_select(APEX_CPU *cpu)
 {
-    CPU_Stage *stage = &cpu->stage[MUL_FU1];
+  int memory_waiting = 0;
 
-    //if(!stage->stalled)
-    //cpu->stage[RETIRE] = cpu->stage[EX];
-    cpu->stage[MUL_FU2]=cpu->stage[MUL_FU1];
-    if (ENABLE_DEBUG_MESSAGES)
+  for (int n = 0, pos = cpu->rob_head; n < cpu->rob_count;
+       ++n, pos = (pos + 1) % APEX_ROB_SIZE)
+  {
+    int index = cpu->rob[pos];
+    APEX_Uop *uop = &cpu->uop_pool[index];
+    int class = uop->issued ? 0 : port_class(uop);
+    if (!class || class == APEX_PORT_BRANCH ||
+        (class == APEX_PORT_AGU && memory_waiting))
+      continue;
+
+    int p = free_port(cpu, class);
+    if (p >= 0 && operands_ready(cpu, uop, pos))
     {
-        print_stage_content("MUL FU1", stage);
+      bind_port(cpu, p, class);
+      uop->issued = 1;
+      if (class == APEX_PORT_MUL)
+        cpu->port[p].mul[0] = index;
+      else
+        cpu->port[p].alu[0] = index;
+      continue;
     }
-    return 0;
+    if (p < 0 && sources_ready(cpu, uop, pos))
+    {
+      cpu->port_conflicts++;
+      cpu->port_conflict_cycle = cpu->clock;
+    }
+    memory_waiting |= class == APEX_PORT_AGU;
+  }
 }
 
-int mulfu2(APEX_CPU *cpu)
+/*
+ * Resolves the oldest branch in the ROB whose condition is known. On
+ * a misprediction everything younger is squashed by the branch's mask
+ * bit, the rename table comes back from its checkpoint in one cycle
+ * and fetch restarts on the right path.
+ */
+int branch_unit(APEX_CPU *cpu)
 {
-    CPU_Stage *stage = &cpu->stage[MUL_FU2];
+  int index = APEX_UOP_BUBBLE;
+  int next_pc = 0;
 
-    //if(!stage->stalled)
-    //cpu->stage[RETIRE] = cpu->stage[EX];
-    cpu->stage[MUL_FU3]=cpu->stage[MUL_FU2];
-    if (ENABLE_DEBUG_MESSAGES)
+  for (int n = 0, pos = cpu->rob_head; n < cpu->rob_count;
+       ++n, pos = (pos + 1) % APEX_ROB_SIZE)
+  {
+    APEX_Uop *uop = &cpu->uop_pool[cpu->rob[pos]];
+    int ready, value;
+    if (!is_branch(uop->op) || uop->completed)
+      continue;
+    if (uop->op == APEX_OP_JUMP)
     {
-        print_stage_content("MUL FU2", stage);
+      ready = rob_operand(cpu, pos, uop->rs1, &value);
+      next_pc = value + uop->imm;
+    }
+    else if (uop->fused)
+    {
+      /* The flag comes from the branch's own head */
+      ready = uop->head_cycle <= cpu->clock;
+      value = uop->head_value == 0;
+      int taken = uop->op == APEX_OP_BZ ? value : !value;
+      next_pc = taken ? uop->pc + uop->imm : uop->pc + 4;
+    }
+    else
+    {
+      ready = rob_zero_flag(cpu, pos, &value);
+      int taken = uop->op == APEX_OP_BZ ? value : !value;
+      next_pc = taken ? uop->pc + uop->imm : uop->pc + 4;
+    }
+    if (cpu->trace)
+      next_pc = trace_next_pc(uop);
+    if (ready)
+    {
+      index = cpu->rob[pos];
+      break;
+    }
+  }
+
+  /* With ports a branch resolves on one executing branches */
+  if (cpu->config.ports && index != APEX_UOP_BUBBLE && !cpu->uop_pool[index].fused)
+  {
+    int p = free_port(cpu, APEX_PORT_BRANCH);
+    if (p >= 0)
+      bind_port(cpu, p, APEX_PORT_BRANCH);
+    else
+    {
+      cpu->port_conflicts++;
+      cpu->port_conflict_cycle = cpu->clock;
+      index = APEX_UOP_BUBBLE;
     }
+  }
 
+  APEX_Uop *branch = &cpu->uop_pool[index];
+  if (index != APEX_UOP_BUBBLE)
+  {
+    branch->completed = 1;
+    cpu->unresolved_branches--;
+    if (next_pc != branch->predicted_pc)
+    {
+      cpu->branch.mispredicts++;
+      cpu->branch.squashed +=
+          squash_from(cpu, (branch->rob_slot + 1) % APEX_ROB_SIZE, 0);
+      /* Without a checkpoint nothing younger was renamed */
+      if (branch->checkpoint >= 0)
+      {
+        restore_checkpoint(cpu, branch->checkpoint);
+        cpu->recovery_stall = 1;
+      }
+      set_thread_pc(cpu, branch->thread, next_pc);
+      cpu->fetch_blocked = 0;
+      loop_redirect(cpu, branch->pc, next_pc);
+    }
+    if (branch->checkpoint >= 0)
+      release_checkpoint(cpu, branch->checkpoint);
+  }
+  if (ENABLE_DEBUG_MESSAGES && cpu->display)
+  {
+    print_stage_content("Branch", branch);
+  }
+  return 0;
+}
 
-    return 0;
+/*
+ * Times a data memory access in the cache and lets the prefetcher
+ * train on it, returns the stall cycles of the access
+ */
+static int dcache_access(APEX_CPU *cpu, const APEX_Uop *uop, int is_store)
+{
+  /* Each thread's data memory has its own lines */
+  int address = uop->thread * APEX_DATA_MEMORY_WORDS + uop->mem_address;
+  int latency = APEX_cache_access(cpu->dcache, address, is_store, cpu->clock);
+  if (cpu->prefetcher)
+  {
+    int lines[APEX_PREFETCH_MAX_DEGREE];
+    int miss = latency > 0 || cpu->dcache->prefetch_hit;
+    int count = APEX_prefetcher_train(cpu->prefetcher, uop->pc, address, miss, lines);
+    for (int i = 0; i < count; ++i)
+    {
+      APEX_cache_prefetch(cpu->dcache, lines[i], cpu->clock);
+    }
+  }
+  return latency;
 }
 
-int mulfu3(APEX_CPU *cpu){
-    CPU_Stage *stage = &cpu->stage[MUL_FU3];
-    int frd=0,frs1=0,frs2=0,free=0;
-    if(strcmp(stage->opcode,"MUL")==0){
+int mem(APEX_CPU *cpu){
+    CPU_Stage *latch = &cpu->stage[MEM];
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs1 && prf[i].latest==1){
-                break;
-            }
-            else frs1++;
+    /* Loads that missed complete once their line arrives */
+    for (int n = 0; n < cpu->lsq_count; ++n)
+    {
+        int index = cpu->lsq[(cpu->lsq_head + n) % APEX_LSQ_SIZE];
+        APEX_Uop *uop = &cpu->uop_pool[index];
+        if (uop->executed && !uop->completed && uop->ready_cycle <= cpu->clock)
+        {
+            uop->completed = 1;
+            broadcast(cpu, index);
         }
+    }
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rs2 && prf[i].latest==1){
-                break;
+    /* Pick this cycle's memory operation from the load/store queue */
+    latch->uop = lsq_select(cpu);
+    APEX_Uop *stage = &cpu->uop_pool[latch->uop];
+    if(stage->op == APEX_OP_STORE || stage->op == APEX_OP_STR) {
+            if (cpu->debug.armed & APEX_WATCH_MEM)
+                APEX_debug_on_store(cpu, stage, stage->mem_address);
+            if (stage->mem_address >= 0 && stage->mem_address < 4096)
+            {
+                if (cpu->dcache)
+                    cpu->mem_stall = dcache_access(cpu, stage, 1);
+                thread_memory(cpu, stage)[stage->mem_address]=stage->rs1_value;
             }
-            else frs2++;
+    }
 
-        }
+    if(stage->op == APEX_OP_LDR || stage->op == APEX_OP_LOAD) {
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==0){
-                break;
-            }
-            else frd++;
+        stage->buffer = 0;
+        stage->ready_cycle = cpu->clock;
+        if (stage->mem_address >= 0 && stage->mem_address < 4096)
+        {
+            /* The port stays free on a miss, only the load waits for the fill */
+            if (cpu->dcache)
+                stage->ready_cycle += dcache_access(cpu, stage, 0);
+            stage->buffer=thread_memory(cpu, stage)[stage->mem_address];
         }
-
-        stage->rs1_value=prf[frs1].arf_val;
-        stage->rs2_value=prf[frs2].arf_val;
-        stage->buffer=stage->rs1_value*stage->rs2_value;
-
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==1){
-                break;
-            }
-            else free++;
+        prf_write(cpu, stage);
+    }
+    if (latch->uop != APEX_UOP_BUBBLE)
+    {
+        stage->executed = 1;
+        if (is_store(stage->op))
+        {
+            APEX_store_sets_executed(&cpu->store_sets, stage, latch->uop);
+            check_violation(cpu, latch->uop);
         }
-        freephyreg(prf,free);
-        prf[frd].arf_val=stage->buffer;
-        prf[frd].latest=1;
-
     }
-    cpu->stage[RETIRE]=cpu->stage[MUL_FU3];
-    if (ENABLE_DEBUG_MESSAGES)
+    if (is_load(stage->op) && stage->ready_cycle > cpu->clock)
+        latch->uop = APEX_UOP_BUBBLE;
+    else
     {
-        print_stage_content("MUL FU3", stage);
+        if (is_load(stage->op))
+            broadcast(cpu, latch->uop);
+        complete_latch(cpu, latch);
+    }
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
+    {
+        print_stage_content("Memmory", stage);
     }
     return 0;
-
 }
 
-int mem(APEX_CPU *cpu){
-    CPU_Stage *stage = &cpu->stage[MEM];
-    int frs1=0,frd=0,free=0;
-    if(strcmp(stage->opcode,"STORE")==0 || strcmp(stage->opcode,"STR")) {
-
-        for (int i = 0; i <24 ; ++i) {
-            if (prf[i].value == stage->rs1 && prf[i].latest == 1) {
-                break;
-            } else frs1++;
-        }
-            stage->rs1_value=prf[frs1].arf_val;
-            cpu->regs[stage->buffer]=stage->rs1_value;
-            freephyreg(prf,frs1);
-
-
-    }
+/* Folds what a retiring op changes into the digest, before it is committed */
+static void digest_retire(APEX_CPU *cpu, const APEX_Uop *uop, int op, int rd, int value)
+{
+    APEX_Digest *digest = &cpu->digest;
+
+    if (APEX_op_writes_register(op))
+        APEX_digest_update(digest, APEX_DIGEST_REG(rd), cpu->regs[rd], value);
+    if (sets_zero_flag(op))
+        APEX_digest_update(digest, APEX_DIGEST_FLAG(uop->thread), cpu->zFlag[uop->thread],
+                           value == 0);
+    if (op == APEX_OP_STORE || op == APEX_OP_STR)
+        APEX_digest_store(digest, uop->thread, uop->mem_address, uop->rs1_value);
+    APEX_digest_retired(digest, cpu->ins_completed);
+}
 
-    if(strcmp(stage->opcode,"LDR")==0 || strcmp(stage->opcode,"LOAD")==0) {
+/*
+ * Commits one instruction to the architectural state. With head set
+ * that is the head of uop's fused pair, read from the head fields: an
+ * ALU op writing a register, never a store.
+ */
+static void commit(APEX_CPU *cpu, APEX_Uop *uop, int head)
+{
+    int pc = head ? uop->head_pc : uop->pc;
+    int op = head ? uop->head_op : uop->op;
+    int rd = head ? uop->head_rd : uop->rd;
+    int value = head ? uop->head_value : uop->buffer;
 
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==0){
-                break;
-            }
-            else frd++;
-        }
+    cpu->ins_completed++;
 
-        stage->rs1_value=prf[frs1].arf_val;
-        stage->buffer=stage->rs1_value + stage->imm;
-        for (int i = 0; i <24 ; ++i) {
-            if(prf[i].value==stage->rd && prf[i].latest==1){
-                break;
-            }
-            else free++;
-        }
-        freephyreg(prf,free);
-        prf[frd].arf_val=stage->buffer;
-        prf[frd].latest=1;
-    }
-    cpu->stage[RETIRE]=cpu->stage[MEM];
-    if (ENABLE_DEBUG_MESSAGES)
+    /* Commit the result to the architectural register file */
+    int writes_rd = APEX_op_writes_register(op);
+    if (cpu->digest.log)
+        digest_retire(cpu, uop, op, rd, value);
+    if (writes_rd)
+        cpu->regs[rd] = value;
+    if (sets_zero_flag(op))
+        cpu->zFlag[uop->thread] = value == 0;
+    cpu->context[uop->thread].retired++;
+    cpu->context[uop->thread].last_retire = cpu->clock + 1;
+
+    if (cpu->cosim)
     {
-        print_stage_content("Memmory", stage);
+        APEX_Retire_Record record;
+        int store = op == APEX_OP_STORE || op == APEX_OP_STR;
+        record.pc = pc;
+        record.rd = writes_rd ? rd : -1;
+        record.value = value;
+        record.mem_address = store ? uop->mem_address : -1;
+        record.mem_value = uop->rs1_value;
+        record.cycle = cpu->clock + 1;
+        APEX_cosim_retire(cpu->cosim, &record);
     }
-    return 0;
+    if (cpu->debug.armed)
+        APEX_debug_on_retire(cpu, pc, rd);
 }
 
 int retire(APEX_CPU *cpu){
-    CPU_Stage *stage = &cpu->stage[RETIRE];
-    if (ENABLE_DEBUG_MESSAGES)
+    int head = APEX_UOP_BUBBLE;
+    if (cpu->rob_count > 0)
     {
-        print_stage_content("Retired", stage);
+        /* A result still queued for a bus has not reached the register file */
+        APEX_Uop *oldest = &cpu->uop_pool[cpu->rob[cpu->rob_head]];
+        if (oldest->completed && (oldest->value_cycle != RESULT_PENDING ||
+                                  !APEX_op_writes_register(oldest->op)))
+            head = cpu->rob[cpu->rob_head];
     }
-    cpu->ins_completed++;
+    if (ENABLE_DEBUG_MESSAGES && cpu->display)
+    {
+        print_stage_content("Retired", &cpu->uop_pool[head]);
+    }
+    if (head == APEX_UOP_BUBBLE)
+        return 0;
+    cpu->rob_head = (cpu->rob_head + 1) % APEX_ROB_SIZE;
+    cpu->rob_count--;
+    if (cpu->lsq_count > 0 && cpu->lsq[cpu->lsq_head] == head)
+    {
+        cpu->lsq_head = (cpu->lsq_head + 1) % APEX_LSQ_SIZE;
+        cpu->lsq_count--;
+    }
+
+    /* A fused pair retires as its two instructions, head first */
+    APEX_Uop *uop = &cpu->uop_pool[head];
+    if (uop->fused)
+        commit(cpu, uop, 1);
+    commit(cpu, uop, 0);
+    uop_free(cpu, head);
+    if (cpu->config.topdown)
+        topdown_retire(cpu);
     return 0;
 }
 
-int APEX_cpu_run(APEX_CPU *cpu, const char *function, int cycles)
+/*
+ * Advances the pipeline by one clock cycle, returns 0 once every
+ * instruction has retired and the pipeline is empty
+ */
+int APEX_cpu_cycle(APEX_CPU *cpu)
 {
+  /* A blocking cache freezes the whole core until the line arrives */
+  if (cpu->mem_stall > 0)
+  {
+    cpu->mem_stall--;
+    cpu->mem_stall_cycles++;
+    if (cpu->config.topdown)
+      cpu->topdown.slots[APEX_TD_MEM_STORE]++;
+    cpu->clock++;
+    return 1;
+  }
+  bypass_cycle(cpu);
 
-  if (strcmp(function, "display") == 0)
+  if (ENABLE_DEBUG_MESSAGES && cpu->display)
+  {
+    printf("--------------------------------\n");
+    printf("Clock Cycle #: %d\n", cpu->clock + 1);
+    printf("--------------------------------\n");
+  }
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_RETIRE,
+                     cpu->rob_count ? cpu->rob[cpu->rob_head] : APEX_UOP_BUBBLE,
+                     retire(cpu));
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_MEM, cpu->stage[MEM].uop, mem(cpu));
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_BRANCH_UNIT, APEX_UOP_BUBBLE, branch_unit(cpu));
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_MULFU3, cpu->stage[MUL_FU3].uop, mulfu3(cpu));
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_MULFU2, cpu->stage[MUL_FU2].uop, mulfu2(cpu));
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_MULFU1, cpu->stage[MUL_FU1].uop, mulfu1(cpu));
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_INTFU2, cpu->stage[INT_FU2].uop, intfu2(cpu));
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_INTFU1, cpu->stage[INT_FU1].uop, intfu1(cpu));
+  if (cpu->config.ports)
+    port_stages(cpu);
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_DECODE, cpu->stage[DRF].uop, decode(cpu));
+  /* What decode dispatched may issue in the same cycle, as from decode without ports */
+  if (cpu->config.ports)
+    port_select(cpu);
+  APEX_PROFILE_STAGE(cpu, APEX_PROF_FETCH, cpu->stage[F].uop, fetch(cpu));
+
+  cpu->clock++;
+
+  if (cpu->debug.armed & APEX_BREAK_CYCLE)
   {
+    APEX_debug_on_cycle(cpu);
+  }
 
-    /* All the instructions committed, so exit */
-    while (cpu->clock != cpu->no_cycles)
-    {
+  int occupied = cpu->rob_count;
+  for (int i = F; i < NUM_STAGES; ++i)
+  {
+    occupied |= cpu->stage[i].uop != APEX_UOP_BUBBLE;
+  }
+  /* Another thread may still have code once the fetching one is done */
+  for (int t = 0; t < cpu->threads && cpu->threads > 1; ++t)
+  {
+    occupied |= thread_has_code(cpu, t);
+  }
+  return occupied;
+}
 
-      if (ENABLE_DEBUG_MESSAGES)
-      {
-        printf("--------------------------------\n");
-        printf("Clock Cycle #: %d\n", cpu->clock + 1);
-        printf("--------------------------------\n");
-      }
-      retire(cpu);
-      mem(cpu);
-      mulfu3(cpu);
-      mulfu2(cpu);
-      mulfu1(cpu);
-      intfu2(cpu);
-      intfu1(cpu);
-      decode(cpu);
-      fetch(cpu);
-
-      cpu->clock++;
-
-      CPU_Stage *stage1 = &cpu->stage[F];
-      CPU_Stage *stage2 = &cpu->stage[DRF];
-      CPU_Stage *stage3 = &cpu->stage[INT_FU1];
-      CPU_Stage *stage4 = &cpu->stage[INT_FU2];
-      CPU_Stage *stage5 = &cpu->stage[MUL_FU1];
-      CPU_Stage *stage6 = &cpu->stage[MUL_FU2];
-      CPU_Stage *stage7 = &cpu->stage[MUL_FU3];
-      CPU_Stage *stage8 = &cpu->stage[MEM];
-      CPU_Stage *stage9 = &cpu->stage[RETIRE];
-
-
-      if (
-          (strcmp(stage2->opcode, "") == 0) &&
-          (strcmp(stage1->opcode, "") == 0) &&
-          (strcmp(stage3->opcode, "") == 0) &&
-          (strcmp(stage4->opcode, "") == 0) &&
-                  (strcmp(stage6->opcode, "") == 0) &&
-                  (strcmp(stage7->opcode, "") == 0) &&
-                  (strcmp(stage8->opcode, "") == 0) &&
-                  (strcmp(stage9->opcode, "") == 0) &&
-          (strcmp(stage5->opcode, "") == 0)
-
-      )
-      {
-        break;
-      }
+/*
+ * Steps the pipeline until every instruction has retired or the clock
+ * reaches the cycle limit, returns the number of cycles simulated
+ */
+int APEX_cpu_simulate(APEX_CPU *cpu, int cycles)
+{
+  int start = cpu->clock;
+  cpu->no_cycles = cycles;
+#ifdef APEX_PROFILE
+  uint64_t profile_ns = APEX_profile_ns();
+  uint64_t profile_ticks = APEX_profile_ticks();
+#endif
+
+  /* All the instructions committed, so exit */
+  while (cpu->clock != cpu->no_cycles)
+  {
+    if (!APEX_cpu_cycle(cpu))
+    {
+      break;
     }
-    printf("(apex) >> Simulation Complete");
-    printf("\n");
-
-    printf("++++++++++++++RAT++++++++++++++++\n");
-      for (int j = 0; j < 24; ++j) {
-          if(prf[j].valid!=1)
-          printf("|R[%d] = P%d & valid = %d ARF_VAL=%d Latest=%d|\n",prf[j].value,j, prf[j].valid,prf[j].arf_val,prf[j].latest);
-      }
-printf("\n");
-    printf("=====REGISTER VALUE============\n");
-    for (int i = 0; i < 16; i++)
+    if (cpu->debug.hit)
     {
-      char *validStr;
-      if (cpu->freeRegisterFlag[i] == 1)
-      {
-        validStr = "Valid";
-      }
-      else
+      if (!cpu->config.break_trace)
       {
-        validStr = "InValid";
+        break;
       }
-
-      printf("\n");
-      printf(" | Register[%d] | Value=%d | status=%s | \n", i, cpu->regs[i], validStr);
+      /* Trace everything from the breakpoint on */
+      printf("APEX_DEBUG : %s, tracing from cycle %d\n",
+             cpu->debug.reason, cpu->clock + 1);
+      cpu->debug.hit = 0;
+      cpu->debug.armed = 0;
+      cpu->display = 1;
     }
-    printf("=======DATA MEMORY===========\n");
+  }
+#ifdef APEX_PROFILE
+  cpu->profile.run_ticks += APEX_profile_ticks() - profile_ticks;
+  cpu->profile.run_ns += APEX_profile_ns() - profile_ns;
+  cpu->profile.cycles += cpu->clock - start;
+#endif
+  return cpu->clock - start;
+}
 
-    for (int i = 0; i < 99; i++)
+/*
+ * Returns the newest value of an architectural register, read through
+ * the rename table when a physical register holds it
+ */
+int APEX_cpu_reg_value(APEX_CPU *cpu, int reg)
+{
+  /* Ports finish out of order, the youngest writer with a result counts */
+  for (int n = cpu->config.ports ? cpu->rob_count : 0; n > 0; --n)
+  {
+    APEX_Uop *uop = &cpu->uop_pool[cpu->rob[(cpu->rob_head + n - 1) % APEX_ROB_SIZE]];
+    if (uop->rd == reg && APEX_op_writes_register(uop->op) &&
+        uop->value_cycle != RESULT_PENDING)
+      return uop->buffer;
+  }
+  if (cpu->prf_alias[reg] == APEX_PRF_ZERO)
+    return 0;
+  if (cpu->prf_alias[reg] >= 0)
+    return cpu->prf[cpu->prf_alias[reg]].arf_val;
+  for (int i = 0; i < 24; ++i)
+  {
+    if (cpu->prf[i].valid == 0 && cpu->prf[i].value == reg &&
+        cpu->prf[i].latest == 1)
     {
-      printf(" | MEM[%d] | Value=%d | \n", i, cpu->data_memory[i]);
+      return cpu->prf[i].arf_val;
     }
   }
-  else
+  return cpu->regs[reg];
+}
+
+/*
+ * Starts a CPU that has not cycled yet from an architectural state
+ * reached elsewhere. Every register set in live gets a physical
+ * register holding its value, as if written before pc, the rest of
+ * the rename table stays free.
+ */
+void APEX_cpu_set_state(APEX_CPU *cpu, int pc, const int regs[32], unsigned int live,
+                        const int *memory, int zero_flag)
+{
+  int entry = 0;
+
+  cpu->pc = pc;
+  memcpy(cpu->regs, regs, sizeof(int) * APEX_THREAD_REGS);
+  memcpy(cpu->memory, memory, sizeof(cpu->data_memory));
+  cpu->zFlag[0] = zero_flag;
+  for (int reg = 0; reg < 32 && entry < 24; ++reg)
   {
-    /* All the instructions committed, so exit */
-    while (cpu->clock == cpu->no_cycles)
+    if (live & (1u << reg))
     {
-      printf("(apex) >> Simulation Complete");
+      cpu->prf[entry].valid = 0;
+      cpu->prf[entry].value = reg;
+      cpu->prf[entry].latest = 1;
+      cpu->prf[entry].arf_val = regs[reg];
+      entry++;
+    }
+  }
+}
 
-      CPU_Stage *stage1 = &cpu->stage[F];
-      CPU_Stage *stage2 = &cpu->stage[DRF];
+/*
+ * Adds a hardware thread running code_memory, with its own registers,
+ * zero flag and data memory, to a CPU that has not cycled yet. Returns
+ * the thread, or -1 when the CPU holds APEX_MAX_THREADS already. The
+ * code memory stays the caller's.
+ */
+int APEX_cpu_add_thread(APEX_CPU *cpu, APEX_Instruction *code_memory,
+                        int code_memory_size)
+{
+  if (!code_memory || cpu->threads == APEX_MAX_THREADS)
+  {
+    return -1;
+  }
+  int *memory = calloc(APEX_DATA_MEMORY_WORDS, sizeof(int));
+  if (!memory || APEX_memory_image_load(&cpu->config, memory) != 0)
+  {
+    free(memory);
+    return -1;
+  }
+  APEX_Context *context = &cpu->context[cpu->threads];
+  context->code_memory = code_memory;
+  context->code_memory_size = code_memory_size;
+  context->pc = 4000;
+  context->memory = memory;
+  return cpu->threads++;
+}
 
-      if (
-          (strcmp(stage2->opcode, "") == 0) &&
-          (strcmp(stage1->opcode, "") == 0))
+/* Instructions each port executed by class, and how busy it was */
+static void print_ports(APEX_CPU *cpu)
+{
+  printf("(apex) >> %d ports, a ready instruction found no free port %ld times\n",
+         cpu->config.ports, cpu->port_conflicts);
+  printf("%-5s %-19s %-9s %-9s %-9s %-9s %s\n", "port", "classes", "ALU", "AGU",
+         "branch", "MUL", "busy");
+  for (int p = 0; p < cpu->config.ports; ++p)
+  {
+    APEX_Port *port = &cpu->port[p];
+    char classes[32] = "";
+    static const char *const names[APEX_PORT_CLASSES] = {"ALU", "AGU", "BR", "MUL"};
+    long issued = 0;
+    for (int c = 0; c < APEX_PORT_CLASSES; ++c)
+    {
+      if (port->classes & (1 << c))
       {
-        break;
+        if (classes[0])
+          strcat(classes, "+");
+        strcat(classes, names[c]);
       }
+      issued += port->issued[c];
     }
+    printf("%-5d %-19s %-9ld %-9ld %-9ld %-9ld %5.1f%%\n", p, classes,
+           port->issued[0], port->issued[1], port->issued[2], port->issued[3],
+           cpu->clock ? 100.0 * issued / cpu->clock : 0.0);
+  }
+}
 
-    cpu->clock++;
+int APEX_cpu_run(APEX_CPU *cpu, const char *function, int cycles)
+{
+  struct prf *prf = cpu->prf;
 
-    printf("\n");
-    printf("=====REGISTER VALUE============\n");
-    for (int i = 0; i < 16; i++)
+  cpu->display = strcmp(function, "display") == 0;
+  if (cpu->config.digest)
+  {
+    int *memories[APEX_MAX_THREADS] = {cpu->memory};
+    for (int t = 1; t < cpu->threads; ++t)
     {
-      char *validStr;
-      if (cpu->freeRegisterFlag[i] == 1)
-      {
-        validStr = "Valid";
-      }
-      else
-      {
-        validStr = "InValid";
-      }
-
-      printf("\n");
-      printf(" | Register[%d] | Value=%d | status=%s | \n", i, cpu->regs[i], validStr);
+      memories[t] = cpu->context[t].memory;
     }
-    printf("=======DATA MEMORY===========\n");
+    if (APEX_digest_start(&cpu->digest, cpu->config.digest_log, cpu->config.digest,
+                          cpu->threads, cpu->regs, cpu->zFlag, memories) != 0)
+    {
+      return -1;
+    }
+  }
+  APEX_cpu_simulate(cpu, cycles);
+  APEX_digest_finish(&cpu->digest, cpu->ins_completed);
+
+  if (cpu->debug.hit)
+  {
+    printf("(apex) >> Stopped at breakpoint: %s\n", cpu->debug.reason);
+    APEX_debug_dump(cpu);
+  }
+  else
+  {
+    printf("(apex) >> Simulation Complete");
+    printf("\n");
+  }
+
+  APEX_store_sets_report(&cpu->store_sets, stdout);
+  if (cpu->bypass.results)
+  {
+    printf("(apex) >> Results broadcast %ld (%ld cycles waiting for a bus), "
+           "operands forwarded %ld, from register file %ld, issue stalls %ld\n",
+           cpu->bypass.results, cpu->bypass.bus_waits, cpu->bypass.forwarded,
+           cpu->bypass.from_rf, cpu->bypass.issue_stalls);
+  }
+  if (cpu->branch.branches)
+  {
+    printf("(apex) >> Branches %ld, mispredicted %ld, squashed %ld, "
+           "restores %ld (%ld rebuilt), recovery cycles %ld, checkpoint stalls %ld\n",
+           cpu->branch.branches, cpu->branch.mispredicts, cpu->branch.squashed,
+           cpu->branch.restores, cpu->branch.rebuilds,
+           cpu->branch.recovery_cycles, cpu->branch.dispatch_stalls);
+  }
+  if (cpu->config.uop_cache || cpu->config.loop_buffer)
+  {
+    APEX_Front_End *front_end = &cpu->front_end;
+    printf("(apex) >> Uop cache hits %ld of %ld (%.1f%%), loop buffer locked %ld times "
+           "and streamed %ld instructions, decoders skipped for %ld, "
+           "front end gated %ld cycles\n",
+           front_end->hits, front_end->lookups,
+           front_end->lookups ? 100.0 * front_end->hits / front_end->lookups : 0.0,
+           front_end->locks, front_end->streamed, front_end->hits + front_end->streamed,
+           front_end->gated_cycles);
+  }
+  if (cpu->prefetcher && cpu->dcache)
+  {
+    APEX_prefetch_report(cpu->prefetcher, cpu->dcache, stdout);
+  }
+  if (cpu->config.eliminate)
+  {
+    printf("(apex) >> Eliminated at rename %ld (moves %ld, zero idioms %ld), "
+           "%ld sharing an entry\n",
+           cpu->eliminated_moves + cpu->eliminated_zeros,
+           cpu->eliminated_moves, cpu->eliminated_zeros, cpu->eliminated_shared);
+  }
+  if (cpu->config.fusion)
+  {
+    long pairs = cpu->fused_pairs[0] + cpu->fused_pairs[1] + cpu->fused_pairs[2];
+    printf("(apex) >> Fused pairs %ld (MOVC+ALU %ld, address+memory %ld, "
+           "ALU+branch %ld), %.1f%% of retired instructions\n",
+           pairs, cpu->fused_pairs[0], cpu->fused_pairs[1], cpu->fused_pairs[2],
+           cpu->ins_completed ? 200.0 * pairs / cpu->ins_completed : 0.0);
+  }
+
+  if (cpu->config.ports)
+  {
+    print_ports(cpu);
+  }
+
+  if (cpu->config.topdown)
+  {
+    APEX_topdown_report(&cpu->topdown, cpu->ins_completed, cpu->clock, stdout);
+  }
+
+  if (cpu->cosim)
+  {
+    APEX_cosim_finish(cpu->cosim, stdout);
+    cpu->cosim = NULL;
+  }
 
-    for (int i = 0; i < 99; i++)
+  if (cpu->display)
+  {
+    printf("++++++++++++++RAT++++++++++++++++\n");
+      for (int j = 0; j < 24; ++j) {
+          if(prf[j].valid!=1)
+          printf("|R[%d] = P%d & valid = %d ARF_VAL=%d Latest=%d|\n",prf[j].value,j, prf[j].valid,prf[j].arf_val,prf[j].latest);
+      }
+      print_shared(cpu);
+printf("\n");
+  }
+  printf("=====REGISTER VALUE============\n");
+  for (int i = 0; i < 16; i++)
+  {
+    char *validStr;
+    if (cpu->freeRegisterFlag[i] == 1)
+    {
+      validStr = "Valid";
+    }
+    else
     {
-      printf(" | MEM[%d] | Value=%d | \n", i, cpu->data_memory[i]);
+      validStr = "InValid";
     }
+
+    printf("\n");
+    printf(" | Register[%d] | Value=%d | status=%s | \n", i, cpu->regs[i], validStr);
   }
+  printf("=======DATA MEMORY===========\n");
 
-  return 0;
-}
\ No newline at end of file
+  for (int i = 0; i < 99; i++)
+  {
+    printf(" | MEM[%d] | Value=%d | \n", i, cpu->memory[i]);
+  }
+  int status = APEX_memory_image_dump(&cpu->config, cpu->memory);
+
+#ifdef APEX_PROFILE
+  APEX_profile_report(&cpu->profile, cpu->ins_completed, stdout);
+#endif
+
+  return status;
+}
@@ -1,5 +1,12 @@
 #ifndef _APEX_CPU_H_
 #define _APEX_CPU_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include "digest.h"
+#include "profile.h"
+#include "topdown.h"
+
 enum
 {
   F,
@@ -17,10 +24,34 @@ enum
 
 };
 
+/* Opcodes known to the parser */
+typedef enum APEX_Opcode
+{
+  APEX_OP_NONE,
+  APEX_OP_MOVC,
+  APEX_OP_ADD,
+  APEX_OP_SUB,
+  APEX_OP_MUL,
+  APEX_OP_AND,
+  APEX_OP_OR,
+  APEX_OP_EXOR,
+  APEX_OP_ADDL,
+  APEX_OP_SUBL,
+  APEX_OP_LOAD,
+  APEX_OP_LDR,
+  APEX_OP_STORE,
+  APEX_OP_STR,
+  APEX_OP_BZ,
+  APEX_OP_BNZ,
+  APEX_OP_JUMP,
+  APEX_OP_HALT
+} APEX_Opcode;
+
 /* Format of an APEX instruction  */
 typedef struct APEX_Instruction
 {
   char opcode[128]; // Operation Code
+  int op;           // Operation Code as APEX_Opcode
   int rd;           // Destination Register Address
   int rs1;          // Source-1 Register Address
   int rs2;
@@ -28,11 +59,50 @@ typedef struct APEX_Instruction
   int imm;          // Literal Value
 } APEX_Instruction;
 
-/* Model of CPU stage latch */
-typedef struct CPU_Stage
+/* Size of the in-flight instruction pool, slot 0 is the bubble */
+#define APEX_UOP_POOL_SIZE 32
+#define APEX_UOP_BUBBLE 0
+
+/* Number of entries in the reorder buffer */
+#define APEX_ROB_SIZE 12
+
+/* Every memory op in flight holds a ROB entry, so the LSQ cannot overflow */
+#define APEX_LSQ_SIZE APEX_ROB_SIZE
+
+/* Squashed instructions waiting to be fetched again */
+#define APEX_REPLAY_SIZE (APEX_ROB_SIZE + 2)
+
+/* Most unresolved branches holding a rename checkpoint, one mask bit each */
+#define APEX_MAX_CHECKPOINTS 8
+
+/* Physical register writes kept to bring a checkpoint up to date */
+#define APEX_PRF_LOG_SIZE 64
+
+/* The entry a zero idiom's destination shares, past the 24 real ones */
+#define APEX_PRF_ZERO 24
+
+/* Hardware thread contexts of an SMT core */
+#define APEX_MAX_THREADS 4
+
+/* Thread t's register r is renamed and committed as t * 32 + r */
+#define APEX_THREAD_REGS 32
+
+/* Execution ports the scheduler binds instructions to, APEX_Config.ports */
+#define APEX_MAX_PORTS 4
+
+/* Opcode classes a port executes, APEX_Config.port_classes */
+#define APEX_PORT_ALU 0x1     // MOVC, ADD, SUB, ADDL, SUBL and the pairs fused with them
+#define APEX_PORT_AGU 0x2     // Loads and stores on their way to the LSQ
+#define APEX_PORT_BRANCH 0x4  // BZ, BNZ and JUMP resolution
+#define APEX_PORT_MUL 0x8
+#define APEX_PORT_CLASSES 4
+
+/* Model of an in-flight instruction, allocated once at fetch */
+typedef struct APEX_Uop
 {
   int pc;           // Program Counter
-  char opcode[128]; // Operation Code
+  const char *opcode; // Mnemonic, only printed, stages go by op
+  int op;           // Operation Code as APEX_Opcode
   int rs1;          // Source-1 Register Address
   int rs2;
   int rs3;// Source-2 Register Address
@@ -43,11 +113,279 @@ typedef struct CPU_Stage
     int rs3_value; // Source-2 Register Value
   int buffer;       // Latch to hold some value
   int mem_address;  // Computed Memory Address
+  int completed;    // Flag to indicate, result is ready to retire
+  int trace_mem_address; // Address recorded in the trace, in trace mode
+  long seq;         // Dispatch order, tells a recycled pool slot apart
+  int rob_slot;     // Position in the reorder buffer
+  int executed;     // Memory op has accessed data memory
+  int dep_uop;      // Store the store-set predictor made a load wait for
+  long dep_seq;
+  int dep_waited;   // The load was held back by that store
+  int dep_address;  // Address the store wrote, to spot false dependences
+  int ready_cycle;  // Load completes at this cycle, after a cache fill
+  int value_cycle;  // Dependents may issue from this cycle, INT_MAX until broadcast
+  unsigned int branch_mask; // Checkpoints of the older unresolved branches
+  int checkpoint;   // Checkpoint a branch took at dispatch, -1 if none
+  int predicted_pc; // Where fetch went after this branch
+  int trace_taken;  // Recorded branch outcome, in trace mode
+  int fused;        // APEX_FUSE_* pair this uop carries, 0 for one instruction
+  int head_pc;      // First instruction of a fused pair, the rest is the second
+  int head_op;
+  int head_rd;
+  int head_rs1;
+  int head_rs2;
+  int head_imm;
+  int head_value;
+  int head_cycle;   // Dependents of head_rd may issue from this cycle
+  int thread;       // Hardware context the instruction belongs to
+  int issued;       // Bound to an execution port, with config.ports only
+} APEX_Uop;
+
+/* Model of CPU stage latch */
+typedef struct CPU_Stage
+{
+  int uop;          // Index of the instruction in the uop pool
   int busy;         // Flag to indicate, stage is performing some action
   int stalled;      // Flag to indicate, stage is stalled
   int flush;        // Flag to flush when branch is taken
 } CPU_Stage;
 
+/* Longest file name a text option holds, terminator included */
+#define APEX_CONFIG_PATH 256
+
+/* Tunable parameters of the modelled core */
+typedef struct APEX_Config
+{
+  int rob_size;     // Reorder buffer entries in use, at most APEX_ROB_SIZE
+  int break_trace;  // On a breakpoint, trace from there instead of stopping
+  int cosim;        // Check every retired instruction against functional.c
+  int dcache;       // Model a private data cache in front of data memory
+  int dcache_sets;
+  int dcache_ways;
+  int dcache_line;  // Words per cache line
+  int dcache_miss_latency; // Stall cycles to fill a line from memory
+  int dcache_c2c_latency;  // Stall cycles for an upgrade or a peer's line
+  int quantum;      // Multi-core cycles between barriers, 0 runs lockstep
+  int mem_dep;      // APEX_MEM_DEP_* load issue policy
+  int simpoint_k;   // Clusters, so simulation points, of a sampled run
+  int simpoint_full; // Also time the whole run to report the sampling error
+  int bypass_latency; // Cycles from a result's broadcast until dependents may issue
+  int result_buses; // Results broadcast per cycle, 0 for no limit
+  int branch_checkpoints; // Unresolved branches allowed in flight, 0 stops dispatch at each
+  int fusion;       // APEX_FUSE_* pairs decode merges into one uop
+  int eliminate;    // Rename resolves moves and zero idioms without an FU
+  int prefetch;     // APEX_PREFETCH_* policy on the data cache
+  int prefetch_degree;   // Lines requested per trigger
+  int prefetch_distance; // Strides or lines ahead of the access
+  int uop_cache;    // Decoded uop cache entries, 0 for none
+  int loop_buffer;  // Loop buffer entries, 0 for none
+  int interval_full; // Also time an interval model estimate on the pipeline
+  int slices;       // Pieces a time-sliced run is cut into
+  int slice_warmup; // Instructions each slice runs before its first timed one
+  int slice_threads; // Host threads timing slices, 0 for one per online CPU
+  int slice_full;   // Also time the whole run to report the slicing error
+  int smt_fetch;    // APEX_SMT_FETCH_* thread fetch picks each cycle
+  int smt_rob;      // ROB entries one thread may hold, 0 for no limit
+  int smt_prf;      // Physical registers one thread's instructions in flight may take, 0 for no limit
+  int topdown;      // Account every dispatch slot and print the CPI stack
+  int topdown_region; // Retired instructions per region of the CPI stack, 0 for none
+  int ilp_hot;      // Critical path PCs an ILP limit study lists
+  int ports;        // Execution ports behind a scheduler, 0 for the one in-order pipe
+  int port_classes[APEX_MAX_PORTS]; // APEX_PORT_* bits of each port
+  int mem_mmap;     // Map mem_image copy-on-write instead of reading it
+  char mem_image[APEX_CONFIG_PATH]; // Binary image data memory starts from, "" for zeroes
+  char mem_dump[APEX_CONFIG_PATH];  // Binary image the final data memory is written to
+  char mem_dump_ranges[APEX_CONFIG_PATH]; // Word ranges dumped, "" for all of memory
+  int digest;       // Retired instructions per line of the state digest log, 0 for none
+  char digest_log[APEX_CONFIG_PATH]; // File the digest lines go to, "" for stdout
+} APEX_Config;
+
+/* Kinds of armed breakpoints, or'ed into APEX_Debug.armed */
+#define APEX_BREAK_PC 0x1
+#define APEX_BREAK_CYCLE 0x2
+#define APEX_BREAK_RETIRED 0x4
+#define APEX_BREAK_REG 0x8
+#define APEX_WATCH_MEM 0x10
+
+#define APEX_BREAK_MAX_REGS 8
+
+/* Load issue policies, APEX_Config.mem_dep */
+#define APEX_MEM_DEP_IN_ORDER 0   // Loads wait for every older store
+#define APEX_MEM_DEP_STORE_SETS 1 // Loads wait only for a predicted store
+#define APEX_MEM_DEP_ALWAYS 2     // Loads never wait, only violations stop them
+
+/* Data cache prefetchers, APEX_Config.prefetch */
+#define APEX_PREFETCH_NONE 0
+#define APEX_PREFETCH_STRIDE 1 // PC indexed stride table
+#define APEX_PREFETCH_STREAM 2 // Next lines after a miss
+
+/* SMT fetch policies, APEX_Config.smt_fetch */
+#define APEX_SMT_FETCH_ROUND_ROBIN 0
+#define APEX_SMT_FETCH_ICOUNT 1  // Thread with the fewest unfinished instructions
+
+/* Instruction pairs decode may fuse, APEX_Config.fusion */
+#define APEX_FUSE_MOVC_ALU 0x1   // MOVC Rx then ADD or SUB reading Rx
+#define APEX_FUSE_ADDR_MEM 0x2   // ADDL or SUBL Rx then LOAD or STORE based on Rx
+#define APEX_FUSE_ALU_BRANCH 0x4 // ADD, SUB, ADDL or SUBL then BZ or BNZ on its flag
+#define APEX_FUSE_KINDS 3
+
+/* One pipelined execution port, it accepts an instruction a cycle */
+typedef struct APEX_Port
+{
+  int classes;      // APEX_PORT_* bits it executes
+  int taken;        // Cycle an instruction was last bound to it
+  int alu[2];       // Uops in its ALU stages, like INT FU1 and INT FU2
+  int mul[3];       // Uops in its MUL stages
+  long issued[APEX_PORT_CLASSES]; // Instructions bound to it, by class
+} APEX_Port;
+
+#define APEX_SSIT_SIZE 256
+#define APEX_LFST_SIZE 64
+
+/* Store-set memory dependence predictor (Chrysos and Emer) */
+typedef struct APEX_Store_Sets
+{
+  int ssit[APEX_SSIT_SIZE];      // Store set of a load or store pc, -1 if none
+  int lfst_uop[APEX_LFST_SIZE];  // Last fetched store of each set
+  long lfst_seq[APEX_LFST_SIZE];
+  int next_ssid;
+
+  /* Stats */
+  long loads;
+  long speculative;   // Loads issued ahead of an older unexecuted store
+  long held;          // Loads the predictor made wait
+  long false_deps;    // Held loads whose store wrote another address
+  long violations;
+  long replayed;      // Instructions squashed and fetched again
+} APEX_Store_Sets;
+
+/* Result buses feeding the bypass network */
+typedef struct APEX_Bypass
+{
+  int used;                            // Buses taken this cycle
+  int waiting[APEX_UOP_POOL_SIZE];     // Results queued for a bus, oldest first
+  long waiting_seq[APEX_UOP_POOL_SIZE];
+  int waiting_count;
+
+  /* Stats */
+  long results;       // Values broadcast
+  long bus_waits;     // Cycles results spent queued for a bus
+  long forwarded;     // Operands read the cycle they became reachable
+  long from_rf;       // Operands read later, from the register file
+  long issue_stalls;  // Cycles decode held an instruction for an operand
+} APEX_Bypass;
+
+struct prf{
+    int valid;
+    int ready;
+    int value;
+    int latest;
+    int arf_val;
+};
+
+/* Rename state as a branch saw it when it dispatched */
+typedef struct APEX_Checkpoint
+{
+  long seq;             // Dispatch order of the branch
+  struct prf prf[24];   // Rename table and free list
+  int prf_alias[APEX_THREAD_REGS * APEX_MAX_THREADS];
+  long log_position;    // Physical register writes made before the snapshot
+} APEX_Checkpoint;
+
+/* One physical register write, replayed onto a restored checkpoint */
+typedef struct APEX_Prf_Write
+{
+  long seq;             // Writer's dispatch order
+  int rd;
+  int value;
+} APEX_Prf_Write;
+
+typedef struct APEX_Branch_Stats
+{
+  long branches;
+  long mispredicts;
+  long squashed;        // Wrong path instructions thrown away
+  long restores;        // Rename tables restored from a checkpoint
+  long rebuilds;        // Restores that outran the write log and walked the ROB
+  long recovery_cycles; // Fetch cycles lost restoring rename state
+  long dispatch_stalls; // Decode cycles held for a free checkpoint
+} APEX_Branch_Stats;
+
+/* Breakpoint and watchpoint state, checked only when armed is non zero */
+typedef struct APEX_Debug
+{
+  int armed;                   // APEX_BREAK_* kinds with a condition set
+  unsigned char *pc_bitmap;    // One bit per code memory index
+  long cycle;                  // Stop once the clock reaches this cycle
+  long retired;                // Stop once this many instructions retired
+  int reg_count;
+  int reg[APEX_BREAK_MAX_REGS];       // Registers compared at retire
+  int reg_value[APEX_BREAK_MAX_REGS]; // Value that fires the breakpoint
+  unsigned char mem_bitmap[4096 / 8]; // One bit per data memory word
+  int hit;                     // Set when a condition fired
+  char reason[96];             // What fired, for the state dump
+} APEX_Debug;
+
+/* An instruction as fetch hands it to decode, kept for reuse */
+typedef struct APEX_Decoded
+{
+  int pc;            // -1 while the entry is empty
+  int predicted_pc;
+  const char *opcode;
+  int op;
+  int rd;
+  int rs1;
+  int rs2;
+  int rs3;
+  int imm;
+} APEX_Decoded;
+
+#define APEX_LOOP_BUFFER_MAX 64
+#define APEX_LOOP_HOT 2 // Back to back iterations before the loop buffer locks on
+
+/*
+ * Decoded uop cache, indexed by pc, and loop buffer. The loop buffer
+ * captures the body of a loop closed by a backward branch and, once
+ * the loop is hot, fetch streams from it with code memory and the
+ * decoders idle.
+ */
+typedef struct APEX_Front_End
+{
+  APEX_Decoded *uop_cache;  // config.uop_cache entries, NULL when off
+  APEX_Decoded loop[APEX_LOOP_BUFFER_MAX];
+  int loop_start;           // First pc of the candidate loop
+  int loop_end;             // Its backward branch
+  int loop_captured;        // Body entries held in loop[]
+  int loop_iterations;      // Back to back iterations seen
+  int loop_active;          // Fetch streams from loop[]
+
+  /* Stats */
+  long lookups;             // Fetches looked up in the uop cache
+  long hits;
+  long streamed;            // Instructions the loop buffer supplied
+  long locks;               // Times the loop buffer locked on a loop
+  long gated_cycles;        // Cycles fetch and decode idled behind it
+} APEX_Front_End;
+
+/* Hardware thread context, the one fetch works in is loaded into APEX_CPU */
+typedef struct APEX_Context
+{
+  APEX_Instruction *code_memory;
+  int code_memory_size;
+  int pc;
+  int *memory;          // Private data memory, thread 0 uses APEX_CPU.memory
+
+  /* Stats */
+  long fetched;
+  long retired;
+  int last_retire;      // Cycle its latest instruction retired in
+} APEX_Context;
+
+struct APEX_Cosim;
+struct APEX_Cache;
+struct APEX_Prefetcher;
+struct APEX_Trace_Reader;
+
 /* Model of APEX CPU */
 typedef struct APEX_CPU
 {
@@ -58,27 +396,127 @@ typedef struct APEX_CPU
   int pc;
 
   int no_cycles;
-  /* Integer register file */
-  int regs[32];
+  /* Integer register file, APEX_THREAD_REGS per hardware thread */
+  int regs[APEX_THREAD_REGS * APEX_MAX_THREADS];
 
   int freeRegisterFlag[32];
 
+  /* Physical register file and rename state */
+  struct prf prf[24];
+  /* Entry a register shares after an eliminated idiom, -1 if none */
+  int prf_alias[APEX_THREAD_REGS * APEX_MAX_THREADS];
+
   /* Array of 5 CPU_stage */
   CPU_Stage stage[10];
 
   /* Code Memory where instructions are stored */
   APEX_Instruction *code_memory;
   int code_memory_size;
+  int owns_code_memory;
+
+  APEX_Config config;
+
+  /* Print pipeline contents every cycle */
+  int display;
+
+  APEX_Debug debug;
+
+  /* Lockstep checker, NULL unless config.cosim is set */
+  struct APEX_Cosim *cosim;
 
   /* Data Memory */
   int data_memory[4096];
 
+  /* Where loads and stores go, data_memory or memory shared by all cores */
+  int *memory;
+
+  /* Copy-on-write mapping of config.mem_image, NULL unless mem_mmap is set */
+  int *mapped_memory;
+
+  /* Recorded instruction stream fetched in place of code memory */
+  struct APEX_Trace_Reader *trace;
+
+  /* Private data cache, NULL when memory is single cycle */
+  struct APEX_Cache *dcache;
+
+  /* Prefetcher training on dcache accesses, NULL when off */
+  struct APEX_Prefetcher *prefetcher;
+
+  /* Cycles the core stays frozen on a store miss, load misses only hold the load */
+  int mem_stall;
+  long mem_stall_cycles;
+
+  /* Pool of in-flight instructions and its free list */
+  APEX_Uop uop_pool[APEX_UOP_POOL_SIZE];
+  int uop_free[APEX_UOP_POOL_SIZE];
+  int uop_free_count;
+
+  /* Reorder buffer, holds uop pool indices in program order */
+  int rob[APEX_ROB_SIZE];
+  int rob_head;
+  int rob_tail;
+  int rob_count;
+  long uop_seq;
+
+  /* Load/store queue, memory ops in program order until they retire */
+  int lsq[APEX_LSQ_SIZE];
+  int lsq_head;
+  int lsq_count;
+  APEX_Store_Sets store_sets;
+
+  APEX_Bypass bypass;
+
+  /* Branch checkpoints, a set bit in branch_mask marks one in use */
+  APEX_Checkpoint checkpoints[APEX_MAX_CHECKPOINTS];
+  unsigned int branch_mask;
+  int unresolved_branches;
+  APEX_Prf_Write prf_log[APEX_PRF_LOG_SIZE];
+  long prf_log_count;
+  int recovery_stall;   // Fetch cycles left while rename state is restored
+  int fetch_blocked;    // Trace fetch waits for a mispredicted branch to resolve
+  APEX_Branch_Stats branch;
+
+  /* Pairs decode fused, one count per APEX_FUSE_* bit */
+  long fused_pairs[APEX_FUSE_KINDS];
+
+  /* Execution ports, used with config.ports */
+  APEX_Port port[APEX_MAX_PORTS];
+  long port_conflicts;  // Times a ready instruction found every port for it taken
+  int port_conflict_cycle; // Last cycle that happened
+
+  /* Moves and zero idioms rename resolved without an FU pass */
+  long eliminated_moves;
+  long eliminated_zeros;
+  long eliminated_shared; // Of those, renamed onto an entry already holding the value
+
+  APEX_Front_End front_end;
+
+  /* Dispatch slot accounting, kept only with config.topdown */
+  APEX_Topdown topdown;
+
+  /* Architectural state digest, kept by APEX_cpu_run with config.digest */
+  APEX_Digest digest;
+
+  /* Instructions squashed by a memory order violation, fetched first */
+  APEX_Uop replay[APEX_REPLAY_SIZE];
+  int replay_head;
+  int replay_count;
+
+  /* Hardware thread contexts, pc and code memory above are thread's */
+  int threads;
+  int thread;
+  APEX_Context context[APEX_MAX_THREADS];
+
   /* Some stats */
   int ins_completed;
 
+#ifdef APEX_PROFILE
+  APEX_Profile profile;
+#endif
+
   /* IQ data*/
 
-  int zFlag;
+  int zFlag[APEX_MAX_THREADS];
 
   int memFetchStore;
   int flushBranchTakenData;
@@ -109,16 +547,18 @@ struct QueueEntry
 
   int IQFront;
   int IQRear;
-} QueueEntry;
+};
 
-struct QueueEntry IQ[8];
+extern struct QueueEntry IQ[8];
 
 struct LSQ
 {
   struct QueueEntry LSQEntry;
   int LOADSTOREBit;
 
-} LSQ[6];
+};
+
+extern struct LSQ LSQ[6];
 
 struct functionalUnits
 {
@@ -138,31 +578,67 @@ struct functionalUnits
 
   int pc;
   int dummyEntry;
-} functionalUnits;
-
-struct prf{
-    int valid;
-    int ready;
-    int value;
-    int latest;
-    int arf_val;
-}prf[24];
-int pcount;
-struct ROB
-{
+};
 
-  int ROBHeadPointer;
-  int ROBTailPointer;
+extern struct functionalUnits functionalUnits;
 
-  struct APEX_Instruction ROBAPEXInstruction;
-} ROB[12];
 
 APEX_Instruction *create_code_memory(const char *filename, int *size);
 
-APEX_CPU *APEX_cpu_init(const char *filename);
+int APEX_opcode_from_string(const char *opcode);
+
+const char *APEX_opcode_name(int op);
+
+APEX_Instruction *create_code_memory_from_buffer(const char *buffer,
+                                                 size_t length, int *size);
+
+APEX_CPU *APEX_cpu_init(const char *filename, const APEX_Config *config);
+
+APEX_CPU *APEX_cpu_init_trace(const char *trace_file, const APEX_Config *config);
+
+APEX_CPU *APEX_cpu_create(APEX_Instruction *code_memory, int code_memory_size,
+                          const APEX_Config *config);
+
+int get_code_index(int pc);
+
+int APEX_cpu_cycle(APEX_CPU *cpu);
+
+int APEX_cpu_simulate(APEX_CPU *cpu, int cycles);
+
+int APEX_cpu_reg_value(APEX_CPU *cpu, int reg);
+
+int APEX_cpu_add_thread(APEX_CPU *cpu, APEX_Instruction *code_memory,
+                        int code_memory_size);
+
+void APEX_cpu_set_state(APEX_CPU *cpu, int pc, const int regs[32], unsigned int live,
+                        const int *memory, int zero_flag);
 
 int APEX_cpu_run(APEX_CPU *cpu, const char *function, int cycles);
 
+void APEX_config_default(APEX_Config *config);
+
+int APEX_config_set(APEX_Config *config, const char *option);
+
+int APEX_debug_add(APEX_CPU *cpu, const char *spec);
+
+void APEX_debug_on_retire(APEX_CPU *cpu, int pc, int rd);
+
+void APEX_debug_on_cycle(APEX_CPU *cpu);
+
+void APEX_debug_on_store(APEX_CPU *cpu, APEX_Uop *uop, int address);
+
+void APEX_debug_dump(APEX_CPU *cpu);
+
+void APEX_store_sets_init(APEX_Store_Sets *sets);
+
+void APEX_store_sets_dispatch(APEX_Store_Sets *sets, APEX_Uop *uop, int index);
+
+void APEX_store_sets_executed(APEX_Store_Sets *sets, const APEX_Uop *store, int index);
+
+void APEX_store_sets_violation(APEX_Store_Sets *sets, int load_pc, int store_pc);
+
+void APEX_store_sets_report(const APEX_Store_Sets *sets, FILE *out);
+
 void APEX_cpu_stop(APEX_CPU *cpu);
 
 int fetch(APEX_CPU *cpu);
@@ -177,4 +653,8 @@ int memory2(APEX_CPU *cpu);
 
 void freephyreg(struct prf prf[], int free);
 
+int uop_alloc(APEX_CPU *cpu);
+
+void uop_free(APEX_CPU *cpu, int uop);
+
 #endif
@@ -0,0 +1,234 @@
+/*
+ *  debug.c
+ *  Breakpoints and watchpoints for long simulations. The pipeline
+ *  only calls in here when APEX_Debug.armed has the matching kind set,
+ *  so an unarmed run pays one test per hook.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+#define DATA_MEMORY_WORDS 4096
+
+static void fire(APEX_CPU *cpu, const char *format, ...)
+{
+  /* Keep the first reason when several conditions fire in one cycle */
+  if (cpu->debug.hit)
+  {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vsnprintf(cpu->debug.reason, sizeof(cpu->debug.reason), format, args);
+  va_end(args);
+  cpu->debug.hit = 1;
+}
+
+static int add_pc(APEX_CPU *cpu, long pc)
+{
+  int index = get_code_index((int)pc);
+  if (pc % 4 != 0 || index < 0 || index >= cpu->code_memory_size)
+  {
+    return -1;
+  }
+  if (!cpu->debug.pc_bitmap)
+  {
+    cpu->debug.pc_bitmap = calloc((cpu->code_memory_size + 7) / 8, 1);
+    if (!cpu->debug.pc_bitmap)
+    {
+      return -1;
+    }
+  }
+  cpu->debug.pc_bitmap[index / 8] |= 1 << (index % 8);
+  cpu->debug.armed |= APEX_BREAK_PC;
+  return 0;
+}
+
+static int add_mem(APEX_CPU *cpu, const char *range)
+{
+  char *end;
+  long first = strtol(range, &end, 0);
+  long last = first;
+  if (*end == '-')
+  {
+    last = strtol(end + 1, &end, 0);
+  }
+  if (*end != '\0' || first < 0 || last < first || last >= DATA_MEMORY_WORDS)
+  {
+    return -1;
+  }
+  for (long address = first; address <= last; ++address)
+  {
+    cpu->debug.mem_bitmap[address / 8] |= 1 << (address % 8);
+  }
+  cpu->debug.armed |= APEX_WATCH_MEM;
+  return 0;
+}
+
+static int add_reg(APEX_CPU *cpu, const char *condition)
+{
+  int reg, value;
+  if (sscanf(condition, "R%d=%d", &reg, &value) != 2 || reg < 0 || reg >= 32 ||
+      cpu->debug.reg_count == APEX_BREAK_MAX_REGS)
+  {
+    return -1;
+  }
+  cpu->debug.reg[cpu->debug.reg_count] = reg;
+  cpu->debug.reg_value[cpu->debug.reg_count] = value;
+  cpu->debug.reg_count++;
+  cpu->debug.armed |= APEX_BREAK_REG;
+  return 0;
+}
+
+/*
+ * Arms one condition given as
+ *   pc:<address>  cycle:<n>  retired:<n>  reg:R<n>=<value>  mem:<a>[-<b>]
+ * returns -1 if the spec does not parse or is out of range
+ */
+int APEX_debug_add(APEX_CPU *cpu, const char *spec)
+{
+  const char *value = strchr(spec, ':');
+  if (!value)
+  {
+    fprintf(stderr, "APEX_Error : Breakpoint %s has no condition\n", spec);
+    return -1;
+  }
+  value++;
+
+  int rc = -1;
+  char *end;
+  if (strncmp(spec, "pc:", 3) == 0)
+  {
+    long pc = strtol(value, &end, 0);
+    rc = *end == '\0' ? add_pc(cpu, pc) : -1;
+  }
+  else if (strncmp(spec, "cycle:", 6) == 0)
+  {
+    cpu->debug.cycle = strtol(value, &end, 0);
+    if (*end == '\0' && cpu->debug.cycle > 0)
+    {
+      cpu->debug.armed |= APEX_BREAK_CYCLE;
+      rc = 0;
+    }
+  }
+  else if (strncmp(spec, "retired:", 8) == 0)
+  {
+    cpu->debug.retired = strtol(value, &end, 0);
+    if (*end == '\0' && cpu->debug.retired > 0)
+    {
+      cpu->debug.armed |= APEX_BREAK_RETIRED;
+      rc = 0;
+    }
+  }
+  else if (strncmp(spec, "reg:", 4) == 0)
+  {
+    rc = add_reg(cpu, value);
+  }
+  else if (strncmp(spec, "mem:", 4) == 0)
+  {
+    rc = add_mem(cpu, value);
+  }
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "APEX_Error : Invalid breakpoint %s\n", spec);
+  }
+  return rc;
+}
+
+void APEX_debug_on_retire(APEX_CPU *cpu, int pc, int rd)
+{
+  APEX_Debug *debug = &cpu->debug;
+
+  if (debug->armed & APEX_BREAK_PC)
+  {
+    int index = get_code_index(pc);
+    if (index >= 0 && index < cpu->code_memory_size &&
+        (debug->pc_bitmap[index / 8] >> (index % 8)) & 1)
+    {
+      fire(cpu, "pc %d retired at cycle %d", pc, cpu->clock + 1);
+    }
+  }
+
+  if ((debug->armed & APEX_BREAK_RETIRED) &&
+      cpu->ins_completed >= debug->retired)
+  {
+    fire(cpu, "%d instructions retired at cycle %d",
+         cpu->ins_completed, cpu->clock + 1);
+  }
+
+  if ((debug->armed & APEX_BREAK_REG) && rd >= 0 && rd < 32)
+  {
+    for (int i = 0; i < debug->reg_count; ++i)
+    {
+      if (debug->reg[i] == rd &&
+          APEX_cpu_reg_value(cpu, rd) == debug->reg_value[i])
+      {
+        fire(cpu, "R%d = %d after pc %d", rd, debug->reg_value[i],
+             pc);
+      }
+    }
+  }
+}
+
+void APEX_debug_on_cycle(APEX_CPU *cpu)
+{
+  if (cpu->clock >= cpu->debug.cycle)
+  {
+    fire(cpu, "reached cycle %d", cpu->clock);
+  }
+}
+
+void APEX_debug_on_store(APEX_CPU *cpu, APEX_Uop *uop, int address)
+{
+  if (address >= 0 && address < DATA_MEMORY_WORDS &&
+      (cpu->debug.mem_bitmap[address / 8] >> (address % 8)) & 1)
+  {
+    fire(cpu, "pc %d writes MEM[%d] at cycle %d", uop->pc, address,
+         cpu->clock + 1);
+  }
+}
+
+/* Prints the pipeline latches, ROB and rename table at a breakpoint */
+void APEX_debug_dump(APEX_CPU *cpu)
+{
+  static const char *names[NUM_STAGES] = {
+      "Fetch", "Decode/RF", "Integer FU1", "Integer FU2",
+      "MUL FU1", "MUL FU2", "MUL FU3", "Memmory"};
+
+  printf("=====PIPELINE (cycle %d, retired %d, pc %d)=====\n",
+         cpu->clock, cpu->ins_completed, cpu->pc);
+  for (int i = F; i < NUM_STAGES; ++i)
+  {
+    APEX_Uop *uop = &cpu->uop_pool[cpu->stage[i].uop];
+    if (cpu->stage[i].uop == APEX_UOP_BUBBLE)
+    {
+      printf("%-15s: empty\n", names[i]);
+    }
+    else
+    {
+      printf("%-15s: pc(%d) %s rd=%d rs1=%d rs2=%d imm=%d\n", names[i],
+             uop->pc, uop->opcode, uop->rd, uop->rs1, uop->rs2, uop->imm);
+    }
+  }
+
+  printf("=====ROB (%d entries)=====\n", cpu->rob_count);
+  for (int i = 0; i < cpu->rob_count; ++i)
+  {
+    APEX_Uop *uop = &cpu->uop_pool[cpu->rob[(cpu->rob_head + i) % APEX_ROB_SIZE]];
+    printf(" | pc(%d) %s | %s |\n", uop->pc, uop->opcode,
+           uop->completed ? "completed" : "in flight");
+  }
+
+  printf("=====RAT=====\n");
+  for (int j = 0; j < 24; ++j)
+  {
+    if (cpu->prf[j].valid != 1)
+    {
+      printf("|R[%d] = P%d ARF_VAL=%d Latest=%d|\n", cpu->prf[j].value, j,
+             cpu->prf[j].arf_val, cpu->prf[j].latest);
+    }
+  }
+}
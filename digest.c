@@ -0,0 +1,185 @@
+/*
+ *  digest.c
+ *  Incremental digest of the architectural state, see digest.h
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "digest.h"
+#include "functional.h"
+
+/* splitmix64's finalizer, every input bit reaches every output bit */
+static uint64_t mix(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/* A location holding 0 adds nothing, so untouched state costs nothing */
+static uint64_t term(uint64_t key, int value)
+{
+  return value ? mix((key << 32) | (uint32_t)value) : 0;
+}
+
+int APEX_digest_start(APEX_Digest *digest, const char *path, long interval, int threads,
+                      const int *regs, const int *zero_flags, int *const *memories)
+{
+  memset(digest, 0, sizeof(*digest));
+  digest->memory = malloc(sizeof(int) * APEX_DATA_MEMORY_WORDS * threads);
+  if (!digest->memory)
+  {
+    return -1;
+  }
+  digest->log = path[0] ? fopen(path, "w") : stdout;
+  if (!digest->log)
+  {
+    fprintf(stderr, "APEX_Error : Unable to create %s\n", path);
+    free(digest->memory);
+    digest->memory = NULL;
+    return -1;
+  }
+  /* Lines are kept even if the run crashes */
+  setvbuf(digest->log, NULL, _IOLBF, 0);
+  digest->interval = interval;
+  digest->next = interval;
+  digest->threads = threads;
+
+  for (int t = 0; t < threads; ++t)
+  {
+    int *memory = &digest->memory[t * APEX_DATA_MEMORY_WORDS];
+    memcpy(memory, memories[t], sizeof(int) * APEX_DATA_MEMORY_WORDS);
+    for (int r = 0; r < 32; ++r)
+    {
+      digest->hash += term(APEX_DIGEST_REG(t * 32 + r), regs[t * 32 + r]);
+    }
+    digest->hash += term(APEX_DIGEST_FLAG(t), zero_flags[t]);
+    for (int a = 0; a < APEX_DATA_MEMORY_WORDS; ++a)
+    {
+      digest->hash += term(APEX_DIGEST_MEM(t, a), memory[a]);
+    }
+  }
+  fprintf(digest->log, "# APEX state digest every %ld retired instructions\n", interval);
+  return 0;
+}
+
+void APEX_digest_update(APEX_Digest *digest, uint64_t key, int old_value, int new_value)
+{
+  digest->hash += term(key, new_value) - term(key, old_value);
+}
+
+void APEX_digest_store(APEX_Digest *digest, int thread, int address, int value)
+{
+  if (address < 0 || address >= APEX_DATA_MEMORY_WORDS)
+  {
+    return;
+  }
+  int *word = &digest->memory[thread * APEX_DATA_MEMORY_WORDS + address];
+  APEX_digest_update(digest, APEX_DIGEST_MEM(thread, address), *word, value);
+  *word = value;
+}
+
+void APEX_digest_retired(APEX_Digest *digest, long retired)
+{
+  if (retired >= digest->next)
+  {
+    fprintf(digest->log, "%ld %016llx\n", retired, (unsigned long long)digest->hash);
+    digest->next += digest->interval;
+  }
+}
+
+void APEX_digest_finish(APEX_Digest *digest, long retired)
+{
+  if (!digest->log)
+  {
+    return;
+  }
+  fprintf(digest->log, "end %ld %016llx\n", retired, (unsigned long long)digest->hash);
+  if (digest->log != stdout)
+  {
+    fclose(digest->log);
+  }
+  free(digest->memory);
+  digest->memory = NULL;
+  digest->log = NULL;
+}
+
+/* One line of a log, comments skipped. Returns 1, 0 at the end or -1 if malformed */
+typedef struct Digest_Line
+{
+  char text[128];
+  long retired;
+  unsigned long long hash;
+  int end;
+} Digest_Line;
+
+static int read_line(FILE *in, Digest_Line *line)
+{
+  while (fgets(line->text, sizeof(line->text), in))
+  {
+    line->text[strcspn(line->text, "\n")] = '\0';
+    if (line->text[0] == '#' || line->text[0] == '\0')
+    {
+      continue;
+    }
+    line->end = strncmp(line->text, "end ", 4) == 0;
+    const char *fields = line->end ? line->text + 4 : line->text;
+    return sscanf(fields, "%ld %llx", &line->retired, &line->hash) == 2 ? 1 : -1;
+  }
+  return 0;
+}
+
+int APEX_digest_compare(const char *path_a, const char *path_b)
+{
+  FILE *a = fopen(path_a, "r");
+  FILE *b = fopen(path_b, "r");
+  if (!a || !b)
+  {
+    fprintf(stderr, "APEX_Error : Unable to open %s\n", !a ? path_a : path_b);
+    if (a)
+      fclose(a);
+    if (b)
+      fclose(b);
+    return -1;
+  }
+
+  Digest_Line line_a, line_b;
+  long agreed = 0;      // Retired instructions both logs agree over
+  long lines = 0;
+  int status;
+  for (;;)
+  {
+    int got_a = read_line(a, &line_a);
+    int got_b = read_line(b, &line_b);
+    if (got_a < 0 || got_b < 0)
+    {
+      fprintf(stderr, "APEX_Error : %s is not a digest log\n", got_a < 0 ? path_a : path_b);
+      status = -1;
+      break;
+    }
+    if (!got_a && !got_b)
+    {
+      printf("(apex) >> Digests agree, %ld lines over %ld retired instructions\n",
+             lines, agreed);
+      status = 0;
+      break;
+    }
+    if (!got_a || !got_b || line_a.retired != line_b.retired ||
+        line_a.hash != line_b.hash || line_a.end != line_b.end)
+    {
+      printf("(apex) >> First divergence after %ld retired instructions, line %ld\n",
+             agreed, lines + 1);
+      printf("%s : %s\n", path_a, got_a ? line_a.text : "(ends)");
+      printf("%s : %s\n", path_b, got_b ? line_b.text : "(ends)");
+      status = 1;
+      break;
+    }
+    agreed = line_a.retired;
+    lines++;
+  }
+  fclose(a);
+  fclose(b);
+  return status;
+}
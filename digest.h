@@ -0,0 +1,58 @@
+#ifndef _APEX_DIGEST_H_
+#define _APEX_DIGEST_H_
+/*
+ *  digest.h
+ *  Digest of the architectural state: committed registers, zero flags
+ *  and data memory. It is the sum of a hash of every nonzero location
+ *  with its value, so a retirement updates it by taking out the old
+ *  value's term and adding the new one, and nothing is rehashed.
+ *
+ *  A log gets one line every interval retired instructions, the count
+ *  and the digest, and a last one at the end of the run. Two runs of
+ *  the same program agree up to the first interval whose lines differ.
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+/* Locations a digest covers */
+#define APEX_DIGEST_REG(reg) ((uint64_t)(reg))
+#define APEX_DIGEST_FLAG(thread) ((1ULL << 20) + (thread))
+#define APEX_DIGEST_MEM(thread, address) ((2ULL << 20) + ((uint64_t)(thread) << 12) + (address))
+
+typedef struct APEX_Digest
+{
+  uint64_t hash;
+  long interval;        // Retired instructions per line
+  long next;            // Retirement count of the next line
+  int threads;
+  int *memory;          // Committed data memory of each thread, stores reach it at retirement
+  FILE *log;            // NULL unless a digest is being kept
+} APEX_Digest;
+
+/*
+ * Opens path, stdout if empty, and starts the digest from the state
+ * given: threads times 32 registers, their zero flags and their data
+ * memories. Returns 0 on success.
+ */
+int APEX_digest_start(APEX_Digest *digest, const char *path, long interval, int threads,
+                      const int *regs, const int *zero_flags, int *const *memories);
+
+/* Location key changes from old_value to new_value */
+void APEX_digest_update(APEX_Digest *digest, uint64_t key, int old_value, int new_value);
+
+/* A retired store of value to address, out of range ones are ignored */
+void APEX_digest_store(APEX_Digest *digest, int thread, int address, int value);
+
+/* Writes a line if retired ends an interval */
+void APEX_digest_retired(APEX_Digest *digest, long retired);
+
+/* Writes the last line and closes the log */
+void APEX_digest_finish(APEX_Digest *digest, long retired);
+
+/*
+ * Prints where two logs first differ. Returns 0 if they agree, 1 if
+ * they differ and -1 if one cannot be read.
+ */
+int APEX_digest_compare(const char *path_a, const char *path_b);
+
+#endif
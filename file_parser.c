@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "cpu.h"
+#include "assembler.h"
 
 /*
  * This function is related to parsing input file
@@ -30,24 +31,61 @@ static int get_num_from_string(char *buffer)
   return atoi(str);
 }
 
+/* Mnemonics indexed by APEX_Opcode */
+static const char *opcode_names[] = {
+    "", "MOVC", "ADD", "SUB", "MUL", "AND", "OR", "EX-OR", "ADDL", "SUBL",
+    "LOAD", "LDR", "STORE", "STR", "BZ", "BNZ", "JUMP", "HALT"};
+
+#define NUM_OPCODES ((int)(sizeof(opcode_names) / sizeof(opcode_names[0])))
+
+/* Maps an opcode mnemonic to APEX_Opcode, APEX_OP_NONE if unknown */
+int APEX_opcode_from_string(const char *opcode)
+{
+  for (int i = 1; i < NUM_OPCODES; ++i)
+  {
+    if (strcmp(opcode, opcode_names[i]) == 0)
+    {
+      return i;
+    }
+  }
+  return APEX_OP_NONE;
+}
+
+/* Mnemonic of an APEX_Opcode, "" if out of range */
+const char *APEX_opcode_name(int op)
+{
+  if (op < 0 || op >= NUM_OPCODES)
+  {
+    return opcode_names[APEX_OP_NONE];
+  }
+  return opcode_names[op];
+}
+
 /*
  * This function is related to parsing input file
  *
  * Note : you can edit this function to add new instructions
  */
-static void create_APEX_instruction(APEX_Instruction *ins, char *buffer)
+void create_APEX_instruction(APEX_Instruction *ins, char *buffer)
 {
-  char *token = strtok(buffer, ",");
+  char *save;
+  buffer[strcspn(buffer, "\r\n")] = '\0';
+  char *token = strtok_r(buffer, ",", &save);
   int token_num = 0;
   char tokens[6][128];
   while (token != NULL)
   {
     strcpy(tokens[token_num], token);
     token_num++;
-    token = strtok(NULL, ",");
+    token = strtok_r(NULL, ",", &save);
   }
 
-  strcpy(ins->opcode, tokens[0]);
+  strcpy(ins->opcode, token_num ? tokens[0] : "");
+  ins->op = APEX_opcode_from_string(ins->opcode);
+  ins->rd = -1;
+  ins->rs1 = -1;
+  ins->rs2 = -1;
+  ins->rs3 = -1;
 
   if (strcmp(ins->opcode, "MOVC") == 0)
   {
@@ -106,6 +144,14 @@ static void create_APEX_instruction(APEX_Instruction *ins, char *buffer)
     /*No any operation*/
   }
 
+  if (strcmp(ins->opcode, "LDR") == 0)
+  {
+    ins->rd = get_num_from_string(tokens[1]);
+    ins->rs1 = get_num_from_string(tokens[2]);
+    ins->rs2 = get_num_from_string(tokens[3]);
+    ins->imm = -1;
+  }
+
   if (
       strcmp(ins->opcode, "ADD") == 0 ||
       strcmp(ins->opcode, "SUB") == 0 ||
@@ -121,10 +167,19 @@ static void create_APEX_instruction(APEX_Instruction *ins, char *buffer)
   }
 }
 
+/*
+ * Assembles the program on an open stream into a newly allocated code
+ * memory, closes the stream. path is NULL for a program in memory.
+ */
+static APEX_Instruction *read_code_memory(FILE *fp, const char *path, int *size)
+{
+  APEX_Instruction *code_memory = APEX_assemble(fp, path, size);
+  fclose(fp);
+  return code_memory;
+}
+
 /*
  * This function is related to parsing input file
- *
- * Note : You are not supposed to edit this function
  */
 APEX_Instruction *create_code_memory(const char *filename, int *size)
 {
@@ -139,39 +194,26 @@ APEX_Instruction *create_code_memory(const char *filename, int *size)
     return NULL;
   }
 
-  char *line = NULL;
-  size_t len = 0;
-  size_t nread;
-  int code_memory_size = 0;
+  return read_code_memory(fp, filename, size);
+}
 
-  while ((nread = getline(&line, &len, fp)) != -1)
-  {
-    code_memory_size++;
-  }
-  *size = code_memory_size;
-  if (!code_memory_size)
+/*
+ * Same as create_code_memory, for a program already held in memory
+ */
+APEX_Instruction *create_code_memory_from_buffer(const char *buffer,
+                                                 size_t length, int *size)
+{
+  if (!buffer || !length)
   {
-    fclose(fp);
+    *size = 0;
     return NULL;
   }
 
-  APEX_Instruction *code_memory =
-      malloc(sizeof(*code_memory) * code_memory_size);
-  if (!code_memory)
+  FILE *fp = fmemopen((void *)buffer, length, "r");
+  if (!fp)
   {
-    fclose(fp);
     return NULL;
   }
 
-  rewind(fp);
-  int current_instruction = 0;
-  while ((nread = getline(&line, &len, fp)) != -1)
-  {
-    create_APEX_instruction(&code_memory[current_instruction], line);
-    current_instruction++;
-  }
-
-  free(line);
-  fclose(fp);
-  return code_memory;
-}
\ No newline at end of file
+  return read_code_memory(fp, NULL, size);
+}
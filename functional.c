@@ -0,0 +1,158 @@
+/*
+ *  functional.c
+ *  Reference interpreter of the APEX ISA. It runs straight over code
+ *  memory with no timing, so it is the ground truth the pipeline model
+ *  is checked against.
+ */
+#include <string.h>
+#include "functional.h"
+
+int APEX_op_writes_register(int op)
+{
+  switch (op)
+  {
+  case APEX_OP_MOVC:
+  case APEX_OP_ADD:
+  case APEX_OP_SUB:
+  case APEX_OP_MUL:
+  case APEX_OP_AND:
+  case APEX_OP_OR:
+  case APEX_OP_EXOR:
+  case APEX_OP_ADDL:
+  case APEX_OP_SUBL:
+  case APEX_OP_LOAD:
+  case APEX_OP_LDR:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+void APEX_func_init(APEX_Func *func, const APEX_Instruction *code_memory,
+                    int code_memory_size)
+{
+  memset(func, 0, sizeof(*func));
+  func->code_memory = code_memory;
+  func->code_memory_size = code_memory_size;
+  func->pc = 4000;
+}
+
+static int load_word(APEX_Func *func, int address)
+{
+  if (address < 0 || address >= APEX_DATA_MEMORY_WORDS)
+  {
+    return 0;
+  }
+  return func->data_memory[address];
+}
+
+/*
+ * Executes the instruction at pc and describes its effect in record,
+ * returns 0 without executing anything once the program halted
+ */
+int APEX_func_step(APEX_Func *func, APEX_Retire_Record *record)
+{
+  int index = get_code_index(func->pc);
+  if (func->halted || index < 0 || index >= func->code_memory_size)
+  {
+    func->halted = 1;
+    return 0;
+  }
+
+  const APEX_Instruction *ins = &func->code_memory[index];
+  int *regs = func->regs;
+  int next_pc = func->pc + 4;
+  int result = 0;
+
+  record->pc = func->pc;
+  record->rd = -1;
+  record->value = 0;
+  record->mem_address = -1;
+  record->mem_value = 0;
+  record->cycle = 0;
+
+  switch (ins->op)
+  {
+  case APEX_OP_MOVC:
+    result = ins->imm;
+    break;
+  case APEX_OP_ADD:
+    result = regs[ins->rs1] + regs[ins->rs2];
+    func->zero_flag = result == 0;
+    break;
+  case APEX_OP_SUB:
+    result = regs[ins->rs1] - regs[ins->rs2];
+    func->zero_flag = result == 0;
+    break;
+  case APEX_OP_MUL:
+    result = regs[ins->rs1] * regs[ins->rs2];
+    func->zero_flag = result == 0;
+    break;
+  case APEX_OP_AND:
+    result = regs[ins->rs1] & regs[ins->rs2];
+    break;
+  case APEX_OP_OR:
+    result = regs[ins->rs1] | regs[ins->rs2];
+    break;
+  case APEX_OP_EXOR:
+    result = regs[ins->rs1] ^ regs[ins->rs2];
+    break;
+  case APEX_OP_ADDL:
+    result = regs[ins->rs1] + ins->imm;
+    func->zero_flag = result == 0;
+    break;
+  case APEX_OP_SUBL:
+    result = regs[ins->rs1] - ins->imm;
+    func->zero_flag = result == 0;
+    break;
+  case APEX_OP_LOAD:
+    result = load_word(func, regs[ins->rs1] + ins->imm);
+    break;
+  case APEX_OP_LDR:
+    result = load_word(func, regs[ins->rs1] + regs[ins->rs2]);
+    break;
+  case APEX_OP_STORE:
+    record->mem_address = regs[ins->rs2] + ins->imm;
+    record->mem_value = regs[ins->rs1];
+    break;
+  case APEX_OP_STR:
+    record->mem_address = regs[ins->rs2] + regs[ins->rs3];
+    record->mem_value = regs[ins->rs1];
+    break;
+  case APEX_OP_BZ:
+    if (func->zero_flag)
+    {
+      next_pc = func->pc + ins->imm;
+    }
+    break;
+  case APEX_OP_BNZ:
+    if (!func->zero_flag)
+    {
+      next_pc = func->pc + ins->imm;
+    }
+    break;
+  case APEX_OP_JUMP:
+    next_pc = regs[ins->rs1] + ins->imm;
+    break;
+  case APEX_OP_HALT:
+    func->halted = 1;
+    break;
+  default:
+    break;
+  }
+
+  if (APEX_op_writes_register(ins->op))
+  {
+    regs[ins->rd] = result;
+    record->rd = ins->rd;
+    record->value = result;
+  }
+  if (record->mem_address >= 0 && record->mem_address < APEX_DATA_MEMORY_WORDS)
+  {
+    func->data_memory[record->mem_address] = record->mem_value;
+  }
+
+  func->pc = next_pc;
+  func->retired++;
+  return 1;
+}
@@ -0,0 +1,42 @@
+#ifndef _APEX_FUNCTIONAL_H_
+#define _APEX_FUNCTIONAL_H_
+/*
+ *  functional.h
+ *  Instruction-at-a-time reference interpreter of the APEX ISA
+ */
+#include "cpu.h"
+
+#define APEX_DATA_MEMORY_WORDS 4096
+
+/* Architectural effect of one retired instruction */
+typedef struct APEX_Retire_Record
+{
+  int pc;
+  int rd;           // Register written, -1 if none
+  int value;        // Value written to rd
+  int mem_address;  // Word stored to, -1 if no store
+  int mem_value;    // Value stored
+  int cycle;        // Clock cycle it retired in, 0 for the reference model
+} APEX_Retire_Record;
+
+/* Architectural state of the reference model */
+typedef struct APEX_Func
+{
+  const APEX_Instruction *code_memory;
+  int code_memory_size;
+  int pc;
+  int regs[32];
+  int data_memory[APEX_DATA_MEMORY_WORDS];
+  int zero_flag;
+  int halted;       // HALT retired or pc left code memory
+  long retired;
+} APEX_Func;
+
+int APEX_op_writes_register(int op);
+
+void APEX_func_init(APEX_Func *func, const APEX_Instruction *code_memory,
+                    int code_memory_size);
+
+int APEX_func_step(APEX_Func *func, APEX_Retire_Record *record);
+
+#endif
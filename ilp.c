@@ -0,0 +1,344 @@
+/*
+ *  ilp.c
+ *  ILP limit study over the dynamic data dependence graph. Every
+ *  instruction the reference interpreter executes becomes a node that
+ *  starts once its register, zero flag and memory producers complete
+ *  and takes its functional unit's latency. Control dependences are
+ *  ignored, as with a perfect branch predictor, and renaming removes
+ *  every false dependence.
+ *
+ *  The graph is never stored. A schedule keeps only the completion
+ *  cycle of the latest writer of each register, the zero flag and
+ *  each data memory word, plus, under a window cap, the retirement
+ *  cycles of the last window instructions: an instruction enters the
+ *  window once the one window places ahead of it retired, in order.
+ *  Memory stays the same however long the run.
+ *
+ *  The critical path is the latest completion. Each time a node
+ *  completes past it, the cycles it adds are charged to the node's
+ *  PC, so the charges sum to the critical path length.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ilp.h"
+#include "functional.h"
+#include "memimage.h"
+
+#define ALU_LATENCY 1      // Issue to a dependent's issue, as in cpu.c
+#define MUL_LATENCY 3
+#define LOAD_LATENCY 3
+
+#define MAX_SCHEDULES 24
+
+/* One dynamic instruction, as the schedules see it */
+typedef struct ILP_Node
+{
+  int sources[3];       // Registers read, -1 if unused
+  int reads_flag;
+  int writes_rd;        // Register written, -1 if none
+  int sets_flag;
+  int load_address;     // Word loaded, -1 if none
+  int store_address;    // Word stored, -1 if none
+  int latency;
+} ILP_Node;
+
+typedef struct ILP_Schedule
+{
+  int window;           // Instructions in flight at most, 0 for no cap
+  long *retire;         // Retirement cycles of the last window instructions
+  long last_retire;
+  long reg_ready[32];
+  long flag_ready;
+  long mem_ready[APEX_DATA_MEMORY_WORDS];
+  long length;          // Latest completion so far
+} ILP_Schedule;
+
+static double now_seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int data_word(int address)
+{
+  return address >= 0 && address < APEX_DATA_MEMORY_WORDS ? address : -1;
+}
+
+/* Describes ins, before func executes it */
+static void make_node(ILP_Node *node, const APEX_Func *func, const APEX_Instruction *ins)
+{
+  const int *regs = func->regs;
+
+  node->sources[0] = node->sources[1] = node->sources[2] = -1;
+  node->reads_flag = 0;
+  node->writes_rd = APEX_op_writes_register(ins->op) ? ins->rd : -1;
+  node->sets_flag = 0;
+  node->load_address = -1;
+  node->store_address = -1;
+  node->latency = ALU_LATENCY;
+
+  switch (ins->op)
+  {
+  case APEX_OP_ADD:
+  case APEX_OP_SUB:
+  case APEX_OP_MUL:
+    node->sets_flag = 1;
+    /* Fall through */
+  case APEX_OP_AND:
+  case APEX_OP_OR:
+  case APEX_OP_EXOR:
+    node->sources[0] = ins->rs1;
+    node->sources[1] = ins->rs2;
+    if (ins->op == APEX_OP_MUL)
+      node->latency = MUL_LATENCY;
+    break;
+  case APEX_OP_ADDL:
+  case APEX_OP_SUBL:
+    node->sets_flag = 1;
+    node->sources[0] = ins->rs1;
+    break;
+  case APEX_OP_LOAD:
+    node->sources[0] = ins->rs1;
+    node->load_address = data_word(regs[ins->rs1] + ins->imm);
+    node->latency = LOAD_LATENCY;
+    break;
+  case APEX_OP_LDR:
+    node->sources[0] = ins->rs1;
+    node->sources[1] = ins->rs2;
+    node->load_address = data_word(regs[ins->rs1] + regs[ins->rs2]);
+    node->latency = LOAD_LATENCY;
+    break;
+  case APEX_OP_STORE:
+    node->sources[0] = ins->rs1;
+    node->sources[1] = ins->rs2;
+    node->store_address = data_word(regs[ins->rs2] + ins->imm);
+    break;
+  case APEX_OP_STR:
+    node->sources[0] = ins->rs1;
+    node->sources[1] = ins->rs2;
+    node->sources[2] = ins->rs3;
+    node->store_address = data_word(regs[ins->rs2] + regs[ins->rs3]);
+    break;
+  case APEX_OP_BZ:
+  case APEX_OP_BNZ:
+    node->reads_flag = 1;
+    break;
+  case APEX_OP_JUMP:
+    node->sources[0] = ins->rs1;
+    break;
+  default:
+    break;
+  }
+}
+
+static void ready_at(long *start, long cycle)
+{
+  if (cycle > *start)
+    *start = cycle;
+}
+
+/* Places the n-th node in schedule, returns its completion cycle */
+static long place(ILP_Schedule *schedule, long n, const ILP_Node *node)
+{
+  long start = 0;
+
+  if (schedule->window && n >= schedule->window)
+    start = schedule->retire[n % schedule->window];
+  for (int i = 0; i < 3; ++i)
+  {
+    if (node->sources[i] >= 0 && node->sources[i] < 32)
+      ready_at(&start, schedule->reg_ready[node->sources[i]]);
+  }
+  if (node->reads_flag)
+    ready_at(&start, schedule->flag_ready);
+  if (node->load_address >= 0)
+    ready_at(&start, schedule->mem_ready[node->load_address]);
+
+  long complete = start + node->latency;
+  if (node->writes_rd >= 0 && node->writes_rd < 32)
+    schedule->reg_ready[node->writes_rd] = complete;
+  if (node->sets_flag)
+    schedule->flag_ready = complete;
+  if (node->store_address >= 0)
+    schedule->mem_ready[node->store_address] = complete;
+  if (schedule->window)
+  {
+    if (complete > schedule->last_retire)
+      schedule->last_retire = complete;
+    schedule->retire[n % schedule->window] = schedule->last_retire;
+  }
+  return complete;
+}
+
+/* Power of two windows with the configured ROB in order, then no cap */
+static int make_schedules(ILP_Schedule **schedules, int rob_size)
+{
+  int windows[MAX_SCHEDULES];
+  int count = 0;
+  int rob_placed = 0;
+
+  for (int window = 4; window <= APEX_ILP_MAX_WINDOW; window *= 2)
+  {
+    if (rob_size < window && !rob_placed)
+      windows[count++] = rob_size;
+    rob_placed |= rob_size <= window;
+    windows[count++] = window;
+  }
+  windows[count++] = 0;
+
+  for (int i = 0; i < count; ++i)
+  {
+    schedules[i] = calloc(1, sizeof(ILP_Schedule));
+    if (!schedules[i])
+      return -1;
+    schedules[i]->window = windows[i];
+    if (windows[i])
+    {
+      schedules[i]->retire = calloc(windows[i], sizeof(long));
+      if (!schedules[i]->retire)
+        return -1;
+    }
+  }
+  return count;
+}
+
+static void free_schedules(ILP_Schedule **schedules, int count)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    if (schedules[i])
+      free(schedules[i]->retire);
+    free(schedules[i]);
+  }
+}
+
+static void print_hot(const APEX_Instruction *code, int size, const long *added,
+                      const long *executed, long length, int hot)
+{
+  int *order = malloc(size * sizeof(int));
+  if (!order)
+    return;
+  int count = 0;
+  for (int i = 0; i < size; ++i)
+  {
+    if (added[i])
+      order[count++] = i;
+  }
+  /* Partial selection, hot is small */
+  if (hot > count)
+    hot = count;
+  for (int i = 0; i < hot; ++i)
+  {
+    int best = i;
+    for (int j = i + 1; j < count; ++j)
+    {
+      if (added[order[j]] > added[order[best]])
+        best = j;
+    }
+    int swap = order[i];
+    order[i] = order[best];
+    order[best] = swap;
+  }
+
+  printf("Critical path PCs, by the cycles they added to it :\n");
+  printf("%-6s %-8s %-11s %-11s %-7s\n", "pc", "opcode", "executed", "cycles", "share");
+  for (int i = 0; i < hot; ++i)
+  {
+    int index = order[i];
+    printf("%-6d %-8s %-11ld %-11ld %5.1f%%\n", 4000 + 4 * index,
+           APEX_opcode_name(code[index].op), executed[index], added[index],
+           length ? 100.0 * added[index] / length : 0.0);
+  }
+  free(order);
+}
+
+int APEX_ilp_run(const char *filename, const APEX_Config *config)
+{
+  int size = 0;
+  APEX_Instruction *code = create_code_memory(filename, &size);
+  if (!code)
+  {
+    fprintf(stderr, "APEX_Error : Unable to load %s\n", filename);
+    return -1;
+  }
+
+  ILP_Schedule *schedules[MAX_SCHEDULES] = {NULL};
+  int count = make_schedules(schedules, config->rob_size);
+  APEX_Func *func = malloc(sizeof(*func));
+  long *added = calloc(size ? size : 1, sizeof(long));
+  long *executed = calloc(size ? size : 1, sizeof(long));
+  if (func)
+  {
+    APEX_func_init(func, code, size);
+  }
+  if (count < 0 || !func || !added || !executed ||
+      APEX_memory_image_load(config, func->data_memory) != 0)
+  {
+    free_schedules(schedules, MAX_SCHEDULES);
+    free(func);
+    free(added);
+    free(executed);
+    free(code);
+    return -1;
+  }
+
+  ILP_Schedule *ideal = schedules[count - 1];
+  APEX_Retire_Record record;
+  ILP_Node node;
+  long n = 0;
+  double start = now_seconds();
+
+  for (;;)
+  {
+    int index = get_code_index(func->pc);
+    if (func->halted || index < 0 || index >= size)
+      break;
+    make_node(&node, func, &code[index]);
+    for (int i = 0; i < count - 1; ++i)
+      place(schedules[i], n, &node);
+    long complete = place(ideal, n, &node);
+    if (complete > ideal->length)
+    {
+      added[index] += complete - ideal->length;
+      ideal->length = complete;
+    }
+    executed[index]++;
+    APEX_func_step(func, &record);
+    n++;
+  }
+  double seconds = now_seconds() - start;
+
+  printf("(apex) >> ILP limit: %ld instructions, critical path %ld cycles, "
+         "ideal IPC %.3f\n",
+         n, ideal->length, ideal->length ? (double)n / ideal->length : 0.0);
+  printf("Latencies : ALU %d, MUL %d, LOAD %d, true register, flag and memory "
+         "dependences only\n",
+         ALU_LATENCY, MUL_LATENCY, LOAD_LATENCY);
+  printf("%-10s %-12s %-8s\n", "window", "cycles", "IPC");
+  for (int i = 0; i < count; ++i)
+  {
+    ILP_Schedule *schedule = schedules[i];
+    long cycles = schedule->window ? schedule->last_retire : schedule->length;
+    char name[32];
+    if (!schedule->window)
+      snprintf(name, sizeof(name), "none");
+    else if (schedule->window == config->rob_size)
+      snprintf(name, sizeof(name), "%d (ROB)", schedule->window);
+    else
+      snprintf(name, sizeof(name), "%d", schedule->window);
+    printf("%-10s %-12ld %-8.3f\n", name, cycles, cycles ? (double)n / cycles : 0.0);
+  }
+  print_hot(code, size, added, executed, ideal->length, config->ilp_hot);
+  printf("Host : %.3f s, %.1f M instructions/s\n", seconds,
+         seconds > 0 ? n / seconds / 1e6 : 0.0);
+
+  free_schedules(schedules, count);
+  free(func);
+  free(added);
+  free(executed);
+  free(code);
+  return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef _APEX_ILP_H_
+#define _APEX_ILP_H_
+/*
+ *  ilp.h
+ *  ILP limit study. The reference interpreter's instruction stream is
+ *  scheduled as a dynamic data dependence graph on an ideal machine,
+ *  with no resource limits or with only an instruction window.
+ */
+#include "cpu.h"
+
+/* Windows are powers of two up to this, plus the configured ROB */
+#define APEX_ILP_MAX_WINDOW 65536
+
+/*
+ * Schedules filename's true register and memory dependences with the
+ * pipeline's latencies and prints the critical path, the ideal IPC,
+ * the IPC under each window size and the config->ilp_hot PCs that
+ * lengthened the critical path most. Returns 0 on success.
+ */
+int APEX_ilp_run(const char *filename, const APEX_Config *config);
+
+#endif
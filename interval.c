@@ -0,0 +1,366 @@
+/*
+ *  interval.c
+ *  First-order interval model (Karkhanis and Smith; Eyerman et al.).
+ *  Dispatch is taken to flow at the core's width; every miss event, a
+ *  mispredicted branch, a consumer of a MUL or load still in flight, a
+ *  data cache miss or a ROB filled behind a long load, stalls it for a
+ *  penalty worked out from the event's latency, the distance to the
+ *  instruction it waits on and the ROB size. The latencies are those
+ *  of the pipeline in cpu.c.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "interval.h"
+#include "cache.h"
+#include "functional.h"
+#include "memimage.h"
+#include "prefetch.h"
+
+#define DISPATCH_WIDTH 1   // Decode renames one instruction a cycle
+#define REDIRECT_DELAY 2   // Branch resolution to the right path's dispatch
+#define RETIRE_DEPTH 3     // Dispatch to retirement of a one cycle op
+#define MUL_LATENCY 3      // Issue to a dependent's dispatch
+#define LOAD_LATENCY 3
+
+/* Where the estimated cycles go */
+enum
+{
+  EVENT_BASE,       // Dispatch at full width
+  EVENT_MISPREDICT,
+  EVENT_MUL,        // Consumer of a MUL in flight
+  EVENT_LOAD,       // Consumer of a load hit in flight
+  EVENT_DCACHE,     // Consumer of a missing load, or a store miss
+  EVENT_ROB,        // ROB full behind an unfinished op
+  EVENT_KINDS
+};
+
+static const char *event_names[EVENT_KINDS] = {
+    "base", "mispredict", "mul chain", "load use", "dcache miss", "rob full"};
+
+typedef struct Interval_Model
+{
+  int rob_size;
+  APEX_Cache *dcache;
+  APEX_Prefetcher *prefetcher;
+
+  long dispatch;            // Cycle of the last dispatch
+  int slots;                // Dispatched in that cycle
+  long redirect;            // First dispatch allowed after a mispredict
+  long resolve;             // Cycle the last branch resolved
+  long ready[32];           // First cycle a consumer of each register may dispatch
+  int ready_event[32];      // What it waits for until then
+  long flag_ready;
+  int flag_event;
+  long retired[APEX_ROB_SIZE]; // Retire cycles of the last rob_size instructions
+  long last_retire;
+  long instructions;
+
+  long events[EVENT_KINDS]; // Stalls, instructions for EVENT_BASE
+  long cycles[EVENT_KINDS];
+  long mispredicts;
+  long dcache_misses;
+} Interval_Model;
+
+static double now_seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Moves the dispatch of the instruction to at least cycle, for event */
+static void wait_for(long *at, int *event, long cycle, int kind)
+{
+  if (cycle > *at)
+  {
+    *at = cycle;
+    *event = kind;
+  }
+}
+
+/* Same branch prediction as fetch in cpu.c */
+static int predicted_pc(const APEX_Instruction *ins, int pc)
+{
+  if ((ins->op == APEX_OP_BZ || ins->op == APEX_OP_BNZ) && ins->imm < 0)
+  {
+    return pc + ins->imm;
+  }
+  return pc + 4;
+}
+
+static int data_access(Interval_Model *model, int pc, int address, int is_store,
+                       long now)
+{
+  if (!model->dcache || address < 0 || address >= APEX_DATA_MEMORY_WORDS)
+  {
+    return 0;
+  }
+  int latency = APEX_cache_access(model->dcache, address, is_store, (int)now);
+  if (model->prefetcher)
+  {
+    int lines[APEX_PREFETCH_MAX_DEGREE];
+    int miss = latency > 0 || model->dcache->prefetch_hit;
+    int count = APEX_prefetcher_train(model->prefetcher, pc, address, miss, lines);
+    for (int i = 0; i < count; ++i)
+    {
+      APEX_cache_prefetch(model->dcache, lines[i], (int)now);
+    }
+  }
+  if (latency > 0)
+  {
+    model->dcache_misses++;
+  }
+  return latency;
+}
+
+static int sets_zero_flag(int op)
+{
+  return op == APEX_OP_ADD || op == APEX_OP_SUB || op == APEX_OP_MUL ||
+         op == APEX_OP_ADDL || op == APEX_OP_SUBL;
+}
+
+/*
+ * Places one instruction, before func executes it, in the interval
+ * timeline. ALU and MUL ops wait in decode for their operands, so a
+ * producer in flight stalls dispatch; loads, stores and branches wait
+ * after dispatch, in the load/store queue or the branch unit.
+ */
+static void account(Interval_Model *model, const APEX_Func *func,
+                    const APEX_Instruction *ins)
+{
+  const int *regs = func->regs;
+  long at = model->slots < DISPATCH_WIDTH ? model->dispatch : model->dispatch + 1;
+  long base = at;
+  int event = EVENT_BASE;
+  int sources[3] = {-1, -1, -1};
+  int waits_in_decode = 1;
+
+  switch (ins->op)
+  {
+  case APEX_OP_ADD:
+  case APEX_OP_SUB:
+  case APEX_OP_MUL:
+  case APEX_OP_AND:
+  case APEX_OP_OR:
+  case APEX_OP_EXOR:
+    sources[0] = ins->rs1;
+    sources[1] = ins->rs2;
+    break;
+  case APEX_OP_ADDL:
+  case APEX_OP_SUBL:
+    sources[0] = ins->rs1;
+    break;
+  case APEX_OP_LOAD:
+  case APEX_OP_JUMP:
+    sources[0] = ins->rs1;
+    waits_in_decode = 0;
+    break;
+  case APEX_OP_LDR:
+  case APEX_OP_STORE:
+    sources[0] = ins->rs1;
+    sources[1] = ins->rs2;
+    waits_in_decode = 0;
+    break;
+  case APEX_OP_STR:
+    sources[0] = ins->rs1;
+    sources[1] = ins->rs2;
+    sources[2] = ins->rs3;
+    waits_in_decode = 0;
+    break;
+  default:
+    waits_in_decode = 0;
+    break;
+  }
+
+  wait_for(&at, &event, model->redirect, EVENT_MISPREDICT);
+  if (model->instructions >= model->rob_size)
+  {
+    wait_for(&at, &event,
+             model->retired[model->instructions % model->rob_size], EVENT_ROB);
+  }
+
+  /* Cycle the operands are all available */
+  long issue = at;
+  int issue_event = EVENT_BASE;
+  for (int i = 0; i < 3; ++i)
+  {
+    if (sources[i] >= 0 && sources[i] < 32)
+      wait_for(&issue, &issue_event, model->ready[sources[i]],
+               model->ready_event[sources[i]]);
+  }
+  if (waits_in_decode && issue > at)
+  {
+    at = issue;
+    event = issue_event;
+  }
+
+  if (at > base)
+  {
+    model->events[event]++;
+    model->cycles[event] += at - base;
+  }
+  model->slots = at == model->dispatch ? model->slots + 1 : 1;
+  model->dispatch = at;
+
+  /* Cycles from issue until a dependent may dispatch */
+  int latency = 1;
+  int kind = EVENT_BASE;
+  if (ins->op == APEX_OP_MUL)
+  {
+    latency = MUL_LATENCY;
+    kind = EVENT_MUL;
+  }
+  else if (ins->op == APEX_OP_LOAD || ins->op == APEX_OP_LDR)
+  {
+    int address = regs[ins->rs1] + (ins->op == APEX_OP_LOAD ? ins->imm : regs[ins->rs2]);
+    int miss = data_access(model, func->pc, address, 0, issue);
+    latency = LOAD_LATENCY + miss;
+    kind = miss > 0 ? EVENT_DCACHE : EVENT_LOAD;
+  }
+  else if (ins->op == APEX_OP_STORE || ins->op == APEX_OP_STR)
+  {
+    int address = regs[ins->rs2] + (ins->op == APEX_OP_STORE ? ins->imm : regs[ins->rs3]);
+    int miss = data_access(model, func->pc, address, 1, issue);
+    if (miss > 0)
+    {
+      /* A store miss freezes the whole core */
+      model->dispatch += miss;
+      model->events[EVENT_DCACHE]++;
+      model->cycles[EVENT_DCACHE] += miss;
+    }
+  }
+  long complete = issue + latency;
+
+  /* The branch unit resolves branches in order */
+  if (ins->op == APEX_OP_BZ || ins->op == APEX_OP_BNZ || ins->op == APEX_OP_JUMP)
+  {
+    long resolve = ins->op == APEX_OP_JUMP ? issue : at;
+    if (ins->op != APEX_OP_JUMP && model->flag_ready > resolve)
+    {
+      resolve = model->flag_ready;
+    }
+    resolve = resolve > model->resolve ? resolve + 1 : model->resolve + 1;
+    model->resolve = resolve;
+    complete = resolve;
+  }
+
+  if (APEX_op_writes_register(ins->op) && ins->rd >= 0 && ins->rd < 32)
+  {
+    model->ready[ins->rd] = issue + latency;
+    model->ready_event[ins->rd] = kind;
+  }
+  if (sets_zero_flag(ins->op))
+  {
+    model->flag_ready = issue + latency;
+    model->flag_event = kind;
+  }
+
+  /* Retirement is in order, one a cycle */
+  long retire = complete + 1 > at + RETIRE_DEPTH ? complete + 1 : at + RETIRE_DEPTH;
+  if (retire <= model->last_retire)
+  {
+    retire = model->last_retire + 1;
+  }
+  model->last_retire = retire;
+  model->retired[model->instructions % model->rob_size] = retire;
+  model->instructions++;
+  model->events[EVENT_BASE]++;
+}
+
+int APEX_interval_run(const char *filename, const APEX_Config *config)
+{
+  int size = 0;
+  APEX_Instruction *code = create_code_memory(filename, &size);
+  if (!code)
+  {
+    fprintf(stderr, "APEX_Error : Unable to load %s\n", filename);
+    return -1;
+  }
+
+  Interval_Model *model = calloc(1, sizeof(*model));
+  APEX_Func *func = malloc(sizeof(*func));
+  if (func)
+  {
+    APEX_func_init(func, code, size);
+  }
+  if (!model || !func || APEX_memory_image_load(config, func->data_memory) != 0)
+  {
+    free(model);
+    free(func);
+    free(code);
+    return -1;
+  }
+  model->rob_size = config->rob_size;
+  if (config->dcache)
+  {
+    model->dcache = APEX_cache_create(config, 0, NULL);
+    model->prefetcher = APEX_prefetcher_create(config);
+  }
+
+  double start = now_seconds();
+  APEX_Retire_Record record;
+  for (;;)
+  {
+    int index = get_code_index(func->pc);
+    if (func->halted || index < 0 || index >= size)
+      break;
+    const APEX_Instruction *ins = &code[index];
+    int pc = func->pc;
+    account(model, func, ins);
+    APEX_func_step(func, &record);
+    if (func->pc != predicted_pc(ins, pc) && !func->halted)
+    {
+      model->mispredicts++;
+      model->redirect = model->resolve + REDIRECT_DELAY;
+    }
+  }
+  double model_time = now_seconds() - start;
+
+  long cycles = model->last_retire;
+  long instructions = model->instructions;
+  double cpi = instructions ? (double)cycles / instructions : 0;
+  model->cycles[EVENT_BASE] = cycles;
+  for (int i = 1; i < EVENT_KINDS; ++i)
+  {
+    model->cycles[EVENT_BASE] -= model->cycles[i];
+  }
+
+  printf("(apex) >> Interval model: %ld instructions, %ld cycles, CPI %.4f, "
+         "%ld mispredicts, %ld dcache misses\n",
+         instructions, cycles, cpi, model->mispredicts, model->dcache_misses);
+  printf("%-12s %-10s %-10s %-7s\n", "event", "count", "cycles", "CPI");
+  for (int i = 0; i < EVENT_KINDS; ++i)
+  {
+    printf("%-12s %-10ld %-10ld %-7.4f\n", event_names[i], model->events[i],
+           model->cycles[i],
+           instructions ? (double)model->cycles[i] / instructions : 0.0);
+  }
+  printf("Host : %.3f s\n", model_time);
+
+  if (config->interval_full)
+  {
+    start = now_seconds();
+    APEX_CPU *cpu = APEX_cpu_create(code, size, config);
+    if (cpu)
+    {
+      APEX_cpu_simulate(cpu, INT_MAX);
+      double detailed_time = now_seconds() - start;
+      double full = cpu->ins_completed ? (double)cpu->clock / cpu->ins_completed : 0;
+      printf("Detailed CPI : %.4f over %d instructions, error %.2f%%, %.3f s, "
+             "%.0fx slower\n",
+             full, cpu->ins_completed, full > 0 ? 100.0 * (cpi - full) / full : 0.0,
+             detailed_time, model_time > 0 ? detailed_time / model_time : 0.0);
+      APEX_cpu_stop(cpu);
+    }
+  }
+
+  APEX_prefetcher_free(model->prefetcher);
+  APEX_cache_free(model->dcache);
+  free(model);
+  free(func);
+  free(code);
+  return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _APEX_INTERVAL_H_
+#define _APEX_INTERVAL_H_
+/*
+ *  interval.h
+ *  Analytical CPI estimate. The program runs once on the reference
+ *  interpreter and an interval model turns its miss events into
+ *  cycles, without stepping the pipeline.
+ */
+#include "cpu.h"
+
+/*
+ * Estimates the cycles of filename on the core config describes and
+ * prints the CPI with the cycles each kind of miss event costs. With
+ * config->interval_full the pipeline model runs it too, for the error
+ * and the speedup. Returns 0 on success.
+ */
+int APEX_interval_run(const char *filename, const APEX_Config *config);
+
+#endif
@@ -7,29 +7,259 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cpu.h"
+#include "ilp.h"
+#include "interval.h"
+#include "multicore.h"
+#include "server.h"
+#include "simpoint.h"
+#include "slice.h"
+#include "smt.h"
+#include "trace.h"
 
 int main(int argc, char const *argv[])
 {
   const char *function;
-  if (argc != 4)
+  if (argc >= 2 && strcmp(argv[1], "--serve") == 0)
   {
-    fprintf(stderr, "APEX_Help : Usage %s <input_file>\n", argv[0]);
+    if (argc != 3 && argc != 4)
+    {
+      fprintf(stderr, "APEX_Help : Usage %s --serve <socket_path> [workers]\n", argv[0]);
+      exit(1);
+    }
+    return APEX_serve(argv[2], argc == 4 ? atoi(argv[3]) : 0);
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "--multicore") == 0)
+  {
+    if (argc < 5)
+    {
+      fprintf(stderr, "APEX_Help : Usage %s --multicore <cores> <cycles> <input_file> [input_file ...] [key=value ...]\n", argv[0]);
+      exit(1);
+    }
+    APEX_Config config;
+    const char *programs[APEX_MAX_CORES];
+    int program_count = 0;
+    APEX_config_default(&config);
+    for (int i = 4; i < argc; ++i)
+    {
+      if (strchr(argv[i], '='))
+      {
+        if (APEX_config_set(&config, argv[i]) != 0)
+        {
+          exit(1);
+        }
+      }
+      else if (program_count < APEX_MAX_CORES)
+      {
+        programs[program_count++] = argv[i];
+      }
+    }
+    return APEX_multicore_run(programs, program_count, atoi(argv[2]),
+                              atoi(argv[3]), &config) == 0 ? 0 : 1;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "--smt") == 0)
+  {
+    if (argc < 5)
+    {
+      fprintf(stderr, "APEX_Help : Usage %s --smt <threads> <cycles> <input_file> [input_file ...] [key=value ...]\n", argv[0]);
+      exit(1);
+    }
+    APEX_Config config;
+    const char *programs[APEX_MAX_THREADS];
+    int program_count = 0;
+    APEX_config_default(&config);
+    for (int i = 4; i < argc; ++i)
+    {
+      if (strchr(argv[i], '='))
+      {
+        if (APEX_config_set(&config, argv[i]) != 0)
+        {
+          exit(1);
+        }
+      }
+      else if (program_count < APEX_MAX_THREADS)
+      {
+        programs[program_count++] = argv[i];
+      }
+    }
+    return APEX_smt_run(programs, program_count, atoi(argv[2]),
+                        atoi(argv[3]), &config) == 0 ? 0 : 1;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "--record") == 0)
+  {
+    if (argc < 4)
+    {
+      fprintf(stderr, "APEX_Help : Usage %s --record <input_file> <trace_file> [max_instructions] [key=value ...]\n", argv[0]);
+      exit(1);
+    }
+    /* The optional count is the one argument without an '=' */
+    int first_option = argc > 4 && !strchr(argv[4], '=') ? 5 : 4;
+    APEX_Config config;
+    APEX_config_default(&config);
+    for (int i = first_option; i < argc; ++i)
+    {
+      if (APEX_config_set(&config, argv[i]) != 0)
+      {
+        exit(1);
+      }
+    }
+    int size = 0;
+    APEX_Instruction *code = create_code_memory(argv[2], &size);
+    if (!code)
+    {
+      fprintf(stderr, "APEX_Error : Unable to load %s\n", argv[2]);
+      exit(1);
+    }
+    long records = APEX_trace_record_program(code, size, argv[3],
+                                             first_option == 5 ? atol(argv[4]) : 0, &config);
+    free(code);
+    if (records < 0)
+    {
+      exit(1);
+    }
+    printf("(apex) >> Recorded %ld instructions to %s\n", records, argv[3]);
+    return 0;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "--simpoint") == 0)
+  {
+    if (argc < 4)
+    {
+      fprintf(stderr, "APEX_Help : Usage %s --simpoint <input_file> <interval> [key=value ...]\n", argv[0]);
+      exit(1);
+    }
+    APEX_Config config;
+    APEX_config_default(&config);
+    for (int i = 4; i < argc; ++i)
+    {
+      if (APEX_config_set(&config, argv[i]) != 0)
+      {
+        exit(1);
+      }
+    }
+    return APEX_simpoint_run(argv[2], atol(argv[3]), &config) == 0 ? 0 : 1;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "--interval") == 0)
+  {
+    if (argc < 3)
+    {
+      fprintf(stderr, "APEX_Help : Usage %s --interval <input_file> [key=value ...]\n", argv[0]);
+      exit(1);
+    }
+    APEX_Config config;
+    APEX_config_default(&config);
+    for (int i = 3; i < argc; ++i)
+    {
+      if (APEX_config_set(&config, argv[i]) != 0)
+      {
+        exit(1);
+      }
+    }
+    return APEX_interval_run(argv[2], &config) == 0 ? 0 : 1;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "--ilp") == 0)
+  {
+    if (argc < 3)
+    {
+      fprintf(stderr, "APEX_Help : Usage %s --ilp <input_file> [key=value ...]\n", argv[0]);
+      exit(1);
+    }
+    APEX_Config config;
+    APEX_config_default(&config);
+    for (int i = 3; i < argc; ++i)
+    {
+      if (APEX_config_set(&config, argv[i]) != 0)
+      {
+        exit(1);
+      }
+    }
+    return APEX_ilp_run(argv[2], &config) == 0 ? 0 : 1;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "--digest-compare") == 0)
+  {
+    if (argc != 4)
+    {
+      fprintf(stderr, "APEX_Help : Usage %s --digest-compare <log> <log>\n", argv[0]);
+      exit(1);
+    }
+    return APEX_digest_compare(argv[2], argv[3]) == 0 ? 0 : 1;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "--slices") == 0)
+  {
+    if (argc < 3)
+    {
+      fprintf(stderr, "APEX_Help : Usage %s --slices <input_file> [key=value ...]\n", argv[0]);
+      exit(1);
+    }
+    APEX_Config config;
+    APEX_config_default(&config);
+    for (int i = 3; i < argc; ++i)
+    {
+      if (APEX_config_set(&config, argv[i]) != 0)
+      {
+        exit(1);
+      }
+    }
+    return APEX_slice_run(argv[2], &config) == 0 ? 0 : 1;
+  }
+
+  /* --trace <trace_file> takes the place of the input file */
+  const char *prog = argv[0];
+  int from_trace = argc >= 2 && strcmp(argv[1], "--trace") == 0;
+  if (from_trace)
+  {
+    argv++;
+    argc--;
+  }
+
+  if (argc < 4)
+  {
+    fprintf(stderr, "APEX_Help : Usage %s [--trace] <input_file> <function> <cycles> [key=value ...]\n", prog);
     exit(1);
   }
 
-  APEX_CPU *cpu = APEX_cpu_init(argv[1]);
+  APEX_Config config;
+  APEX_config_default(&config);
+  for (int i = 4; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "break=", 6) != 0 &&
+        APEX_config_set(&config, argv[i]) != 0)
+    {
+      exit(1);
+    }
+  }
+
+  APEX_CPU *cpu = from_trace ? APEX_cpu_init_trace(argv[1], &config)
+                            : APEX_cpu_init(argv[1], &config);
   if (!cpu)
   {
     fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
     exit(1);
   }
 
+  /* Breakpoints need the loaded program, so they are armed last */
+  for (int i = 4; i < argc; ++i)
+  {
+    if (strncmp(argv[i], "break=", 6) == 0 &&
+        APEX_debug_add(cpu, argv[i] + 6) != 0)
+    {
+      exit(1);
+    }
+  }
+
   function = argv[2];
   cpu->no_cycles = atoi(argv[3]);
 
-  APEX_cpu_run(cpu, function, cpu->no_cycles);
+  int status = APEX_cpu_run(cpu, function, cpu->no_cycles);
   APEX_cpu_stop(cpu);
-  return 0;
+  return status == 0 ? 0 : 1;
 }
\ No newline at end of file
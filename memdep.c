@@ -0,0 +1,105 @@
+/*
+ *  memdep.c
+ *  Store-set memory dependence predictor. The store set id table
+ *  (SSIT) maps load and store pcs to a set, the last fetched store
+ *  table (LFST) names the youngest in-flight store of each set. A load
+ *  in a set waits only for that store, every other load may issue
+ *  ahead of older stores whose address is still unknown.
+ */
+#include <stdio.h>
+#include "cpu.h"
+
+static int ssit_index(int pc)
+{
+  return (pc / 4) % APEX_SSIT_SIZE;
+}
+
+void APEX_store_sets_init(APEX_Store_Sets *sets)
+{
+  for (int i = 0; i < APEX_SSIT_SIZE; ++i)
+  {
+    sets->ssit[i] = -1;
+  }
+  for (int i = 0; i < APEX_LFST_SIZE; ++i)
+  {
+    sets->lfst_uop[i] = APEX_UOP_BUBBLE;
+    sets->lfst_seq[i] = 0;
+  }
+  sets->next_ssid = 0;
+}
+
+/*
+ * Called in program order as a memory op enters the ROB. A load or
+ * store of a set depends on the set's last fetched store, a store
+ * then becomes that last fetched store.
+ */
+void APEX_store_sets_dispatch(APEX_Store_Sets *sets, APEX_Uop *uop, int index)
+{
+  int ssid = sets->ssit[ssit_index(uop->pc)];
+  uop->dep_uop = APEX_UOP_BUBBLE;
+  uop->dep_seq = 0;
+  uop->dep_waited = 0;
+  if (ssid < 0)
+  {
+    return;
+  }
+  uop->dep_uop = sets->lfst_uop[ssid];
+  uop->dep_seq = sets->lfst_seq[ssid];
+  if (uop->op == APEX_OP_STORE || uop->op == APEX_OP_STR)
+  {
+    sets->lfst_uop[ssid] = index;
+    sets->lfst_seq[ssid] = uop->seq;
+  }
+}
+
+/* A store that wrote memory no longer holds back its set */
+void APEX_store_sets_executed(APEX_Store_Sets *sets, const APEX_Uop *store, int index)
+{
+  int ssid = sets->ssit[ssit_index(store->pc)];
+  if (ssid >= 0 && sets->lfst_uop[ssid] == index &&
+      sets->lfst_seq[ssid] == store->seq)
+  {
+    sets->lfst_uop[ssid] = APEX_UOP_BUBBLE;
+  }
+}
+
+/* Puts a load and the store it read too early in the same set */
+void APEX_store_sets_violation(APEX_Store_Sets *sets, int load_pc, int store_pc)
+{
+  int *load_set = &sets->ssit[ssit_index(load_pc)];
+  int *store_set = &sets->ssit[ssit_index(store_pc)];
+
+  if (*load_set < 0 && *store_set < 0)
+  {
+    *load_set = *store_set = sets->next_ssid;
+    sets->next_ssid = (sets->next_ssid + 1) % APEX_LFST_SIZE;
+  }
+  else if (*load_set < 0)
+  {
+    *load_set = *store_set;
+  }
+  else if (*store_set < 0)
+  {
+    *store_set = *load_set;
+  }
+  else
+  {
+    /* Two sets merge into the smaller id */
+    int ssid = *load_set < *store_set ? *load_set : *store_set;
+    *load_set = *store_set = ssid;
+  }
+}
+
+void APEX_store_sets_report(const APEX_Store_Sets *sets, FILE *out)
+{
+  if (sets->loads == 0)
+  {
+    return;
+  }
+  long wrong = sets->violations + sets->false_deps;
+  fprintf(out, "(apex) >> Loads %ld, speculative %ld, held %ld (false %ld), "
+               "violations %ld (%ld replayed), prediction accuracy %.1f%%\n",
+          sets->loads, sets->speculative, sets->held, sets->false_deps,
+          sets->violations, sets->replayed,
+          100.0 * (sets->loads - wrong) / sets->loads);
+}
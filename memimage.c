@@ -0,0 +1,193 @@
+/*
+ *  memimage.c
+ *  Loads data memory from a binary image and writes it back as one,
+ *  see memimage.h
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "functional.h"
+#include "memimage.h"
+
+#define IMAGE_BYTES (APEX_DATA_MEMORY_WORDS * sizeof(int))
+
+/* Opens path and checks it fits data memory, returns its size or -1 */
+static long open_image(const char *path, int *fd)
+{
+  struct stat st;
+
+  *fd = open(path, O_RDONLY);
+  if (*fd < 0)
+  {
+    fprintf(stderr, "APEX_Error : Unable to open memory image %s\n", path);
+    return -1;
+  }
+  if (fstat(*fd, &st) != 0 || st.st_size > (long)IMAGE_BYTES ||
+      st.st_size % sizeof(int) != 0)
+  {
+    fprintf(stderr, "APEX_Error : Memory image %s must be whole words, at most %d of them\n",
+            path, APEX_DATA_MEMORY_WORDS);
+    close(*fd);
+    return -1;
+  }
+  return st.st_size;
+}
+
+int APEX_memory_image_load(const APEX_Config *config, int *memory)
+{
+  int fd;
+
+  if (!config->mem_image[0])
+  {
+    return 0;
+  }
+  long size = open_image(config->mem_image, &fd);
+  if (size < 0)
+  {
+    return -1;
+  }
+  long done = 0;
+  while (done < size)
+  {
+    ssize_t got = read(fd, (char *)memory + done, size - done);
+    if (got <= 0)
+    {
+      fprintf(stderr, "APEX_Error : Unable to read memory image %s\n", config->mem_image);
+      close(fd);
+      return -1;
+    }
+    done += got;
+  }
+  for (long i = size / sizeof(int); i < APEX_DATA_MEMORY_WORDS; ++i)
+  {
+    memory[i] = 0;
+  }
+  close(fd);
+  return 0;
+}
+
+int *APEX_memory_image_map(const char *path)
+{
+  int fd;
+
+  long size = open_image(path, &fd);
+  if (size < 0)
+  {
+    return NULL;
+  }
+  /* Zero pages first, the file is then mapped over its part of them */
+  void *memory = mmap(NULL, IMAGE_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory != MAP_FAILED && size &&
+      mmap(memory, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    munmap(memory, IMAGE_BYTES);
+    memory = MAP_FAILED;
+  }
+  close(fd);
+  if (memory == MAP_FAILED)
+  {
+    fprintf(stderr, "APEX_Error : Unable to map memory image %s\n", path);
+    return NULL;
+  }
+  return memory;
+}
+
+void APEX_memory_image_unmap(int *memory)
+{
+  if (memory)
+  {
+    munmap(memory, IMAGE_BYTES);
+  }
+}
+
+/* Parses "first-last" or "word" at *spec, inclusive, returns -1 if malformed */
+static int parse_range(const char **spec, long *first, long *last)
+{
+  char *end;
+
+  *first = strtol(*spec, &end, 0);
+  if (end == *spec)
+  {
+    return -1;
+  }
+  *last = *first;
+  if (*end == '-')
+  {
+    const char *from = end + 1;
+    *last = strtol(from, &end, 0);
+    if (end == from)
+    {
+      return -1;
+    }
+  }
+  if (*end == ',')
+  {
+    end++;
+  }
+  else if (*end != '\0')
+  {
+    return -1;
+  }
+  *spec = end;
+  return *first >= 0 && *first <= *last && *last < APEX_DATA_MEMORY_WORDS ? 0 : -1;
+}
+
+int APEX_memory_image_check_ranges(const char *ranges)
+{
+  long first, last;
+
+  for (const char *spec = ranges; *spec;)
+  {
+    if (parse_range(&spec, &first, &last) != 0)
+    {
+      fprintf(stderr, "APEX_Error : mem_dump_ranges takes first-last word ranges "
+                      "in [0, %d], comma separated\n", APEX_DATA_MEMORY_WORDS - 1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int APEX_memory_image_dump(const APEX_Config *config, const int *memory)
+{
+  if (!config->mem_dump[0])
+  {
+    return 0;
+  }
+  /* Checked before the file is created, so a bad list leaves nothing behind */
+  if (APEX_memory_image_check_ranges(config->mem_dump_ranges) != 0)
+  {
+    return -1;
+  }
+  FILE *out = fopen(config->mem_dump, "wb");
+  if (!out)
+  {
+    fprintf(stderr, "APEX_Error : Unable to create %s\n", config->mem_dump);
+    return -1;
+  }
+
+  int status = 0;
+  if (!config->mem_dump_ranges[0])
+  {
+    status = fwrite(memory, sizeof(int), APEX_DATA_MEMORY_WORDS, out) ==
+                     APEX_DATA_MEMORY_WORDS ? 0 : -1;
+  }
+  for (const char *spec = config->mem_dump_ranges; *spec && status == 0;)
+  {
+    long first, last;
+    parse_range(&spec, &first, &last);
+    long words = last - first + 1;
+    status = fwrite(&memory[first], sizeof(int), words, out) == (size_t)words ? 0 : -1;
+  }
+  if (fclose(out) != 0 || status != 0)
+  {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", config->mem_dump);
+    return -1;
+  }
+  return 0;
+}
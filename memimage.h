@@ -0,0 +1,35 @@
+#ifndef _APEX_MEMIMAGE_H_
+#define _APEX_MEMIMAGE_H_
+/*
+ *  memimage.h
+ *  Binary images of data memory. An image is the memory's words in
+ *  order, 4 bytes each in host byte order, as many as the file holds
+ *  up to APEX_DATA_MEMORY_WORDS; words past its end start at 0.
+ */
+#include "cpu.h"
+
+/*
+ * Fills memory from config->mem_image, leaves it untouched when no
+ * image is set. Returns 0 on success.
+ */
+int APEX_memory_image_load(const APEX_Config *config, int *memory);
+
+/*
+ * Maps path copy-on-write as a whole data memory, so stores never
+ * reach the file. Returns NULL on failure.
+ */
+int *APEX_memory_image_map(const char *path);
+
+void APEX_memory_image_unmap(int *memory);
+
+/* Returns 0 if ranges is a valid mem_dump_ranges list */
+int APEX_memory_image_check_ranges(const char *ranges);
+
+/*
+ * Writes memory to config->mem_dump, only the config->mem_dump_ranges
+ * words one range after the other if set. Does nothing without a
+ * dump file. Returns 0 on success.
+ */
+int APEX_memory_image_dump(const APEX_Config *config, const int *memory);
+
+#endif
@@ -0,0 +1,283 @@
+/*
+ *  multicore.c
+ *  Runs several APEX cores over one shared data memory. Each core
+ *  keeps its own pipeline and private data cache, the caches are kept
+ *  coherent with MSI through the directory in cache.c.
+ *
+ *  In quantum mode every core runs on its own host thread and the
+ *  threads meet at a barrier every quantum cycles, so no core runs
+ *  more than one quantum ahead of another. Lockstep mode steps all
+ *  cores one cycle at a time, in core order, on the calling thread,
+ *  which makes racy programs deterministic.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cache.h"
+#include "functional.h"
+#include "memimage.h"
+#include "prefetch.h"
+#include "multicore.h"
+
+typedef struct APEX_Multicore APEX_Multicore;
+
+typedef struct APEX_Core
+{
+  APEX_CPU *cpu;
+  APEX_Multicore *chip;
+  pthread_t thread;
+  int done;          // Drained or reached the cycle limit
+} APEX_Core;
+
+struct APEX_Multicore
+{
+  int cores;
+  int cycles;
+  int quantum;
+  APEX_Core core[APEX_MAX_CORES];
+  int *memory;
+  APEX_Coherence *coherence;
+
+  pthread_barrier_t barrier;
+  atomic_int active; // Cores not done yet
+  int stop;          // Decided by one thread between the two barriers
+  long quanta;
+};
+
+static int step(APEX_Core *core, int cycles)
+{
+  APEX_CPU *cpu = core->cpu;
+  if (!APEX_cpu_cycle(cpu) || cpu->clock >= cycles)
+  {
+    core->done = 1;
+    return 0;
+  }
+  return 1;
+}
+
+static void *core_main(void *arg)
+{
+  APEX_Core *core = arg;
+  APEX_Multicore *chip = core->chip;
+
+  for (;;)
+  {
+    if (!core->done)
+    {
+      int end = core->cpu->clock + chip->quantum;
+      while (core->cpu->clock < end && step(core, chip->cycles))
+        ;
+      if (core->done)
+      {
+        atomic_fetch_sub(&chip->active, 1);
+      }
+    }
+
+    /* Every core finished the quantum, one of them decides whether to go on */
+    if (pthread_barrier_wait(&chip->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+      chip->stop = atomic_load(&chip->active) == 0;
+      chip->quanta++;
+    }
+    pthread_barrier_wait(&chip->barrier);
+    if (chip->stop)
+    {
+      return NULL;
+    }
+  }
+}
+
+static void run_lockstep(APEX_Multicore *chip)
+{
+  int active = chip->cores;
+  while (active > 0)
+  {
+    for (int i = 0; i < chip->cores; ++i)
+    {
+      if (!chip->core[i].done && !step(&chip->core[i], chip->cycles))
+      {
+        active--;
+      }
+    }
+  }
+}
+
+static int run_threads(APEX_Multicore *chip)
+{
+  int started = 0;
+
+  atomic_store(&chip->active, chip->cores);
+  pthread_barrier_init(&chip->barrier, NULL, chip->cores);
+  for (; started < chip->cores; ++started)
+  {
+    if (pthread_create(&chip->core[started].thread, NULL, core_main,
+                       &chip->core[started]) != 0)
+    {
+      break;
+    }
+  }
+  if (started != chip->cores)
+  {
+    /* The barrier counts every core, threads already started would hang */
+    fprintf(stderr, "APEX_Error : Unable to start core thread %d\n", started);
+    exit(1);
+  }
+  for (int i = 0; i < chip->cores; ++i)
+  {
+    pthread_join(chip->core[i].thread, NULL);
+  }
+  pthread_barrier_destroy(&chip->barrier);
+  return 0;
+}
+
+static void print_report(APEX_Multicore *chip, double seconds)
+{
+  long total_retired = 0;
+  long total_cycles = 0;
+  int chip_cycles = 0;
+
+  if (chip->quantum)
+  {
+    printf("(apex) >> %d cores, quantum %d cycles, %ld barriers\n",
+           chip->cores, chip->quantum, chip->quanta);
+  }
+  else
+  {
+    printf("(apex) >> %d cores, lockstep\n", chip->cores);
+  }
+  printf("%-5s %-9s %-9s %-6s %-9s %-9s %-9s %-9s %-9s %-9s %-9s %-9s\n",
+         "core", "cycles", "retired", "IPC", "stalls", "accesses", "hits",
+         "misses", "coherence", "upgrades", "invalid", "writeback");
+  for (int i = 0; i < chip->cores; ++i)
+  {
+    APEX_CPU *cpu = chip->core[i].cpu;
+    APEX_Cache *cache = cpu->dcache;
+    printf("%-5d %-9d %-9d %-6.3f %-9ld %-9ld %-9ld %-9ld %-9ld %-9ld %-9ld %-9ld\n",
+           i, cpu->clock, cpu->ins_completed,
+           cpu->clock ? (double)cpu->ins_completed / cpu->clock : 0.0,
+           cpu->mem_stall_cycles, cache->accesses, cache->hits, cache->misses,
+           cache->coherence_misses, cache->upgrades, cache->invalidations,
+           cache->writebacks);
+    total_retired += cpu->ins_completed;
+    total_cycles += cpu->clock;
+    if (cpu->clock > chip_cycles)
+    {
+      chip_cycles = cpu->clock;
+    }
+  }
+  for (int i = 0; i < chip->cores && chip->core[0].cpu->prefetcher; ++i)
+  {
+    printf("Core %d :\n", i);
+    APEX_prefetch_report(chip->core[i].cpu->prefetcher, chip->core[i].cpu->dcache, stdout);
+  }
+  printf("Chip : %d cycles, %ld retired, IPC %.3f\n", chip_cycles, total_retired,
+         chip_cycles ? (double)total_retired / chip_cycles : 0.0);
+  printf("Host : %.3f s, %.0f core cycles/s\n", seconds,
+         seconds > 0 ? total_cycles / seconds : 0.0);
+
+  printf("=======SHARED DATA MEMORY====\n");
+  for (int i = 0; i < APEX_DATA_MEMORY_WORDS; i++)
+  {
+    if (chip->memory[i])
+    {
+      printf(" | MEM[%d] | Value=%d | \n", i, chip->memory[i]);
+    }
+  }
+}
+
+static void free_chip(APEX_Multicore *chip)
+{
+  for (int i = 0; i < chip->cores; ++i)
+  {
+    if (chip->core[i].cpu)
+    {
+      APEX_cpu_stop(chip->core[i].cpu);
+    }
+  }
+  APEX_coherence_free(chip->coherence);
+  free(chip->memory);
+  free(chip);
+}
+
+int APEX_multicore_run(const char *const *programs, int program_count,
+                       int cores, int cycles, const APEX_Config *config)
+{
+  if (cores < 1 || cores > APEX_MAX_CORES || program_count < 1)
+  {
+    fprintf(stderr, "APEX_Error : Need 1 to %d cores and a program\n", APEX_MAX_CORES);
+    return -1;
+  }
+  if (config->cosim)
+  {
+    fprintf(stderr, "APEX_Error : cosim does not model peer cores writing shared memory\n");
+    return -1;
+  }
+
+  APEX_Multicore *chip = calloc(1, sizeof(*chip));
+  if (!chip)
+  {
+    return -1;
+  }
+  chip->cores = cores;
+  chip->cycles = cycles;
+  chip->quantum = config->quantum;
+  chip->memory = calloc(APEX_DATA_MEMORY_WORDS, sizeof(int));
+  chip->coherence = APEX_coherence_create(APEX_DATA_MEMORY_WORDS, config->dcache_line);
+  if (!chip->memory || !chip->coherence ||
+      APEX_memory_image_load(config, chip->memory) != 0)
+  {
+    free_chip(chip);
+    return -1;
+  }
+
+  /* The private caches are set up here, with the directory attached */
+  APEX_Config core_config = *config;
+  core_config.dcache = 0;
+
+  for (int i = 0; i < cores; ++i)
+  {
+    const char *program = programs[i < program_count ? i : program_count - 1];
+    int size = 0;
+    APEX_Instruction *code = create_code_memory(program, &size);
+    APEX_CPU *cpu = APEX_cpu_create(code, size, &core_config);
+    if (!cpu)
+    {
+      fprintf(stderr, "APEX_Error : Unable to initialize core %d from %s\n", i, program);
+      free(code);
+      free_chip(chip);
+      return -1;
+    }
+    cpu->owns_code_memory = 1;
+    cpu->memory = chip->memory;
+    cpu->no_cycles = cycles;
+    cpu->dcache = APEX_cache_create(config, i, chip->coherence);
+    chip->core[i].cpu = cpu;
+    chip->core[i].chip = chip;
+    if (!cpu->dcache)
+    {
+      free_chip(chip);
+      return -1;
+    }
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (chip->quantum)
+  {
+    run_threads(chip);
+  }
+  else
+  {
+    run_lockstep(chip);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  print_report(chip, (end.tv_sec - start.tv_sec) +
+                         (end.tv_nsec - start.tv_nsec) / 1e9);
+  int status = APEX_memory_image_dump(config, chip->memory);
+  free_chip(chip);
+  return status;
+}
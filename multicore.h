@@ -0,0 +1,23 @@
+#ifndef _APEX_MULTICORE_H_
+#define _APEX_MULTICORE_H_
+/*
+ *  multicore.h
+ *  Chip of several APEX cores with private data caches over one
+ *  coherent shared data memory
+ */
+#include "cpu.h"
+
+/* Bounded by the sharer bitmask of the coherence directory */
+#define APEX_MAX_CORES 32
+
+/*
+ * Runs cores CPUs for at most cycles cycles each and prints per core
+ * and chip stats. Core i runs programs[i], or the last program when
+ * fewer programs than cores are given. config->quantum picks between
+ * one host thread per core synchronised every quantum cycles and a
+ * single threaded lockstep run (quantum 0). Returns 0 on success.
+ */
+int APEX_multicore_run(const char *const *programs, int program_count,
+                       int cores, int cycles, const APEX_Config *config);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ *  prefetch.c
+ *  Stride and stream prefetchers. A new policy is one train function
+ *  and a row in policies[], indexed by APEX_Config.prefetch.
+ */
+#include <stdlib.h>
+#include "prefetch.h"
+#include "cache.h"
+
+/* Adds a line once, keeps the candidates in data memory */
+static int add_line(APEX_Prefetcher *prefetcher, int *lines, int count, int line)
+{
+  int last_line = (4096 - 1) / prefetcher->line_words;
+  if (line < 0 || line > last_line)
+  {
+    return count;
+  }
+  for (int i = 0; i < count; ++i)
+  {
+    if (lines[i] == line)
+    {
+      return count;
+    }
+  }
+  lines[count] = line;
+  return count + 1;
+}
+
+/*
+ * Learns the address stride of each load and store pc. Once the same
+ * stride was seen twice in a row, fetches the lines distance to
+ * distance + degree - 1 strides ahead.
+ */
+static int stride_train(APEX_Prefetcher *prefetcher, int pc, int address,
+                        int miss, int *lines)
+{
+  APEX_Stride_Entry *entry = &prefetcher->stride[(pc / 4) % APEX_STRIDE_TABLE_SIZE];
+  int count = 0;
+
+  (void)miss;
+  if (entry->pc != pc)
+  {
+    entry->pc = pc;
+    entry->last_address = address;
+    entry->stride = 0;
+    entry->confidence = 0;
+    return 0;
+  }
+
+  int delta = address - entry->last_address;
+  entry->last_address = address;
+  if (delta == 0)
+  {
+    return 0;
+  }
+  if (delta == entry->stride)
+  {
+    if (entry->confidence < 3)
+      entry->confidence++;
+  }
+  else
+  {
+    entry->stride = delta;
+    entry->confidence = 0;
+    return 0;
+  }
+
+  int own_line = address / prefetcher->line_words;
+  for (int i = 0; i < prefetcher->degree; ++i)
+  {
+    int target = address + entry->stride * (prefetcher->distance + i);
+    if (target / prefetcher->line_words != own_line)
+      count = add_line(prefetcher, lines, count, target / prefetcher->line_words);
+  }
+  return count;
+}
+
+/*
+ * Next-N-line stream: a miss, or the first use of a line it brought
+ * in, fetches degree lines starting distance lines past it, in the
+ * direction the misses are moving.
+ */
+static int stream_train(APEX_Prefetcher *prefetcher, int pc, int address,
+                        int miss, int *lines)
+{
+  int line = address / prefetcher->line_words;
+  int count = 0;
+
+  (void)pc;
+  if (!miss)
+  {
+    return 0;
+  }
+  if (line != prefetcher->stream_line && prefetcher->stream_line >= 0)
+  {
+    prefetcher->stream_direction = line > prefetcher->stream_line ? 1 : -1;
+  }
+  prefetcher->stream_line = line;
+  for (int i = 0; i < prefetcher->degree; ++i)
+  {
+    count = add_line(prefetcher, lines, count,
+                     line + prefetcher->stream_direction * (prefetcher->distance + i));
+  }
+  return count;
+}
+
+static const APEX_Prefetch_Policy policies[] = {
+    {"none", NULL},
+    {"stride", stride_train},
+    {"stream", stream_train},
+};
+
+APEX_Prefetcher *APEX_prefetcher_create(const APEX_Config *config)
+{
+  if (config->prefetch <= APEX_PREFETCH_NONE ||
+      config->prefetch >= (int)(sizeof(policies) / sizeof(policies[0])))
+  {
+    return NULL;
+  }
+  APEX_Prefetcher *prefetcher = calloc(1, sizeof(*prefetcher));
+  if (!prefetcher)
+  {
+    return NULL;
+  }
+  prefetcher->policy = &policies[config->prefetch];
+  prefetcher->degree = config->prefetch_degree;
+  prefetcher->distance = config->prefetch_distance;
+  prefetcher->line_words = config->dcache_line;
+  for (int i = 0; i < APEX_STRIDE_TABLE_SIZE; ++i)
+  {
+    prefetcher->stride[i].pc = -1;
+  }
+  prefetcher->stream_line = -1;
+  prefetcher->stream_direction = 1;
+  return prefetcher;
+}
+
+void APEX_prefetcher_free(APEX_Prefetcher *prefetcher)
+{
+  free(prefetcher);
+}
+
+/* Runs the policy on one demand access, returns the lines to fetch */
+int APEX_prefetcher_train(APEX_Prefetcher *prefetcher, int pc, int address,
+                          int miss, int *lines)
+{
+  int count = prefetcher->policy->train(prefetcher, pc, address, miss, lines);
+  if (count > 0)
+  {
+    prefetcher->triggers++;
+    prefetcher->candidates += count;
+  }
+  return count;
+}
+
+/*
+ * Coverage is the share of would-be misses a prefetch served, accuracy
+ * the share of issued prefetches used before eviction and timeliness
+ * the share of used prefetches that arrived before the access.
+ */
+void APEX_prefetch_report(const APEX_Prefetcher *prefetcher,
+                          const struct APEX_Cache *cache, FILE *out)
+{
+  long useful = cache->prefetch_useful;
+  long would_miss = useful + cache->misses;
+
+  fprintf(out, "(apex) >> Prefetch %s (degree %d, distance %d): %ld triggers, "
+               "%ld issued (%ld already cached), %ld used (%ld late), %ld unused\n",
+          prefetcher->policy->name, prefetcher->degree, prefetcher->distance,
+          prefetcher->triggers, cache->prefetches,
+          prefetcher->candidates - cache->prefetches, useful,
+          cache->prefetch_late, cache->prefetch_unused);
+  fprintf(out, "(apex) >> Prefetch coverage %.1f%%, accuracy %.1f%%, "
+               "timeliness %.1f%%, %ld miss cycles hidden\n",
+          would_miss ? 100.0 * useful / would_miss : 0.0,
+          cache->prefetches ? 100.0 * useful / cache->prefetches : 0.0,
+          useful ? 100.0 * (useful - cache->prefetch_late) / useful : 0.0,
+          cache->prefetch_hidden);
+}
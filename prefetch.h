@@ -0,0 +1,67 @@
+#ifndef _APEX_PREFETCH_H_
+#define _APEX_PREFETCH_H_
+/*
+ *  prefetch.h
+ *  Hardware prefetchers on the data cache. Each policy watches the
+ *  demand accesses of the memory stage and names lines to bring in
+ *  ahead of use; the cache tracks whether they arrived in time and
+ *  were used before eviction.
+ */
+#include <stdio.h>
+#include "cpu.h"
+
+#define APEX_STRIDE_TABLE_SIZE 64
+#define APEX_PREFETCH_MAX_DEGREE 16
+
+/* One entry of the PC indexed stride table */
+typedef struct APEX_Stride_Entry
+{
+  int pc;          // Load or store owning the entry, -1 when empty
+  int last_address;
+  int stride;
+  int confidence;  // Times in a row the stride repeated, saturates at 3
+} APEX_Stride_Entry;
+
+typedef struct APEX_Prefetcher APEX_Prefetcher;
+
+/*
+ * A prefetch policy. train sees every demand access, miss is set for
+ * a miss or the first use of a prefetched line, and fills lines with
+ * at most degree line numbers to fetch. Returns how many.
+ */
+typedef struct APEX_Prefetch_Policy
+{
+  const char *name;
+  int (*train)(APEX_Prefetcher *prefetcher, int pc, int address, int miss,
+               int *lines);
+} APEX_Prefetch_Policy;
+
+struct APEX_Prefetcher
+{
+  const APEX_Prefetch_Policy *policy;
+  int degree;      // Lines requested per trigger
+  int distance;    // How far ahead the first one is, in strides or lines
+  int line_words;
+
+  /* Policy state */
+  APEX_Stride_Entry stride[APEX_STRIDE_TABLE_SIZE];
+  int stream_line; // Last line that triggered the stream prefetcher
+  int stream_direction;
+
+  /* Stats */
+  long triggers;   // Accesses that produced candidates
+  long candidates; // Lines named, issued or already present
+};
+
+/* NULL when config->prefetch is APEX_PREFETCH_NONE */
+APEX_Prefetcher *APEX_prefetcher_create(const APEX_Config *config);
+
+void APEX_prefetcher_free(APEX_Prefetcher *prefetcher);
+
+int APEX_prefetcher_train(APEX_Prefetcher *prefetcher, int pc, int address,
+                          int miss, int *lines);
+
+void APEX_prefetch_report(const APEX_Prefetcher *prefetcher,
+                          const struct APEX_Cache *cache, FILE *out);
+
+#endif
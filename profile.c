@@ -0,0 +1,101 @@
+/*
+ *  profile.c
+ *  Report of where the simulator spends host time, see profile.h
+ */
+#include "cpu.h"
+#include "profile.h"
+
+#ifdef APEX_PROFILE
+
+static const char *stage_names[APEX_PROF_STAGES] = {
+    "retire", "mem", "branch", "mulfu3", "mulfu2", "mulfu1",
+    "intfu2", "intfu1", "decode", "fetch"};
+
+static const char *class_names[APEX_PROF_CLASSES] = {
+    "bubble", "alu", "mul", "mem", "branch", "other"};
+
+uint64_t APEX_profile_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+int APEX_profile_class(int op)
+{
+  switch (op)
+  {
+  case APEX_OP_MOVC:
+  case APEX_OP_ADD:
+  case APEX_OP_SUB:
+  case APEX_OP_AND:
+  case APEX_OP_OR:
+  case APEX_OP_EXOR:
+  case APEX_OP_ADDL:
+  case APEX_OP_SUBL:
+    return APEX_PROF_ALU;
+  case APEX_OP_MUL:
+    return APEX_PROF_MULTIPLY;
+  case APEX_OP_LOAD:
+  case APEX_OP_LDR:
+  case APEX_OP_STORE:
+  case APEX_OP_STR:
+    return APEX_PROF_MEMORY;
+  case APEX_OP_BZ:
+  case APEX_OP_BNZ:
+  case APEX_OP_JUMP:
+    return APEX_PROF_BRANCH;
+  default:
+    return APEX_PROF_OTHER;
+  }
+}
+
+void APEX_profile_report(const APEX_Profile *profile, long retired, FILE *out)
+{
+  /* Ticks are TSC cycles on x86, scale them by the span of the run */
+  double ns_per_tick = profile->run_ticks
+                           ? (double)profile->run_ns / profile->run_ticks
+                           : 1.0;
+  double cycles = profile->cycles ? profile->cycles : 1;
+  double instructions = retired ? retired : 1;
+  uint64_t stage_total = 0;
+
+  fprintf(out, "=======HOST PROFILE==========\n");
+  fprintf(out, "%-8s %10s %10s", "stage", "ns/cycle", "ns/instr");
+  for (int c = 0; c < APEX_PROF_CLASSES; ++c)
+  {
+    fprintf(out, " %10s", class_names[c]);
+  }
+  fprintf(out, "\n");
+
+  for (int s = 0; s < APEX_PROF_STAGES; ++s)
+  {
+    uint64_t ticks = 0;
+    for (int c = 0; c < APEX_PROF_CLASSES; ++c)
+    {
+      ticks += profile->ticks[s][c];
+    }
+    stage_total += ticks;
+    fprintf(out, "%-8s %10.2f %10.2f", stage_names[s],
+            ticks * ns_per_tick / cycles, ticks * ns_per_tick / instructions);
+
+    /* Per class, ns per call of the stage on that kind of instruction */
+    for (int c = 0; c < APEX_PROF_CLASSES; ++c)
+    {
+      uint64_t calls = profile->calls[s][c];
+      fprintf(out, " %10.2f",
+              calls ? profile->ticks[s][c] * ns_per_tick / calls : 0.0);
+    }
+    fprintf(out, "\n");
+  }
+
+  uint64_t loop = profile->run_ticks > stage_total ? profile->run_ticks - stage_total : 0;
+  fprintf(out, "%-8s %10.2f %10.2f\n", "loop", loop * ns_per_tick / cycles,
+          loop * ns_per_tick / instructions);
+  fprintf(out, "%-8s %10.2f %10.2f\n", "total", profile->run_ns / cycles,
+          profile->run_ns / instructions);
+  fprintf(out, "%ld cycles, %ld instructions, %.3f ms host, class columns are ns/call\n",
+          profile->cycles, retired, profile->run_ns / 1e6);
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef _APEX_PROFILE_H_
+#define _APEX_PROFILE_H_
+/*
+ *  profile.h
+ *  Host side profiler of the simulator itself. Built only with
+ *  -DAPEX_PROFILE (make profile), otherwise every hook expands to the
+ *  plain call and APEX_CPU carries no profile state.
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+/* Timed parts of a cycle, in the order APEX_cpu_cycle calls them */
+enum
+{
+  APEX_PROF_RETIRE,
+  APEX_PROF_MEM,
+  APEX_PROF_BRANCH_UNIT,
+  APEX_PROF_MULFU3,
+  APEX_PROF_MULFU2,
+  APEX_PROF_MULFU1,
+  APEX_PROF_INTFU2,
+  APEX_PROF_INTFU1,
+  APEX_PROF_DECODE,
+  APEX_PROF_FETCH,
+  APEX_PROF_STAGES
+};
+
+/* Opcode classes of the instruction a stage worked on */
+enum
+{
+  APEX_PROF_BUBBLE,
+  APEX_PROF_ALU,
+  APEX_PROF_MULTIPLY,
+  APEX_PROF_MEMORY,
+  APEX_PROF_BRANCH,
+  APEX_PROF_OTHER,
+  APEX_PROF_CLASSES
+};
+
+typedef struct APEX_Profile
+{
+  uint64_t ticks[APEX_PROF_STAGES][APEX_PROF_CLASSES];
+  uint64_t calls[APEX_PROF_STAGES][APEX_PROF_CLASSES];
+  uint64_t run_ticks;    // Whole APEX_cpu_simulate calls
+  uint64_t run_ns;       // Same span on the monotonic clock, to scale ticks
+  long cycles;
+} APEX_Profile;
+
+#ifdef APEX_PROFILE
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t APEX_profile_ticks(void)
+{
+  return __rdtsc();
+}
+#else
+static inline uint64_t APEX_profile_ticks(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+#endif
+
+uint64_t APEX_profile_ns(void);
+
+int APEX_profile_class(int op);
+
+/* Times call, charged to stage and to the class of the uop it works on */
+#define APEX_PROFILE_STAGE(cpu, stage, uop, call)                       \
+  do                                                                    \
+  {                                                                     \
+    int apex_class_ = APEX_profile_class((cpu)->uop_pool[(uop)].op);    \
+    if ((uop) == APEX_UOP_BUBBLE)                                       \
+      apex_class_ = APEX_PROF_BUBBLE;                                   \
+    uint64_t apex_start_ = APEX_profile_ticks();                        \
+    call;                                                               \
+    (cpu)->profile.ticks[stage][apex_class_] +=                         \
+        APEX_profile_ticks() - apex_start_;                             \
+    (cpu)->profile.calls[stage][apex_class_]++;                         \
+  } while (0)
+
+/* Prints ns per cycle and per instruction of every stage and class */
+void APEX_profile_report(const APEX_Profile *profile, long retired, FILE *out);
+
+#else
+
+#define APEX_PROFILE_STAGE(cpu, stage, uop, call) call
+
+#endif
+
+#endif
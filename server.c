@@ -0,0 +1,507 @@
+/*
+ *  server.c
+ *  Long running simulation server on a local Unix socket. Parsed
+ *  programs stay cached between jobs and jobs run on a worker pool,
+ *  so a batch of runs pays process start and file parsing once.
+ *
+ *  Requests, one per line:
+ *    RUN <id> <program> <cycles> [key=value ...]  queue a job
+ *    WAIT                                         reply "DONE <n>" once every
+ *                                                 job queued so far finished
+ *    QUIT                                         close the connection
+ *    SHUTDOWN                                     finish queued jobs and exit
+ *
+ *  Every job answers with one line, in completion order:
+ *    <id> OK cycles=<n> retired=<n> ipc=<x> [cosim=ok|diverged@<n>]
+ *    <id> ERR <reason>
+ *  The line is all a job reports, so digest= and mem_dump= are refused.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cosim.h"
+#include "cpu.h"
+#include "server.h"
+
+/* Parsed program shared read-only by every job that runs it */
+typedef struct Cached_Program
+{
+  char path[PATH_MAX];
+  struct timespec mtime;  // Modification time seen when parsed
+  off_t size;             // File size seen when parsed
+  APEX_Instruction *code_memory;
+  int code_memory_size;
+  int refs;               // Jobs using it, plus one while it is cached
+  struct Cached_Program *next;
+} Cached_Program;
+
+/* Client connection, kept alive until its last job has answered */
+typedef struct Connection
+{
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  int pending;  // Jobs queued and not answered yet
+  int finished; // Jobs answered since the last WAIT
+} Connection;
+
+typedef struct Job
+{
+  Connection *conn;
+  char id[64];
+  char path[PATH_MAX];
+  int cycles;
+  APEX_Config config;
+  struct Job *next;
+} Job;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Cached_Program *cache;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static Job *queue_head;
+static Job *queue_tail;
+static int stopping;
+
+static int listen_fd = -1;
+
+static void program_release(Cached_Program *program)
+{
+  pthread_mutex_lock(&cache_lock);
+  int refs = --program->refs;
+  pthread_mutex_unlock(&cache_lock);
+  if (refs == 0)
+  {
+    free(program->code_memory);
+    free(program);
+  }
+}
+
+/*
+ * Returns the parsed program for path, parsing it again if the file
+ * changed since it was cached. Parsing happens under cache_lock so a
+ * burst of jobs for a new program parses it only once.
+ */
+static Cached_Program *program_acquire(const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) != 0)
+  {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  Cached_Program **link = &cache;
+  while (*link && strcmp((*link)->path, path) != 0)
+  {
+    link = &(*link)->next;
+  }
+
+  Cached_Program *program = *link;
+  if (program &&
+      program->size == st.st_size &&
+      program->mtime.tv_sec == st.st_mtim.tv_sec &&
+      program->mtime.tv_nsec == st.st_mtim.tv_nsec)
+  {
+    program->refs++;
+    pthread_mutex_unlock(&cache_lock);
+    return program;
+  }
+
+  /* Stale entry, drop it from the cache, running jobs keep their copy */
+  if (program)
+  {
+    *link = program->next;
+    if (--program->refs == 0)
+    {
+      free(program->code_memory);
+      free(program);
+    }
+  }
+
+  program = calloc(1, sizeof(*program));
+  if (program)
+  {
+    program->code_memory =
+        create_code_memory(path, &program->code_memory_size);
+  }
+  if (!program || !program->code_memory)
+  {
+    pthread_mutex_unlock(&cache_lock);
+    free(program);
+    return NULL;
+  }
+
+  snprintf(program->path, sizeof(program->path), "%s", path);
+  program->mtime = st.st_mtim;
+  program->size = st.st_size;
+  program->refs = 2;
+  program->next = cache;
+  cache = program;
+  pthread_mutex_unlock(&cache_lock);
+  return program;
+}
+
+static void write_all(int fd, const char *buffer, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, buffer, len);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return;
+    }
+    buffer += n;
+    len -= n;
+  }
+}
+
+static void job_reply(Job *job, const char *line)
+{
+  Connection *conn = job->conn;
+  pthread_mutex_lock(&conn->lock);
+  write_all(conn->fd, line, strlen(line));
+  conn->pending--;
+  conn->finished++;
+  pthread_cond_broadcast(&conn->idle);
+  pthread_mutex_unlock(&conn->lock);
+}
+
+static void job_run(Job *job)
+{
+  char line[320];
+  Cached_Program *program = program_acquire(job->path);
+  if (!program)
+  {
+    snprintf(line, sizeof(line), "%s ERR cannot load program\n", job->id);
+    job_reply(job, line);
+    return;
+  }
+
+  APEX_CPU *cpu = APEX_cpu_create(program->code_memory,
+                                  program->code_memory_size, &job->config);
+  if (!cpu)
+  {
+    program_release(program);
+    snprintf(line, sizeof(line), "%s ERR out of memory\n", job->id);
+    job_reply(job, line);
+    return;
+  }
+
+  int cycles = APEX_cpu_simulate(cpu, job->cycles);
+  int len = snprintf(line, sizeof(line), "%s OK cycles=%d retired=%d ipc=%.4f",
+                     job->id, cycles, cpu->ins_completed,
+                     cycles ? (double)cpu->ins_completed / cycles : 0.0);
+  if (cpu->cosim)
+  {
+    long divergence = APEX_cosim_finish(cpu->cosim, NULL);
+    cpu->cosim = NULL;
+    if (divergence < 0)
+    {
+      len += snprintf(line + len, sizeof(line) - len, " cosim=ok");
+    }
+    else
+    {
+      len += snprintf(line + len, sizeof(line) - len, " cosim=diverged@%ld",
+                      divergence);
+    }
+  }
+  snprintf(line + len, sizeof(line) - len, "\n");
+
+  APEX_cpu_stop(cpu);
+  program_release(program);
+  job_reply(job, line);
+}
+
+static void *worker_main(void *arg)
+{
+  (void)arg;
+  for (;;)
+  {
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head && !stopping)
+    {
+      pthread_cond_wait(&queue_ready, &queue_lock);
+    }
+    Job *job = queue_head;
+    if (!job)
+    {
+      pthread_mutex_unlock(&queue_lock);
+      return NULL;
+    }
+    queue_head = job->next;
+    if (!queue_head)
+    {
+      queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    job_run(job);
+    free(job);
+  }
+}
+
+static void job_submit(Job *job)
+{
+  pthread_mutex_lock(&job->conn->lock);
+  job->conn->pending++;
+  pthread_mutex_unlock(&job->conn->lock);
+
+  pthread_mutex_lock(&queue_lock);
+  job->next = NULL;
+  if (queue_tail)
+  {
+    queue_tail->next = job;
+  }
+  else
+  {
+    queue_head = job;
+  }
+  queue_tail = job;
+  pthread_cond_signal(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/* Parses "RUN <id> <program> <cycles> [key=value ...]" into a job */
+static Job *parse_run(Connection *conn, char *args, char *error, size_t len)
+{
+  char *save;
+  char *id = strtok_r(args, " \t", &save);
+  char *path = strtok_r(NULL, " \t", &save);
+  char *cycles = strtok_r(NULL, " \t", &save);
+  if (!id || !path || !cycles)
+  {
+    snprintf(error, len, "- ERR usage RUN <id> <program> <cycles>\n");
+    return NULL;
+  }
+
+  Job *job = calloc(1, sizeof(*job));
+  if (!job)
+  {
+    snprintf(error, len, "%s ERR out of memory\n", id);
+    return NULL;
+  }
+  job->conn = conn;
+  snprintf(job->id, sizeof(job->id), "%s", id);
+  snprintf(job->path, sizeof(job->path), "%s", path);
+  job->cycles = atoi(cycles);
+  APEX_config_default(&job->config);
+
+  if (job->cycles <= 0)
+  {
+    snprintf(error, len, "%s ERR cycles must be positive\n", job->id);
+    free(job);
+    return NULL;
+  }
+
+  char *option;
+  while ((option = strtok_r(NULL, " \t", &save)) != NULL)
+  {
+    if (APEX_config_set(&job->config, option) != 0)
+    {
+      snprintf(error, len, "%s ERR bad option %s\n", job->id, option);
+      free(job);
+      return NULL;
+    }
+  }
+
+  /* A job answers with its reply line only, it writes no digest or memory image */
+  const char *unsupported = job->config.digest        ? "digest"
+                            : job->config.mem_dump[0] ? "mem_dump"
+                                                      : NULL;
+  if (unsupported)
+  {
+    snprintf(error, len, "%s ERR %s is not supported in a job\n", job->id, unsupported);
+    free(job);
+    return NULL;
+  }
+  return job;
+}
+
+static void *connection_main(void *arg)
+{
+  Connection *conn = arg;
+  FILE *in = fdopen(dup(conn->fd), "r");
+  char *line = NULL;
+  size_t len = 0;
+  char reply[PATH_MAX + 128];
+
+  while (in && getline(&line, &len, in) != -1)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (strncmp(line, "RUN ", 4) == 0)
+    {
+      Job *job = parse_run(conn, line + 4, reply, sizeof(reply));
+      if (job)
+      {
+        job_submit(job);
+        continue;
+      }
+      pthread_mutex_lock(&conn->lock);
+      write_all(conn->fd, reply, strlen(reply));
+      pthread_mutex_unlock(&conn->lock);
+    }
+    else if (strcmp(line, "WAIT") == 0)
+    {
+      pthread_mutex_lock(&conn->lock);
+      while (conn->pending > 0)
+      {
+        pthread_cond_wait(&conn->idle, &conn->lock);
+      }
+      snprintf(reply, sizeof(reply), "DONE %d\n", conn->finished);
+      conn->finished = 0;
+      write_all(conn->fd, reply, strlen(reply));
+      pthread_mutex_unlock(&conn->lock);
+    }
+    else if (strcmp(line, "QUIT") == 0)
+    {
+      break;
+    }
+    else if (strcmp(line, "SHUTDOWN") == 0)
+    {
+      shutdown(listen_fd, SHUT_RDWR);
+      break;
+    }
+    else if (line[0] != '\0')
+    {
+      snprintf(reply, sizeof(reply), "- ERR unknown request\n");
+      pthread_mutex_lock(&conn->lock);
+      write_all(conn->fd, reply, strlen(reply));
+      pthread_mutex_unlock(&conn->lock);
+    }
+  }
+
+  /* Queued jobs still reference the connection */
+  pthread_mutex_lock(&conn->lock);
+  while (conn->pending > 0)
+  {
+    pthread_cond_wait(&conn->idle, &conn->lock);
+  }
+  pthread_mutex_unlock(&conn->lock);
+
+  free(line);
+  if (in)
+  {
+    fclose(in);
+  }
+  close(conn->fd);
+  pthread_mutex_destroy(&conn->lock);
+  pthread_cond_destroy(&conn->idle);
+  free(conn);
+  return NULL;
+}
+
+int APEX_serve(const char *socket_path, int workers)
+{
+  struct sockaddr_un addr;
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "APEX_Error : Socket path too long\n");
+    return 1;
+  }
+  if (workers <= 0)
+  {
+    workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers <= 0)
+  {
+    workers = 1;
+  }
+
+  /* A client going away must not kill the server */
+  signal(SIGPIPE, SIG_IGN);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+  {
+    perror("APEX_Error : socket");
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 16) != 0)
+  {
+    perror("APEX_Error : bind");
+    close(listen_fd);
+    return 1;
+  }
+
+  pthread_t *pool = calloc(workers, sizeof(*pool));
+  if (!pool)
+  {
+    close(listen_fd);
+    return 1;
+  }
+  for (int i = 0; i < workers; ++i)
+  {
+    pthread_create(&pool[i], NULL, worker_main, NULL);
+  }
+  fprintf(stderr, "APEX_SERVER : Listening on %s with %d workers\n",
+          socket_path, workers);
+
+  for (;;)
+  {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+
+    Connection *conn = calloc(1, sizeof(*conn));
+    if (!conn)
+    {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->idle, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, connection_main, conn) != 0)
+    {
+      close(fd);
+      free(conn);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  /* Workers drain the queue before they exit */
+  pthread_mutex_lock(&queue_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+  for (int i = 0; i < workers; ++i)
+  {
+    pthread_join(pool[i], NULL);
+  }
+  free(pool);
+
+  close(listen_fd);
+  unlink(socket_path);
+  fprintf(stderr, "APEX_SERVER : Stopped\n");
+  return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef _APEX_SERVER_H_
+#define _APEX_SERVER_H_
+
+/*
+ * Serves simulation jobs on a local Unix socket until a client sends
+ * SHUTDOWN. A worker count of 0 uses one worker per online host core.
+ */
+int APEX_serve(const char *socket_path, int workers);
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ *  simpoint.c
+ *  SimPoint style sampling. A trace of the whole run is recorded once,
+ *  every interval of N instructions becomes a basic block vector (the
+ *  instructions executed in each block, blocks end on BZ, BNZ and
+ *  JUMP), the vectors are clustered with k-means and the interval
+ *  nearest each centroid is replayed from the trace through the
+ *  pipeline. Each point's CPI is weighted by the share of instructions
+ *  its cluster covers.
+ */
+#include <float.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simpoint.h"
+#include "trace.h"
+
+#define KMEANS_MAX_ITERATIONS 100
+
+typedef struct SimPoint
+{
+  int interval;     // Index of the chosen interval
+  double weight;    // Share of all instructions its cluster covers
+  double cpi;
+} SimPoint;
+
+static double now_seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int is_branch(int op)
+{
+  return op == APEX_OP_BZ || op == APEX_OP_BNZ || op == APEX_OP_JUMP;
+}
+
+/*
+ * Streams the trace into one row of dims counts per interval, rows are
+ * normalised so intervals of different length compare. Returns the
+ * number of intervals, sizes gets each interval's instruction count.
+ */
+static int collect_bbvs(const char *path, long interval, int dims,
+                        double **bbvs, long **sizes)
+{
+  APEX_Trace_Reader *reader = APEX_trace_reader_open(path);
+  APEX_Trace_Record record;
+  int capacity = 16;
+  int count = 0;
+  int block = 0;    // Code index of the current block's first instruction
+  int new_block = 1;
+  long in_interval = 0;
+
+  if (!reader)
+  {
+    return -1;
+  }
+  *bbvs = NULL;
+  *sizes = NULL;
+
+  while (APEX_trace_reader_next(reader, &record))
+  {
+    if (in_interval == 0)
+    {
+      if (count == 0 || count == capacity)
+      {
+        capacity = count ? capacity * 2 : capacity;
+        *bbvs = realloc(*bbvs, sizeof(double) * capacity * dims);
+        *sizes = realloc(*sizes, sizeof(long) * capacity);
+        if (!*bbvs || !*sizes)
+        {
+          APEX_trace_reader_close(reader);
+          return -1;
+        }
+      }
+      memset(*bbvs + (size_t)count * dims, 0, sizeof(double) * dims);
+      count++;
+    }
+    if (new_block)
+    {
+      block = get_code_index(record.pc);
+      new_block = 0;
+    }
+    if (block >= 0 && block < dims)
+    {
+      (*bbvs)[(size_t)(count - 1) * dims + block] += 1;
+    }
+    new_block = is_branch(record.op);
+    (*sizes)[count - 1] = ++in_interval;
+    if (in_interval == interval)
+    {
+      in_interval = 0;
+    }
+  }
+  APEX_trace_reader_close(reader);
+
+  for (int i = 0; i < count; ++i)
+  {
+    for (int d = 0; d < dims; ++d)
+    {
+      (*bbvs)[(size_t)i * dims + d] /= (*sizes)[i];
+    }
+  }
+  return count;
+}
+
+static double distance(const double *a, const double *b, int dims)
+{
+  double sum = 0;
+  for (int d = 0; d < dims; ++d)
+  {
+    sum += (a[d] - b[d]) * (a[d] - b[d]);
+  }
+  return sum;
+}
+
+/*
+ * k-means over the interval vectors, seeded farthest first from
+ * interval 0 so a run is reproducible. Fills cluster with the
+ * cluster of each interval, returns the number of clusters used.
+ */
+static int kmeans(const double *bbvs, int count, int dims, int k,
+                  int *cluster, double *centroids)
+{
+  if (k > count)
+  {
+    k = count;
+  }
+
+  memcpy(centroids, bbvs, sizeof(double) * dims);
+  for (int c = 1; c < k; ++c)
+  {
+    int farthest = 0;
+    double best = -1;
+    for (int i = 0; i < count; ++i)
+    {
+      double nearest = DBL_MAX;
+      for (int j = 0; j < c; ++j)
+      {
+        double d = distance(&bbvs[(size_t)i * dims], &centroids[(size_t)j * dims], dims);
+        if (d < nearest)
+        {
+          nearest = d;
+        }
+      }
+      if (nearest > best)
+      {
+        best = nearest;
+        farthest = i;
+      }
+    }
+    memcpy(&centroids[(size_t)c * dims], &bbvs[(size_t)farthest * dims],
+           sizeof(double) * dims);
+  }
+
+  for (int i = 0; i < count; ++i)
+  {
+    cluster[i] = -1;
+  }
+  for (int iteration = 0; iteration < KMEANS_MAX_ITERATIONS; ++iteration)
+  {
+    int changed = 0;
+    for (int i = 0; i < count; ++i)
+    {
+      int nearest = 0;
+      double best = DBL_MAX;
+      for (int c = 0; c < k; ++c)
+      {
+        double d = distance(&bbvs[(size_t)i * dims], &centroids[(size_t)c * dims], dims);
+        if (d < best)
+        {
+          best = d;
+          nearest = c;
+        }
+      }
+      changed |= cluster[i] != nearest;
+      cluster[i] = nearest;
+    }
+    if (!changed)
+    {
+      break;
+    }
+
+    /* An emptied cluster keeps its old centroid */
+    for (int c = 0; c < k; ++c)
+    {
+      int members = 0;
+      double *centroid = &centroids[(size_t)c * dims];
+      for (int i = 0; i < count; ++i)
+      {
+        if (cluster[i] != c)
+        {
+          continue;
+        }
+        if (members++ == 0)
+        {
+          memset(centroid, 0, sizeof(double) * dims);
+        }
+        for (int d = 0; d < dims; ++d)
+        {
+          centroid[d] += bbvs[(size_t)i * dims + d];
+        }
+      }
+      for (int d = 0; members && d < dims; ++d)
+      {
+        centroid[d] /= members;
+      }
+    }
+  }
+  return k;
+}
+
+/* Times count instructions of the trace from start, returns cycles per instruction */
+static double time_window(const char *path, long start, long count,
+                          const APEX_Config *config, long *retired)
+{
+  APEX_CPU *cpu = APEX_cpu_init_trace(path, config);
+  if (!cpu)
+  {
+    return -1;
+  }
+  APEX_trace_reader_window(cpu->trace, start, count);
+  APEX_cpu_simulate(cpu, INT_MAX);
+  double cpi = cpu->ins_completed ? (double)cpu->clock / cpu->ins_completed : 0;
+  *retired = cpu->ins_completed;
+  APEX_cpu_stop(cpu);
+  return cpi;
+}
+
+int APEX_simpoint_run(const char *filename, long interval, const APEX_Config *config)
+{
+  char path[] = "/tmp/apex_simpoint_XXXXXX";
+  double *bbvs = NULL;
+  long *sizes = NULL;
+  int *cluster = NULL;
+  double *centroids = NULL;
+  int status = -1;
+  int size = 0;
+
+  if (interval <= 0)
+  {
+    fprintf(stderr, "APEX_Error : Interval must be positive\n");
+    return -1;
+  }
+
+  APEX_Instruction *code = create_code_memory(filename, &size);
+  if (!code)
+  {
+    fprintf(stderr, "APEX_Error : Unable to load %s\n", filename);
+    return -1;
+  }
+
+  int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    fprintf(stderr, "APEX_Error : Unable to create a trace file\n");
+    free(code);
+    return -1;
+  }
+  close(fd);
+
+  double start = now_seconds();
+  long total = APEX_trace_record_program(code, size, path, 0, config);
+  free(code);
+  int count = total > 0 ? collect_bbvs(path, interval, size, &bbvs, &sizes) : -1;
+  if (count <= 0)
+  {
+    fprintf(stderr, "APEX_Error : No instructions to sample\n");
+    goto out;
+  }
+
+  cluster = malloc(sizeof(int) * count);
+  centroids = malloc(sizeof(double) * APEX_SIMPOINT_MAX_K * size);
+  if (!cluster || !centroids)
+  {
+    goto out;
+  }
+  int k = kmeans(bbvs, count, size, config->simpoint_k, cluster, centroids);
+  double profile_time = now_seconds() - start;
+
+  /* The member nearest its centroid stands for the whole cluster */
+  SimPoint points[APEX_SIMPOINT_MAX_K];
+  int used = 0;
+  for (int c = 0; c < k; ++c)
+  {
+    long members = 0;
+    double best = DBL_MAX;
+    int chosen = -1;
+    for (int i = 0; i < count; ++i)
+    {
+      if (cluster[i] != c)
+      {
+        continue;
+      }
+      members += sizes[i];
+      double d = distance(&bbvs[(size_t)i * size], &centroids[(size_t)c * size], size);
+      if (d < best)
+      {
+        best = d;
+        chosen = i;
+      }
+    }
+    if (chosen >= 0)
+    {
+      points[used].interval = chosen;
+      points[used].weight = (double)members / total;
+      used++;
+    }
+  }
+
+  start = now_seconds();
+  double weighted = 0;
+  long detailed = 0;
+  printf("(apex) >> %d intervals of %ld instructions, %d simulation points\n",
+         count, interval, used);
+  printf("%-6s %-9s %-11s %-7s %-7s\n", "point", "interval", "start", "weight", "CPI");
+  for (int p = 0; p < used; ++p)
+  {
+    long retired = 0;
+    points[p].cpi = time_window(path, points[p].interval * interval,
+                                sizes[points[p].interval], config, &retired);
+    if (points[p].cpi < 0)
+    {
+      goto out;
+    }
+    weighted += points[p].weight * points[p].cpi;
+    detailed += retired;
+    printf("%-6d %-9d %-11ld %-7.3f %-7.3f\n", p, points[p].interval,
+           points[p].interval * interval, points[p].weight, points[p].cpi);
+  }
+  double sample_time = now_seconds() - start;
+  printf("Weighted CPI : %.4f, %ld of %ld instructions timed\n", weighted, detailed, total);
+  printf("Host : %.3f s profiling, %.3f s timing\n", profile_time, sample_time);
+
+  if (config->simpoint_full)
+  {
+    long retired = 0;
+    start = now_seconds();
+    double full = time_window(path, 0, 0, config, &retired);
+    printf("Full CPI : %.4f over %ld instructions, error %.2f%%, %.3f s\n", full,
+           retired, full > 0 ? 100.0 * (weighted - full) / full : 0.0,
+           now_seconds() - start);
+  }
+  status = 0;
+
+out:
+  unlink(path);
+  free(bbvs);
+  free(sizes);
+  free(cluster);
+  free(centroids);
+  return status;
+}
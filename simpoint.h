@@ -0,0 +1,23 @@
+#ifndef _APEX_SIMPOINT_H_
+#define _APEX_SIMPOINT_H_
+/*
+ *  simpoint.h
+ *  Representative region selection. The program runs once on the
+ *  reference interpreter, its basic block vectors are clustered and
+ *  only one interval per cluster goes through the pipeline model.
+ */
+#include "cpu.h"
+
+/* Upper bound on config->simpoint_k */
+#define APEX_SIMPOINT_MAX_K 32
+
+/*
+ * Splits the run of filename into intervals of interval instructions,
+ * picks config->simpoint_k simulation points, times them and prints
+ * the points, their weights and the weighted CPI. With
+ * config->simpoint_full the whole program is timed too, for the error.
+ * Returns 0 on success.
+ */
+int APEX_simpoint_run(const char *filename, long interval, const APEX_Config *config);
+
+#endif
@@ -0,0 +1,381 @@
+/*
+ *  slice.c
+ *  Parallel time-sliced runs of one long program. A first pass of the
+ *  reference interpreter counts the instructions, a second one keeps
+ *  the architectural state (PC, registers, zero flag and data memory)
+ *  a warm-up ahead of each of K evenly spaced points. Worker threads
+ *  take the slices in order as the second pass hands their state over
+ *  and time each on a fresh pipeline: the warm-up instructions fill the
+ *  pipeline, cache and predictors, and only the cycles from the
+ *  retirement of the last warm-up instruction to that of the slice's
+ *  last instruction count.
+ *
+ *  For the error bound every slice but the last runs on past its end
+ *  for the next slice's warm-up length, and at every boundary those
+ *  instructions' cycles, timed fully warm, are compared with what the
+ *  next slice makes of them after its warm-up.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "slice.h"
+#include "functional.h"
+#include "memimage.h"
+
+/* Retirement counts a slice reads the clock at */
+enum
+{
+  MARK_START,       // Last warm-up instruction retired
+  MARK_CHECK,       // End of the first instructions, checked for the bound
+  MARK_END,
+  MARK_TAIL,        // End of the next slice's checked instructions
+  MARKS
+};
+
+typedef struct Slice
+{
+  long start;         // First timed instruction
+  long length;        // Instructions timed
+  long warmup;        // Instructions run before start
+  long check;         // First instructions checked for the bound
+  long tail;          // Instructions of the next slice timed past the end
+  APEX_Func *state;   // State warmup instructions before start
+  unsigned int live;  // Registers written before that state
+  long cycles;
+  long check_cycles;
+  long tail_cycles;
+  double seconds;
+  int failed;
+} Slice;
+
+typedef struct Slice_Run
+{
+  APEX_Instruction *code;
+  int size;
+  APEX_Config config;
+  Slice slice[APEX_SLICE_MAX];
+  int count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t produced;
+  int available;      // Slices whose state is ready
+  int next;           // Next slice a worker takes
+} Slice_Run;
+
+static double now_seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Runs the warm-up and the slice on a new pipeline and reads its cycles */
+static int time_slice(Slice_Run *run, Slice *slice)
+{
+  if (!slice->state)
+  {
+    return -1;
+  }
+  APEX_CPU *cpu = APEX_cpu_create(run->code, run->size, &run->config);
+  if (!cpu)
+  {
+    return -1;
+  }
+  APEX_Func *state = slice->state;
+  APEX_cpu_set_state(cpu, state->pc, state->regs, slice->live, state->data_memory,
+                     state->zero_flag);
+
+  long marks[MARKS] = {slice->warmup, slice->warmup + slice->check,
+                       slice->warmup + slice->length,
+                       slice->warmup + slice->length + slice->tail};
+  long clocks[MARKS];
+  int last = slice == &run->slice[run->count - 1];
+  int mark = 0;
+
+  double start = now_seconds();
+  while (mark < MARKS && marks[mark] <= 0)
+  {
+    clocks[mark++] = 0;
+  }
+  while (APEX_cpu_cycle(cpu))
+  {
+    while (mark < MARKS && marks[mark] <= cpu->ins_completed)
+    {
+      clocks[mark++] = cpu->clock;
+    }
+    /* The last slice also counts the cycles to drain the pipeline */
+    if (mark == MARKS && !last)
+    {
+      break;
+    }
+  }
+  while (mark < MARKS)
+  {
+    clocks[mark++] = cpu->clock;
+  }
+  slice->seconds = now_seconds() - start;
+
+  slice->cycles = clocks[MARK_END] - clocks[MARK_START];
+  slice->check_cycles = clocks[MARK_CHECK] - clocks[MARK_START];
+  slice->tail_cycles = clocks[MARK_TAIL] - clocks[MARK_END];
+  APEX_cpu_stop(cpu);
+  return 0;
+}
+
+static void *worker_main(void *arg)
+{
+  Slice_Run *run = arg;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&run->lock);
+    while (run->next < run->count && run->next >= run->available)
+    {
+      pthread_cond_wait(&run->produced, &run->lock);
+    }
+    if (run->next == run->count)
+    {
+      pthread_mutex_unlock(&run->lock);
+      return NULL;
+    }
+    Slice *slice = &run->slice[run->next++];
+    pthread_mutex_unlock(&run->lock);
+
+    slice->failed = time_slice(run, slice) != 0;
+    free(slice->state);
+    slice->state = NULL;
+  }
+}
+
+/* Hands a slice, with or without its state, over to the workers */
+static void publish(Slice_Run *run)
+{
+  pthread_mutex_lock(&run->lock);
+  run->available++;
+  pthread_cond_broadcast(&run->produced);
+  pthread_mutex_unlock(&run->lock);
+}
+
+/* Cuts total instructions into count slices, warm-ups and checks included */
+static void plan(Slice_Run *run, long total, long warmup)
+{
+  for (int i = 0; i < run->count; ++i)
+  {
+    Slice *slice = &run->slice[i];
+    slice->start = total * i / run->count;
+    slice->length = total * (i + 1) / run->count - slice->start;
+    slice->warmup = slice->start < warmup ? slice->start : warmup;
+    slice->check = 0;
+    slice->tail = 0;
+    if (i > 0)
+    {
+      slice->check = slice->warmup < slice->length ? slice->warmup : slice->length;
+      run->slice[i - 1].tail = slice->check;
+    }
+  }
+}
+
+/* Second interpreter pass from func's initial state, keeps the state ahead of every slice */
+static void produce(Slice_Run *run, APEX_Func *func)
+{
+  APEX_Retire_Record record;
+  unsigned int live = 0;
+
+  for (int i = 0; i < run->count; ++i)
+  {
+    Slice *slice = &run->slice[i];
+    long at = slice->start - slice->warmup;
+    while (func->retired < at && APEX_func_step(func, &record))
+    {
+      if (record.rd >= 0 && record.rd < 32)
+      {
+        live |= 1u << record.rd;
+      }
+    }
+    slice->state = malloc(sizeof(*slice->state));
+    if (slice->state)
+    {
+      memcpy(slice->state, func, sizeof(*func));
+    }
+    slice->live = live;
+    publish(run);
+  }
+}
+
+static void print_report(Slice_Run *run, long total, int threads, double count_time,
+                         double wall_time, long *cycles_out)
+{
+  long cycles = 0;
+  long bound = 0;
+  double busy = 0;
+
+  printf("(apex) >> %ld instructions in %d slices, warm-up %d, %d threads\n",
+         total, run->count, run->config.slice_warmup, threads);
+  printf("%-6s %-11s %-11s %-11s %-7s %-9s %-8s\n", "slice", "start", "length",
+         "cycles", "CPI", "warm-up", "host s");
+  for (int i = 0; i < run->count; ++i)
+  {
+    Slice *slice = &run->slice[i];
+    long error = 0;
+    if (i > 0)
+    {
+      error = labs(slice->check_cycles - run->slice[i - 1].tail_cycles);
+    }
+    cycles += slice->cycles;
+    bound += error;
+    busy += slice->seconds;
+    printf("%-6d %-11ld %-11ld %-11ld %-7.3f %-9ld %-8.3f\n", i, slice->start,
+           slice->length, slice->cycles,
+           slice->length ? (double)slice->cycles / slice->length : 0.0, error,
+           slice->seconds);
+  }
+  printf("Sliced cycles : %ld +/- %ld, CPI %.4f\n", cycles, bound,
+         total ? (double)cycles / total : 0.0);
+  printf("Host : %.3f s counting, %.3f s wall, %.3f s in slices\n", count_time,
+         wall_time, busy);
+  *cycles_out = cycles;
+}
+
+int APEX_slice_run(const char *filename, const APEX_Config *config)
+{
+  int size = 0;
+  APEX_Instruction *code = create_code_memory(filename, &size);
+  if (!code)
+  {
+    fprintf(stderr, "APEX_Error : Unable to load %s\n", filename);
+    return -1;
+  }
+
+  Slice_Run *run = calloc(1, sizeof(*run));
+  APEX_Func *func = malloc(sizeof(*func));
+  if (!run || !func)
+  {
+    free(run);
+    free(func);
+    free(code);
+    return -1;
+  }
+  run->code = code;
+  run->size = size;
+  run->config = *config;
+  /* The checker would start from the top of the program */
+  run->config.cosim = 0;
+
+  double start = now_seconds();
+  APEX_Retire_Record record;
+  APEX_func_init(func, code, size);
+  if (APEX_memory_image_load(config, func->data_memory) != 0)
+  {
+    free(run);
+    free(func);
+    free(code);
+    return -1;
+  }
+  while (APEX_func_step(func, &record))
+    ;
+  long total = func->retired;
+  double count_time = now_seconds() - start;
+  if (total == 0)
+  {
+    fprintf(stderr, "APEX_Error : No instructions to slice\n");
+    free(run);
+    free(func);
+    free(code);
+    return -1;
+  }
+
+  run->count = total < config->slices ? (int)total : config->slices;
+  plan(run, total, config->slice_warmup);
+
+  /* Reset for the second pass before any worker starts */
+  APEX_func_init(func, code, size);
+  if (APEX_memory_image_load(config, func->data_memory) != 0)
+  {
+    free(run);
+    free(func);
+    free(code);
+    return -1;
+  }
+
+  int threads = config->slice_threads;
+  if (threads <= 0)
+  {
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads <= 0)
+  {
+    threads = 1;
+  }
+  if (threads > run->count)
+  {
+    threads = run->count;
+  }
+
+  pthread_mutex_init(&run->lock, NULL);
+  pthread_cond_init(&run->produced, NULL);
+  pthread_t pool[APEX_SLICE_MAX];
+  int started = 0;
+  for (; started < threads; ++started)
+  {
+    if (pthread_create(&pool[started], NULL, worker_main, run) != 0)
+    {
+      break;
+    }
+  }
+  produce(run, func);
+  if (started == 0)
+  {
+    worker_main(run);
+  }
+  for (int i = 0; i < started; ++i)
+  {
+    pthread_join(pool[i], NULL);
+  }
+  pthread_cond_destroy(&run->produced);
+  pthread_mutex_destroy(&run->lock);
+  double wall_time = now_seconds() - start;
+
+  int failed = 0;
+  for (int i = 0; i < run->count; ++i)
+  {
+    failed |= run->slice[i].failed;
+  }
+  if (failed)
+  {
+    fprintf(stderr, "APEX_Error : Unable to time every slice\n");
+    free(run);
+    free(func);
+    free(code);
+    return -1;
+  }
+
+  long cycles;
+  print_report(run, total, started ? started : 1, count_time, wall_time, &cycles);
+
+  if (config->slice_full)
+  {
+    start = now_seconds();
+    APEX_CPU *cpu = APEX_cpu_create(code, size, &run->config);
+    if (cpu)
+    {
+      APEX_cpu_simulate(cpu, INT_MAX);
+      double full_time = now_seconds() - start;
+      printf("Full : %d cycles over %d instructions, error %.2f%%, %.3f s, "
+             "%.2fx the sliced wall time\n",
+             cpu->clock, cpu->ins_completed,
+             cpu->clock ? 100.0 * (cycles - cpu->clock) / cpu->clock : 0.0,
+             full_time, wall_time > 0 ? full_time / wall_time : 0.0);
+      APEX_cpu_stop(cpu);
+    }
+  }
+
+  free(run);
+  free(func);
+  free(code);
+  return 0;
+}
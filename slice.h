@@ -0,0 +1,23 @@
+#ifndef _APEX_SLICE_H_
+#define _APEX_SLICE_H_
+/*
+ *  slice.h
+ *  Time-sliced runs. The reference interpreter cuts one long program
+ *  into slices at evenly spaced points and each slice is timed on the
+ *  pipeline on its own host thread, from the state it starts in.
+ */
+#include "cpu.h"
+
+/* Upper bound on config->slices and config->slice_threads */
+#define APEX_SLICE_MAX 256
+
+/*
+ * Times filename in config->slices slices, each warmed up on the
+ * config->slice_warmup instructions before it, and prints the cycles
+ * of every slice, their sum with its warm-up error bound and the host
+ * time. With config->slice_full the whole program is timed too, for
+ * the error. Returns 0 on success.
+ */
+int APEX_slice_run(const char *filename, const APEX_Config *config);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ *  smt.c
+ *  Runs several hardware threads on one APEX core. Fetch picks one
+ *  thread each cycle, round robin or by ICOUNT, and everything behind
+ *  it is shared: the ROB, the LSQ, the functional units, the physical
+ *  registers and the data cache, whose lines are tagged by thread.
+ *  Each thread has its own registers, zero flag and data memory.
+ *
+ *  Every program is then run alone on the same core, which gives the
+ *  SMT gain, and its final state is checked against the reference
+ *  interpreter.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "functional.h"
+#include "memimage.h"
+#include "smt.h"
+
+/* Cycles without a retirement after which the core is taken to be stuck */
+#define APEX_SMT_STALL_LIMIT 10000
+
+typedef struct SMT_Thread
+{
+  const char *program;
+  APEX_Instruction *code;
+  int size;
+  int alone_cycles;
+  int alone_retired;
+  const char *check;  // Reference interpreter verdict on the final state
+  char mismatch[32];
+} SMT_Thread;
+
+/* Steps cpu to the end or the cycle limit, returns -1 if it got stuck */
+static int run_core(APEX_CPU *cpu, int cycles)
+{
+  int retired = cpu->ins_completed;
+  int progress = cpu->clock;
+
+  cpu->no_cycles = cycles;
+  while (cpu->clock != cycles && APEX_cpu_cycle(cpu))
+  {
+    if (cpu->ins_completed != retired)
+    {
+      retired = cpu->ins_completed;
+      progress = cpu->clock;
+    }
+    else if (cpu->clock - progress > APEX_SMT_STALL_LIMIT)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Compares a finished thread's registers and memory with the
+ * interpreter's. Returns -1 if the interpreter cannot start.
+ */
+static int check_thread(SMT_Thread *thread, APEX_Func *func, const int *regs,
+                        const int *memory, const APEX_Config *config)
+{
+  APEX_Retire_Record record;
+
+  APEX_func_init(func, thread->code, thread->size);
+  if (APEX_memory_image_load(config, func->data_memory) != 0)
+  {
+    return -1;
+  }
+  while (APEX_func_step(func, &record))
+    ;
+  thread->check = "ok";
+  for (int r = 0; r < APEX_THREAD_REGS; ++r)
+  {
+    if (regs[r] != func->regs[r])
+    {
+      snprintf(thread->mismatch, sizeof(thread->mismatch), "R%d", r);
+      thread->check = thread->mismatch;
+      return 0;
+    }
+  }
+  for (int i = 0; i < APEX_DATA_MEMORY_WORDS; ++i)
+  {
+    if (memory[i] != func->data_memory[i])
+    {
+      snprintf(thread->mismatch, sizeof(thread->mismatch), "MEM[%d]", i);
+      thread->check = thread->mismatch;
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static void print_report(APEX_CPU *cpu, SMT_Thread *threads, int count, int cycles)
+{
+  const APEX_Config *config = &cpu->config;
+  long retired = 0;
+  long alone = 0;
+  double weighted = 0;
+
+  printf("(apex) >> %d threads, %s fetch, ROB %d", count,
+         config->smt_fetch == APEX_SMT_FETCH_ICOUNT ? "ICOUNT" : "round robin",
+         config->rob_size);
+  if (config->smt_rob)
+  {
+    printf(" (%d per thread)", config->smt_rob);
+  }
+  printf(", 24 physical registers");
+  if (config->smt_prf)
+  {
+    printf(" (%d per thread)", config->smt_prf);
+  }
+  printf("\n");
+  printf("%-6s %-20s %-9s %-9s %-6s %-9s %-9s %-6s %-8s\n", "thread", "program",
+         "retired", "finished", "IPC", "alone", "cycles", "IPC", "state");
+  for (int t = 0; t < count; ++t)
+  {
+    SMT_Thread *thread = &threads[t];
+    APEX_Context *context = &cpu->context[t];
+    double ipc = context->last_retire ? (double)context->retired / context->last_retire : 0.0;
+    double alone_ipc = thread->alone_cycles
+                           ? (double)thread->alone_retired / thread->alone_cycles
+                           : 0.0;
+    printf("%-6d %-20s %-9ld %-9d %-6.3f %-9d %-9d %-6.3f %-8s\n", t, thread->program,
+           context->retired, context->last_retire, ipc, thread->alone_retired,
+           thread->alone_cycles, alone_ipc, thread->check);
+    retired += context->retired;
+    alone += thread->alone_cycles;
+    weighted += alone_ipc > 0 ? ipc / alone_ipc : 0.0;
+  }
+  printf("Core : %d cycles, %ld retired, IPC %.3f\n", cpu->clock, retired,
+         cpu->clock ? (double)retired / cpu->clock : 0.0);
+  printf("SMT : weighted speedup %.3f, %ld cycles alone back to back, throughput gain %.3fx\n",
+         weighted, alone, cpu->clock ? (double)alone / cpu->clock : 0.0);
+  if (cpu->clock == cycles)
+  {
+    printf("Stopped at the cycle limit, unfinished threads are not checked\n");
+  }
+}
+
+static void free_threads(SMT_Thread *threads, int count)
+{
+  for (int t = 0; t < count; ++t)
+  {
+    free(threads[t].code);
+  }
+}
+
+int APEX_smt_run(const char *const *programs, int program_count, int threads,
+                 int cycles, const APEX_Config *config)
+{
+  if (threads < 1 || threads > APEX_MAX_THREADS || program_count < 1)
+  {
+    fprintf(stderr, "APEX_Error : Need 1 to %d threads and a program\n", APEX_MAX_THREADS);
+    return -1;
+  }
+  if (config->cosim)
+  {
+    fprintf(stderr, "APEX_Error : cosim follows a single instruction stream\n");
+    return -1;
+  }
+  if (config->uop_cache || config->loop_buffer)
+  {
+    fprintf(stderr, "APEX_Error : The uop cache and loop buffer hold one thread's code\n");
+    return -1;
+  }
+  if (config->smt_prf && config->smt_prf < 4)
+  {
+    /* A fused pair can need four entries at once */
+    fprintf(stderr, "APEX_Error : smt_prf must be 0 or at least 4\n");
+    return -1;
+  }
+
+  SMT_Thread thread[APEX_MAX_THREADS];
+  memset(thread, 0, sizeof(thread));
+  for (int t = 0; t < threads; ++t)
+  {
+    thread[t].program = programs[t < program_count ? t : program_count - 1];
+    thread[t].check = "-";
+    thread[t].code = create_code_memory(thread[t].program, &thread[t].size);
+    if (!thread[t].code)
+    {
+      fprintf(stderr, "APEX_Error : Unable to load %s\n", thread[t].program);
+      free_threads(thread, t);
+      return -1;
+    }
+  }
+
+  APEX_CPU *cpu = APEX_cpu_create(thread[0].code, thread[0].size, config);
+  APEX_Func *func = malloc(sizeof(*func));
+  if (!cpu || !func)
+  {
+    if (cpu)
+    {
+      APEX_cpu_stop(cpu);
+    }
+    free(func);
+    free_threads(thread, threads);
+    return -1;
+  }
+  for (int t = 1; t < threads; ++t)
+  {
+    if (APEX_cpu_add_thread(cpu, thread[t].code, thread[t].size) < 0)
+    {
+      fprintf(stderr, "APEX_Error : Unable to add thread %d\n", t);
+      APEX_cpu_stop(cpu);
+      free(func);
+      free_threads(thread, threads);
+      return -1;
+    }
+  }
+
+  if (run_core(cpu, cycles) != 0)
+  {
+    fprintf(stderr, "APEX_Error : No instruction retired in %d cycles, the threads "
+                    "write more registers than there are physical ones\n",
+            APEX_SMT_STALL_LIMIT);
+    APEX_cpu_stop(cpu);
+    free(func);
+    free_threads(thread, threads);
+    return -1;
+  }
+
+  for (int t = 0; t < threads; ++t)
+  {
+    APEX_CPU *alone = APEX_cpu_create(thread[t].code, thread[t].size, config);
+    if (!alone)
+    {
+      continue;
+    }
+    run_core(alone, cycles);
+    thread[t].alone_cycles = alone->clock;
+    thread[t].alone_retired = alone->ins_completed;
+    /* A thread the limit cut short has no final state to check */
+    if (alone->clock < cycles && cpu->context[t].retired == alone->ins_completed &&
+        check_thread(&thread[t], func, &cpu->regs[t * APEX_THREAD_REGS],
+                     t ? cpu->context[t].memory : cpu->memory, config) != 0)
+    {
+      APEX_cpu_stop(alone);
+      APEX_cpu_stop(cpu);
+      free(func);
+      free_threads(thread, threads);
+      return -1;
+    }
+    APEX_cpu_stop(alone);
+  }
+  print_report(cpu, thread, threads, cycles);
+
+  APEX_cpu_stop(cpu);
+  free(func);
+  free_threads(thread, threads);
+  return 0;
+}
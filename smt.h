@@ -0,0 +1,22 @@
+#ifndef _APEX_SMT_H_
+#define _APEX_SMT_H_
+/*
+ *  smt.h
+ *  Simultaneous multithreading. One out-of-order core holds several
+ *  hardware threads, each with its own program, pc, registers and data
+ *  memory, sharing fetch, the ROB, the LSQ, the functional units and
+ *  the physical registers.
+ */
+#include "cpu.h"
+
+/*
+ * Runs threads hardware threads on one core for at most cycles cycles
+ * and prints per thread and core throughput, then runs each program
+ * alone on the same core for the SMT gain. Thread i runs programs[i],
+ * or the last program when fewer programs than threads are given.
+ * Returns 0 on success.
+ */
+int APEX_smt_run(const char *const *programs, int program_count, int threads,
+                 int cycles, const APEX_Config *config);
+
+#endif
@@ -0,0 +1,18 @@
+; Taken and not taken BZ and BNZ, nested loops and a JUMP
+        MOVC R1, #3             ; outer trips
+        MOVC R5, #0
+outer:  MOVC R2, #4             ; inner trips
+inner:  ADD R5, R5, R2
+        SUBL R2, R2, #1
+        BNZ inner
+        SUB R6, R5, R5
+        BZ skip                 ; always taken
+        MOVC R5, #999
+skip:   SUBL R1, R1, #1
+        BZ done
+        MOVC R7, #outer
+        JUMP R7, #0
+done:   ADDL R8, R5, #0
+        BNZ end                 ; R8 is not zero
+        MOVC R8, #777
+end:    HALT
@@ -0,0 +1,17 @@
+; options: fusion=7
+; MOVC+ALU, address+memory and ALU+branch pairs round a loop
+        MOVC R7, #6             ; trips
+        MOVC R8, #100
+loop:   MOVC R1, #2
+        ADD R2, R1, R7          ; MOVC+ALU
+        ADDL R3, R8, #1
+        STORE R2, R3, #0        ; address+memory
+        ADDL R4, R8, #1
+        LOAD R5, R4, #0         ; address+memory
+        ADD R6, R6, R5
+        ADDL R8, R8, #2
+        SUBL R7, R7, #1
+        BNZ loop                ; ALU+branch
+        MOVC R9, #4
+        SUB R10, R9, R6         ; MOVC+ALU
+        HALT
@@ -0,0 +1,19 @@
+; options: eliminate=1
+; Zero idioms and moves renamed without an FU, across a loop so their
+; shared entries are released and reused
+        MOVC R7, #5
+        MOVC R1, #9
+loop:   MOVC R2, #0             ; zero idiom
+        SUB R3, R1, R1          ; zero idiom
+        ADDL R4, R1, #0         ; move
+        SUBL R5, R4, #0         ; move of a move
+        ADD R6, R5, R2
+        ADDL R1, R6, #1
+        ADDL R5, R5, #0         ; move onto itself
+        MUL R8, R1, R5
+        ADD R9, R8, R3
+        SUBL R7, R7, #1
+        BNZ loop
+        MOVC R10, #0
+        ADDL R11, R10, #0
+        HALT
@@ -0,0 +1,17 @@
+; LDR and STR with register offsets, and an LDR destination read at once
+        MOVC R11, #87
+        MOVC R9, #1
+        MOVC R8, #2
+        LDR R8, R11, R9         ; R8 = MEM[88], never stored, 0
+        ADDL R1, R8, #0
+        MOVC R2, #40
+        MOVC R3, #5
+        STR R2, R3, R9          ; MEM[6] = 40
+        LDR R4, R3, R9          ; R4 = 40, from the store
+        ADD R5, R4, R4
+        STR R5, R4, R3          ; MEM[45] = 80
+        MOVC R6, #45
+        LOAD R7, R6, #0         ; R7 = 80
+        STORE R7, R6, #1        ; MEM[46] = 80
+        LDR R10, R6, R9         ; R10 = 80
+        HALT
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs every program here under cosim=1, with the default configuration
+# and with ports=4, and fails if any run leaves the reference model.
+# A program's first "; options:" comment adds options to both runs.
+#
+#   sh tests/run.sh [apex_sim]
+
+SIM=${1:-./apex_sim}
+DIR=$(dirname "$0")
+CYCLES=100000
+failed=0
+
+for program in "$DIR"/*.asm; do
+  options=$(sed -n 's/^; options: *//p' "$program" | head -n 1)
+  for config in "" "ports=4"; do
+    out=$("$SIM" "$program" simulate $CYCLES cosim=1 $config $options 2>&1)
+    if echo "$out" | grep -q "match the reference model"; then
+      echo "ok   $(basename "$program") $config $options"
+    else
+      echo "FAIL $(basename "$program") $config $options"
+      echo "$out" | grep -E "APEX_COSIM|APEX_Error" | head -n 5
+      failed=1
+    fi
+  done
+done
+exit $failed
@@ -0,0 +1,12 @@
+; Sources nothing wrote read the architectural register file
+        MOVC R2, #3
+        MUL R1, R2, R5          ; R5 never written
+        ADD R3, R6, R2          ; R6 never written
+        SUB R4, R7, R7
+        STORE R12, R2, #10      ; R12 never written
+        LOAD R13, R2, #10
+        ADDL R14, R15, #9       ; R15 never written
+        SUBL R0, R14, #1
+        STR R14, R2, R9         ; R9 never written, MEM[3] = 9
+        LDR R1, R2, R9
+        HALT
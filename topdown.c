@@ -0,0 +1,133 @@
+/*
+ *  topdown.c
+ *  CPI stack report of the top-down slot accounting, see topdown.h
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "topdown.h"
+
+/* Levels of the hierarchy, each a range of leaves */
+typedef struct Topdown_Node
+{
+  const char *name;
+  int depth;
+  int first;
+  int last;
+} Topdown_Node;
+
+static const Topdown_Node nodes[] = {
+    {"Retiring", 0, APEX_TD_RETIRING, APEX_TD_RETIRING},
+    {"Bad speculation", 0, APEX_TD_BAD_BRANCH, APEX_TD_BAD_REPLAY},
+    {"Branch mispredict", 1, APEX_TD_BAD_BRANCH, APEX_TD_BAD_BRANCH},
+    {"Memory order", 1, APEX_TD_BAD_REPLAY, APEX_TD_BAD_REPLAY},
+    {"Front end bound", 0, APEX_TD_FRONT_FETCH, APEX_TD_FRONT_FLUSH},
+    {"Fetch stall", 1, APEX_TD_FRONT_FETCH, APEX_TD_FRONT_FETCH},
+    {"Flush refill", 1, APEX_TD_FRONT_FLUSH, APEX_TD_FRONT_FLUSH},
+    {"Back end bound", 0, APEX_TD_CORE_DEPENDENCY, APEX_TD_MEM_STORE},
+    {"Core", 1, APEX_TD_CORE_DEPENDENCY, APEX_TD_CORE_RESOURCES},
+    {"Dependency", 2, APEX_TD_CORE_DEPENDENCY, APEX_TD_CORE_DEPENDENCY},
+    {"FU busy", 2, APEX_TD_CORE_FU, APEX_TD_CORE_FU},
+    {"Resources", 2, APEX_TD_CORE_RESOURCES, APEX_TD_CORE_RESOURCES},
+    {"Memory", 1, APEX_TD_MEM_LOAD, APEX_TD_MEM_STORE},
+    {"Load", 2, APEX_TD_MEM_LOAD, APEX_TD_MEM_LOAD},
+    {"Store miss", 2, APEX_TD_MEM_STORE, APEX_TD_MEM_STORE},
+};
+
+static long node_slots(const Topdown_Node *node, const long *slots)
+{
+  long sum = 0;
+  for (int i = node->first; i <= node->last; ++i)
+  {
+    sum += slots[i];
+  }
+  return sum;
+}
+
+void APEX_topdown_close_region(APEX_Topdown *topdown, long retired, long cycles)
+{
+  if (topdown->region_count == topdown->region_capacity)
+  {
+    int capacity = topdown->region_capacity ? 2 * topdown->region_capacity : 64;
+    APEX_Topdown_Region *regions =
+        realloc(topdown->regions, capacity * sizeof(*regions));
+    if (!regions)
+    {
+      return;
+    }
+    topdown->regions = regions;
+    topdown->region_capacity = capacity;
+  }
+  APEX_Topdown_Region *region = &topdown->regions[topdown->region_count++];
+  region->retired = retired;
+  region->cycles = cycles;
+  memcpy(region->slots, topdown->slots, sizeof(region->slots));
+}
+
+static void print_regions(APEX_Topdown *topdown, FILE *out)
+{
+  APEX_Topdown_Region previous;
+  memset(&previous, 0, sizeof(previous));
+
+  fprintf(out, "%-7s %-11s %-9s %-7s %9s %9s %9s %9s %9s\n", "region", "first",
+          "cycles", "CPI", "retiring", "bad spec", "front end", "core", "memory");
+  for (int r = 0; r < topdown->region_count; ++r)
+  {
+    APEX_Topdown_Region *region = &topdown->regions[r];
+    long delta[APEX_TD_SLOTS];
+    long retired = region->retired - previous.retired;
+    long cycles = region->cycles - previous.cycles;
+    for (int i = 0; i < APEX_TD_SLOTS; ++i)
+    {
+      delta[i] = region->slots[i] - previous.slots[i];
+    }
+    /* Top level nodes, then the core and memory halves of the back end */
+    const int shown[] = {0, 1, 4, 8, 12};
+    fprintf(out, "%-7d %-11ld %-9ld %-7.3f", r, previous.retired, cycles,
+            retired ? (double)cycles / retired : 0.0);
+    for (int n = 0; n < 5; ++n)
+    {
+      long slots = node_slots(&nodes[shown[n]], delta);
+      fprintf(out, " %8.1f%%", cycles ? 100.0 * slots / cycles : 0.0);
+    }
+    fprintf(out, "\n");
+    previous = *region;
+  }
+}
+
+void APEX_topdown_report(APEX_Topdown *topdown, long retired, long cycles, FILE *out)
+{
+  fprintf(out, "(apex) >> Top-down, %ld dispatch slots, CPI %.3f over %ld instructions\n",
+          cycles, retired ? (double)cycles / retired : 0.0, retired);
+  fprintf(out, "%-24s %-7s %-7s\n", "", "CPI", "slots");
+  for (size_t n = 0; n < sizeof(nodes) / sizeof(nodes[0]); ++n)
+  {
+    long slots = node_slots(&nodes[n], topdown->slots);
+    fprintf(out, "%*s%-*s %-7.3f %5.1f%%\n", 2 * nodes[n].depth, "",
+            24 - 2 * nodes[n].depth, nodes[n].name,
+            retired ? (double)slots / retired : 0.0,
+            cycles ? 100.0 * slots / cycles : 0.0);
+  }
+  if (topdown->in_flight)
+  {
+    fprintf(out, "%-24s %-7.3f %5.1f%%\n", "Still in flight",
+            retired ? (double)topdown->in_flight / retired : 0.0,
+            cycles ? 100.0 * topdown->in_flight / cycles : 0.0);
+  }
+
+  if (topdown->region_size)
+  {
+    if (topdown->region_count == 0 ||
+        topdown->regions[topdown->region_count - 1].cycles != cycles)
+    {
+      APEX_topdown_close_region(topdown, retired, cycles);
+    }
+    print_regions(topdown, out);
+  }
+}
+
+void APEX_topdown_free(APEX_Topdown *topdown)
+{
+  free(topdown->regions);
+  topdown->regions = NULL;
+}
@@ -0,0 +1,57 @@
+#ifndef _APEX_TOPDOWN_H_
+#define _APEX_TOPDOWN_H_
+/*
+ *  topdown.h
+ *  Top-down accounting of the dispatch slot. Every cycle the one slot
+ *  decode dispatches into the ROB is put in one leaf of the hierarchy
+ *  below, and dispatched slots settle as retiring or bad speculation
+ *  once their instruction retires or is squashed.
+ */
+#include <stdio.h>
+
+/* Leaves of the hierarchy, in report order */
+enum
+{
+  APEX_TD_RETIRING,
+  APEX_TD_BAD_BRANCH,      // Squashed by a mispredicted branch
+  APEX_TD_BAD_REPLAY,      // Squashed by a memory order violation
+  APEX_TD_FRONT_FETCH,     // Fetch delivered nothing
+  APEX_TD_FRONT_FLUSH,     // Front end refilling after a squash
+  APEX_TD_CORE_DEPENDENCY, // Waiting on a result other than a load's
+  APEX_TD_CORE_FU,         // Functional unit busy
+  APEX_TD_CORE_RESOURCES,  // ROB, physical registers or checkpoints full
+  APEX_TD_MEM_LOAD,        // Waiting on a load, or a load holding the ROB
+  APEX_TD_MEM_STORE,       // Core frozen on a store miss
+  APEX_TD_SLOTS
+};
+
+/* Counters at the end of one region */
+typedef struct APEX_Topdown_Region
+{
+  long retired;
+  long cycles;
+  long slots[APEX_TD_SLOTS];
+} APEX_Topdown_Region;
+
+typedef struct APEX_Topdown
+{
+  long slots[APEX_TD_SLOTS];
+  long in_flight;          // Dispatched slots not settled yet
+  int refill;              // A squash emptied the front end, nothing delivered since
+
+  long region_size;        // Retired instructions per region, 0 for none
+  long next_region;        // Retirement count closing the current region
+  APEX_Topdown_Region *regions;
+  int region_count;
+  int region_capacity;
+} APEX_Topdown;
+
+/* Records the counters at the end of a region */
+void APEX_topdown_close_region(APEX_Topdown *topdown, long retired, long cycles);
+
+/* Prints the CPI stack of the run and, with regions, one line per region */
+void APEX_topdown_report(APEX_Topdown *topdown, long retired, long cycles, FILE *out);
+
+void APEX_topdown_free(APEX_Topdown *topdown);
+
+#endif
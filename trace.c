@@ -0,0 +1,415 @@
+/*
+ *  trace.c
+ *  Streaming reader and writer of the chunked binary trace format.
+ *
+ *  File   : "APEXTRC1"
+ *  Chunk  : u32 record count, u32 payload bytes (little endian), payload
+ *  Record : flags byte
+ *             0x1  pc is not the previous pc + 4, zigzag varint delta follows
+ *             0x2  memory access, zigzag varint delta to the previous one
+ *             0x4  branch taken
+ *           op byte, rd rs1 rs2 rs3 bytes stored plus one, zigzag varint imm
+ *
+ *  Delta state restarts with every chunk so each chunk decodes alone.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "functional.h"
+#include "memimage.h"
+#include "trace.h"
+
+#define TRACE_MAGIC "APEXTRC1"
+#define TRACE_MAGIC_SIZE 8
+
+#define FLAG_JUMP 0x1
+#define FLAG_MEM 0x2
+#define FLAG_TAKEN 0x4
+
+/* Worst case encoded size of one record */
+#define RECORD_MAX_BYTES (1 + 5 + 1 + 4 + 5 + 5)
+
+typedef struct Trace_State
+{
+  int next_pc;      // Expected pc of the next record
+  int mem_address;  // Last memory address seen
+} Trace_State;
+
+struct APEX_Trace_Writer
+{
+  FILE *fp;
+  unsigned char buffer[APEX_TRACE_CHUNK_RECORDS * RECORD_MAX_BYTES];
+  size_t bytes;
+  int records;
+  long total;
+  Trace_State state;
+};
+
+struct APEX_Trace_Reader
+{
+  FILE *fp;
+  unsigned char *buffer;
+  size_t capacity;
+  size_t bytes;
+  size_t offset;
+  int records;      // Records left in the loaded chunk
+  int eof;
+  long limit;       // Records left in the window, -1 when unbounded
+  Trace_State state;
+};
+
+static void reset_state(Trace_State *state)
+{
+  state->next_pc = 4000;
+  state->mem_address = 0;
+}
+
+static unsigned int zigzag(int value)
+{
+  return ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+}
+
+static int unzigzag(unsigned int value)
+{
+  return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+static unsigned char *put_varint(unsigned char *out, unsigned int value)
+{
+  while (value >= 0x80)
+  {
+    *out++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (unsigned char)value;
+  return out;
+}
+
+static void put_u32(unsigned char *out, unsigned int value)
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    out[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static unsigned int get_u32(const unsigned char *in)
+{
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int)in[3] << 24);
+}
+
+APEX_Trace_Writer *APEX_trace_writer_open(const char *path)
+{
+  APEX_Trace_Writer *writer = calloc(1, sizeof(*writer));
+  if (!writer)
+  {
+    return NULL;
+  }
+  writer->fp = fopen(path, "wb");
+  if (!writer->fp)
+  {
+    fprintf(stderr, "APEX_Error : Unable to create trace %s\n", path);
+    free(writer);
+    return NULL;
+  }
+  fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, writer->fp);
+  reset_state(&writer->state);
+  return writer;
+}
+
+static int flush_chunk(APEX_Trace_Writer *writer)
+{
+  unsigned char header[8];
+  if (writer->records == 0)
+  {
+    return 0;
+  }
+  put_u32(header, writer->records);
+  put_u32(header + 4, writer->bytes);
+  if (fwrite(header, 1, sizeof(header), writer->fp) != sizeof(header) ||
+      fwrite(writer->buffer, 1, writer->bytes, writer->fp) != writer->bytes)
+  {
+    return -1;
+  }
+  writer->records = 0;
+  writer->bytes = 0;
+  reset_state(&writer->state);
+  return 0;
+}
+
+int APEX_trace_writer_put(APEX_Trace_Writer *writer, const APEX_Trace_Record *record)
+{
+  unsigned char *start = writer->buffer + writer->bytes;
+  unsigned char *out = start + 1;
+  Trace_State *state = &writer->state;
+  unsigned char flags = 0;
+
+  if (record->pc != state->next_pc)
+  {
+    flags |= FLAG_JUMP;
+    out = put_varint(out, zigzag(record->pc - state->next_pc));
+  }
+  if (record->mem_address >= 0)
+  {
+    flags |= FLAG_MEM;
+    out = put_varint(out, zigzag(record->mem_address - state->mem_address));
+    state->mem_address = record->mem_address;
+  }
+  if (record->taken)
+  {
+    flags |= FLAG_TAKEN;
+  }
+  *start = flags;
+  *out++ = (unsigned char)record->op;
+  *out++ = (unsigned char)(record->rd + 1);
+  *out++ = (unsigned char)(record->rs1 + 1);
+  *out++ = (unsigned char)(record->rs2 + 1);
+  *out++ = (unsigned char)(record->rs3 + 1);
+  out = put_varint(out, zigzag(record->imm));
+  state->next_pc = record->pc + 4;
+
+  writer->bytes = out - writer->buffer;
+  writer->total++;
+  if (++writer->records == APEX_TRACE_CHUNK_RECORDS)
+  {
+    return flush_chunk(writer);
+  }
+  return 0;
+}
+
+long APEX_trace_writer_close(APEX_Trace_Writer *writer)
+{
+  long total = writer->total;
+  if (flush_chunk(writer) != 0 || fclose(writer->fp) != 0)
+  {
+    total = -1;
+  }
+  free(writer);
+  return total;
+}
+
+APEX_Trace_Reader *APEX_trace_reader_open(const char *path)
+{
+  char magic[TRACE_MAGIC_SIZE];
+  APEX_Trace_Reader *reader = calloc(1, sizeof(*reader));
+  if (!reader)
+  {
+    return NULL;
+  }
+  reader->fp = fopen(path, "rb");
+  if (!reader->fp)
+  {
+    fprintf(stderr, "APEX_Error : Unable to open trace %s\n", path);
+    free(reader);
+    return NULL;
+  }
+  if (fread(magic, 1, sizeof(magic), reader->fp) != sizeof(magic) ||
+      memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+  {
+    fprintf(stderr, "APEX_Error : %s is not an APEX trace\n", path);
+    fclose(reader->fp);
+    free(reader);
+    return NULL;
+  }
+  reader->limit = -1;
+  return reader;
+}
+
+static int load_chunk(APEX_Trace_Reader *reader)
+{
+  unsigned char header[8];
+  if (fread(header, 1, sizeof(header), reader->fp) != sizeof(header))
+  {
+    return 0;
+  }
+  unsigned int records = get_u32(header);
+  unsigned int bytes = get_u32(header + 4);
+  if (records == 0 || records > APEX_TRACE_CHUNK_RECORDS ||
+      bytes > (size_t)records * RECORD_MAX_BYTES)
+  {
+    fprintf(stderr, "APEX_Error : Corrupt trace chunk\n");
+    return 0;
+  }
+  if (bytes > reader->capacity)
+  {
+    unsigned char *buffer = realloc(reader->buffer, bytes);
+    if (!buffer)
+    {
+      return 0;
+    }
+    reader->buffer = buffer;
+    reader->capacity = bytes;
+  }
+  if (fread(reader->buffer, 1, bytes, reader->fp) != bytes)
+  {
+    fprintf(stderr, "APEX_Error : Truncated trace chunk\n");
+    return 0;
+  }
+  reader->records = records;
+  reader->bytes = bytes;
+  reader->offset = 0;
+  reset_state(&reader->state);
+  return 1;
+}
+
+int APEX_trace_reader_more(APEX_Trace_Reader *reader)
+{
+  if (reader->limit == 0)
+  {
+    return 0;
+  }
+  if (reader->records == 0 && !reader->eof && !load_chunk(reader))
+  {
+    reader->eof = 1;
+  }
+  return reader->records > 0;
+}
+
+static int get_byte(APEX_Trace_Reader *reader)
+{
+  if (reader->offset >= reader->bytes)
+  {
+    return -1;
+  }
+  return reader->buffer[reader->offset++];
+}
+
+static int get_varint(APEX_Trace_Reader *reader)
+{
+  unsigned int value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    int byte = get_byte(reader);
+    if (byte < 0)
+    {
+      break;
+    }
+    value |= (unsigned int)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+    {
+      break;
+    }
+  }
+  return unzigzag(value);
+}
+
+int APEX_trace_reader_next(APEX_Trace_Reader *reader, APEX_Trace_Record *record)
+{
+  if (!APEX_trace_reader_more(reader))
+  {
+    return 0;
+  }
+  Trace_State *state = &reader->state;
+  int flags = get_byte(reader);
+
+  record->pc = state->next_pc;
+  if (flags & FLAG_JUMP)
+  {
+    record->pc += get_varint(reader);
+  }
+  record->mem_address = -1;
+  if (flags & FLAG_MEM)
+  {
+    state->mem_address += get_varint(reader);
+    record->mem_address = state->mem_address;
+  }
+  record->taken = (flags & FLAG_TAKEN) != 0;
+  record->op = get_byte(reader);
+  record->rd = get_byte(reader) - 1;
+  record->rs1 = get_byte(reader) - 1;
+  record->rs2 = get_byte(reader) - 1;
+  record->rs3 = get_byte(reader) - 1;
+  record->imm = get_varint(reader);
+  state->next_pc = record->pc + 4;
+
+  reader->records--;
+  if (reader->limit > 0)
+  {
+    reader->limit--;
+  }
+  return 1;
+}
+
+int APEX_trace_reader_window(APEX_Trace_Reader *reader, long skip, long count)
+{
+  APEX_Trace_Record record;
+  reader->limit = -1;
+  for (long i = 0; i < skip; ++i)
+  {
+    if (!APEX_trace_reader_next(reader, &record))
+    {
+      return 0;
+    }
+  }
+  reader->limit = count > 0 ? count : -1;
+  return APEX_trace_reader_more(reader);
+}
+
+void APEX_trace_reader_close(APEX_Trace_Reader *reader)
+{
+  fclose(reader->fp);
+  free(reader->buffer);
+  free(reader);
+}
+
+long APEX_trace_record_program(const APEX_Instruction *code_memory,
+                               int code_memory_size, const char *path,
+                               long max_records, const APEX_Config *config)
+{
+  APEX_Func func;
+  APEX_Retire_Record retired;
+
+  APEX_func_init(&func, code_memory, code_memory_size);
+  if (APEX_memory_image_load(config, func.data_memory) != 0)
+  {
+    return -1;
+  }
+  APEX_Trace_Writer *writer = APEX_trace_writer_open(path);
+  if (!writer)
+  {
+    return -1;
+  }
+  while (max_records <= 0 || writer->total < max_records)
+  {
+    int index = get_code_index(func.pc);
+    if (func.halted || index < 0 || index >= code_memory_size)
+    {
+      break;
+    }
+    const APEX_Instruction *ins = &code_memory[index];
+    APEX_Trace_Record record;
+    record.pc = func.pc;
+    record.op = ins->op;
+    record.rd = ins->rd;
+    record.rs1 = ins->rs1;
+    record.rs2 = ins->rs2;
+    record.rs3 = ins->rs3;
+    record.imm = ins->imm;
+
+    /* Load addresses come from the registers before the step */
+    record.mem_address = -1;
+    if (ins->op == APEX_OP_LOAD)
+    {
+      record.mem_address = func.regs[ins->rs1] + ins->imm;
+    }
+    else if (ins->op == APEX_OP_LDR)
+    {
+      record.mem_address = func.regs[ins->rs1] + func.regs[ins->rs2];
+    }
+
+    APEX_func_step(&func, &retired);
+    if (retired.mem_address >= 0)
+    {
+      record.mem_address = retired.mem_address;
+    }
+    record.taken = func.pc != record.pc + 4 && !func.halted;
+
+    if (APEX_trace_writer_put(writer, &record) != 0)
+    {
+      APEX_trace_writer_close(writer);
+      return -1;
+    }
+  }
+  return APEX_trace_writer_close(writer);
+}
@@ -0,0 +1,66 @@
+#ifndef _APEX_TRACE_H_
+#define _APEX_TRACE_H_
+/*
+ *  trace.h
+ *  Recorded dynamic instruction streams. A trace is written once from
+ *  the reference interpreter and can then drive the pipeline timing
+ *  model any number of times in place of code memory.
+ *
+ *  The file is a header followed by chunks of at most
+ *  APEX_TRACE_CHUNK_RECORDS records. Records are delta and varint
+ *  encoded, so a reader only ever holds one chunk in memory.
+ */
+#include "cpu.h"
+
+#define APEX_TRACE_CHUNK_RECORDS 4096
+
+/* One dynamic instruction */
+typedef struct APEX_Trace_Record
+{
+  int pc;
+  int op;           // APEX_Opcode
+  int rd;
+  int rs1;
+  int rs2;
+  int rs3;
+  int imm;
+  int mem_address;  // Word loaded or stored, -1 for other instructions
+  int taken;        // Branch outcome, the next record starts at the target
+} APEX_Trace_Record;
+
+typedef struct APEX_Trace_Writer APEX_Trace_Writer;
+typedef struct APEX_Trace_Reader APEX_Trace_Reader;
+
+APEX_Trace_Writer *APEX_trace_writer_open(const char *path);
+
+int APEX_trace_writer_put(APEX_Trace_Writer *writer, const APEX_Trace_Record *record);
+
+/* Flushes the last chunk, returns the number of records written or -1 */
+long APEX_trace_writer_close(APEX_Trace_Writer *writer);
+
+APEX_Trace_Reader *APEX_trace_reader_open(const char *path);
+
+/* Returns 1 while a record is left, loading the next chunk if needed */
+int APEX_trace_reader_more(APEX_Trace_Reader *reader);
+
+int APEX_trace_reader_next(APEX_Trace_Reader *reader, APEX_Trace_Record *record);
+
+/*
+ * Skips the next skip records and ends the stream count records later,
+ * count <= 0 leaves it unbounded. Returns 0 if the trace ran out.
+ */
+int APEX_trace_reader_window(APEX_Trace_Reader *reader, long skip, long count);
+
+void APEX_trace_reader_close(APEX_Trace_Reader *reader);
+
+/*
+ * Runs a program on the reference interpreter, data memory starting
+ * from config->mem_image, and writes its dynamic instruction stream,
+ * stopping after max_records when it is positive. Returns the number
+ * of records written or -1.
+ */
+long APEX_trace_record_program(const APEX_Instruction *code_memory,
+                               int code_memory_size, const char *path,
+                               long max_records, const APEX_Config *config);
+
+#endif